@@ -35,5 +35,7 @@ setup(	name		= "spidev",
 	license		= "MIT",
 	classifiers	= classifiers,
 	url		= "http://github.com/doceme/py-spidev",
-	ext_modules	= [Extension("spidev", ["spidev_module.c"])]
+	ext_modules	= [Extension("spidev", ["spidev_module.c"], depends=["spidev_capi.h"])],
+	headers		= ["spidev_capi.h"],
+	py_modules	= ["spidev_bench"]
 )
@@ -0,0 +1,237 @@
+#!/usr/bin/env python
+"""Benchmark the transfer methods of spidev.SpiDev.
+
+Every method is timed for a sweep of payload sizes and input types, against
+a real device or, by default, the in-process loopback backend, which measures
+the cost of the bindings alone. Results are printed as JSON so they can be
+compared between releases:
+
+    python -m spidev_bench > before.json
+    python -m spidev_bench --backend kernel --bus 0 --device 0 --speed 8000000
+
+For every case the report holds calls/s, MB/s, the median and 99th
+percentile latency of a call, and two allocation figures measured in a
+separate pass with tracemalloc: the peak number of bytes allocated during
+one call, and the number of memory blocks one call allocates and that are
+still alive when it returns (its result, plus anything leaked or cached).
+Blocks allocated and freed within the call only show up in the peak.
+
+Needs Python 3.9 or later (time.perf_counter_ns and tracemalloc.reset_peak).
+"""
+
+import sys
+
+if sys.version_info < (3, 9):
+    sys.exit("spidev_bench needs Python 3.9 or later")
+
+import argparse
+import json
+import platform
+import time
+import tracemalloc
+
+import spidev
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+METHODS = ("xfer", "xfer2", "xfer3", "writebytes", "writebytes2", "readbytes")
+INPUTS = ("list", "tuple", "bytes", "bytearray", "numpy")
+SIZES = (1, 16, 256, 4096, 65536, 1 << 20)
+
+# Calls whose results are kept alive while counting blocks, and the bytes
+# of payload they may keep alive at most
+ALLOC_CALLS = 100
+ALLOC_MAX_BYTES = 16 << 20
+
+
+def make_input(kind, size):
+    data = bytes(i & 0xFF for i in range(size))
+    if kind == "list":
+        return list(data)
+    if kind == "tuple":
+        return tuple(data)
+    if kind == "bytes":
+        return data
+    if kind == "bytearray":
+        return bytearray(data)
+    if kind == "numpy":
+        return numpy.frombuffer(data, dtype=numpy.uint8).copy()
+    raise ValueError("unknown input type %r" % kind)
+
+
+def make_call(spi, method, payload, size):
+    if method == "readbytes":
+        return lambda: spi.readbytes(size)
+    func = getattr(spi, method)
+    return lambda: func(payload)
+
+
+def percentile(sorted_values, fraction):
+    index = min(len(sorted_values) - 1, int(round(fraction * (len(sorted_values) - 1))))
+    return sorted_values[index]
+
+
+def _measure_peak(call):
+    call()  # warm up caches such as recycled output buffers
+    tracemalloc.start()
+    try:
+        before, _ = tracemalloc.get_traced_memory()
+        tracemalloc.reset_peak()
+        result = call()
+        del result
+        _, peak = tracemalloc.get_traced_memory()
+    finally:
+        tracemalloc.stop()
+    return peak - before
+
+
+def _count_blocks(call, ncalls):
+    results = [None] * ncalls
+    call()
+    tracemalloc.start()
+    try:
+        before = tracemalloc.take_snapshot()
+        for i in range(ncalls):
+            results[i] = call()
+        after = tracemalloc.take_snapshot()
+    finally:
+        tracemalloc.stop()
+    del results
+    return sum(stat.count_diff for stat in after.compare_to(before, "filename"))
+
+
+def measure_allocations(call, size):
+    """Return the peak bytes and the blocks allocated by one call."""
+    ncalls = max(1, min(ALLOC_CALLS, ALLOC_MAX_BYTES // max(size, 1)))
+    # The measurement itself allocates a little, count it out
+    peak_bytes = _measure_peak(call) - _measure_peak(lambda: None)
+    blocks = _count_blocks(call, ncalls) - _count_blocks(lambda: None, ncalls)
+    return max(0, peak_bytes), max(0.0, round(blocks / float(ncalls), 2))
+
+
+def run_case(call, size, min_time, min_calls, max_calls):
+    timer = time.perf_counter_ns
+    latencies = []
+    call()
+    start = timer()
+    deadline = start + int(min_time * 1e9)
+    while len(latencies) < max_calls:
+        t0 = timer()
+        call()
+        t1 = timer()
+        latencies.append(t1 - t0)
+        if t1 >= deadline and len(latencies) >= min_calls:
+            break
+    total = (timer() - start) / 1e9
+
+    latencies.sort()
+    peak_bytes, blocks = measure_allocations(call, size)
+    calls = len(latencies)
+    return {
+        "calls": calls,
+        "seconds": round(total, 6),
+        "calls_per_s": round(calls / total, 1),
+        "mb_per_s": round(calls * size / total / 1e6, 3),
+        "p50_us": round(percentile(latencies, 0.50) / 1e3, 3),
+        "p99_us": round(percentile(latencies, 0.99) / 1e3, 3),
+        "peak_alloc_bytes": peak_bytes,
+        "alloc_blocks_per_call": blocks,
+    }
+
+
+def parse_args(argv):
+    parser = argparse.ArgumentParser(
+        prog="python -m spidev_bench",
+        description="Benchmark spidev transfer methods and print the results as JSON.")
+    parser.add_argument("--backend", default="loopback",
+                        help="backend to open the device with (default: loopback)")
+    parser.add_argument("--bus", type=int, default=0)
+    parser.add_argument("--device", type=int, default=0)
+    parser.add_argument("--speed", type=int, default=0,
+                        help="max_speed_hz to set, 0 to keep the device setting")
+    parser.add_argument("--byte-ns", type=int, default=0,
+                        help="time per byte of the loopback device, in ns")
+    parser.add_argument("--block-size", type=int, default=0,
+                        help="block_size to set, 0 to keep the default")
+    parser.add_argument("--methods", default=",".join(METHODS),
+                        help="comma separated methods (default: all)")
+    parser.add_argument("--inputs", default=",".join(INPUTS),
+                        help="comma separated input types (default: all available)")
+    parser.add_argument("--sizes", default=",".join(str(s) for s in SIZES),
+                        help="comma separated payload sizes in bytes")
+    parser.add_argument("--output-type", default=None,
+                        choices=("list", "bytes", "bytearray", "memoryview"),
+                        help="output_type to set (default: None)")
+    parser.add_argument("--min-time", type=float, default=0.2,
+                        help="seconds spent on every case (default: 0.2)")
+    parser.add_argument("--min-calls", type=int, default=5)
+    parser.add_argument("--max-calls", type=int, default=100000)
+    parser.add_argument("-o", "--output", default="-",
+                        help="file to write the JSON report to (default: stdout)")
+    return parser.parse_args(argv)
+
+
+def main(argv=None):
+    args = parse_args(argv)
+    methods = [m for m in args.methods.split(",") if m]
+    inputs = [i for i in args.inputs.split(",") if i and (i != "numpy" or numpy is not None)]
+    sizes = [int(s) for s in args.sizes.split(",") if s]
+
+    for method in methods:
+        if method not in METHODS:
+            sys.exit("unknown method %r" % method)
+
+    spi = spidev.SpiDev()
+    spi.open(args.bus, args.device, backend=args.backend)
+    try:
+        if args.speed:
+            spi.max_speed_hz = args.speed
+        if args.block_size:
+            spi.block_size = args.block_size
+        if args.output_type:
+            spi.output_type = {"list": list, "bytes": bytes, "bytearray": bytearray,
+                               "memoryview": memoryview}[args.output_type]
+        if args.backend == "loopback":
+            spi.loopback(byte_ns=args.byte_ns)
+
+        results = []
+        for method in methods:
+            for size in sizes:
+                # readbytes takes no input, it is measured once per size
+                for kind in (["-"] if method == "readbytes" else inputs):
+                    payload = None if kind == "-" else make_input(kind, size)
+                    case = {"method": method, "input": kind, "size": size}
+                    case.update(run_case(make_call(spi, method, payload, size), size,
+                                         args.min_time, args.min_calls, args.max_calls))
+                    results.append(case)
+                    sys.stderr.write("%-12s %-10s %8d  %12.1f calls/s %10.3f MB/s\n" % (
+                        method, kind, size, case["calls_per_s"], case["mb_per_s"]))
+
+        report = {
+            "spidev": spidev.__version__,
+            "python": platform.python_version(),
+            "machine": platform.machine(),
+            "backend": spi.backend,
+            "byte_ns": args.byte_ns if args.backend == "loopback" else None,
+            "max_speed_hz": spi.max_speed_hz,
+            "block_size": spi.block_size,
+            "output_type": args.output_type,
+            "numpy": numpy.__version__ if numpy is not None else None,
+            "results": results,
+        }
+    finally:
+        spi.close()
+
+    text = json.dumps(report, indent=2)
+    if args.output == "-":
+        print(text)
+    else:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,136 @@
+/*
+ * spidev_capi.h - C API of the spidev module for other extensions
+ *
+ * MIT License
+ *
+ * The spidev module exports the functions below in the spidev._C_API
+ * capsule. They let C and Cython extensions run transfers on a SpiDev
+ * object straight through its transfer engine, without going through the
+ * Python methods:
+ *
+ *	if (SpiDev_ImportAPI() < 0)
+ *		return NULL;
+ *	...
+ *	struct spi_ioc_transfer xfer = {
+ *		.tx_buf = (unsigned long)tx,
+ *		.rx_buf = (unsigned long)rx,
+ *		.len = 2,
+ *	};
+ *	Py_BEGIN_ALLOW_THREADS
+ *	status = SpiDev_Transfer(spi, &xfer, 1);
+ *	Py_END_ALLOW_THREADS
+ *
+ * Transfers go through the backend the object was opened with, count in its
+ * statistics, and may run without the GIL. The other functions need it.
+ *
+ * SPIDEV_CAPI_VERSION changes when the table changes incompatibly. New
+ * functions are appended, callers built against a newer header than the
+ * module find them missing through the size field.
+ */
+
+#ifndef SPIDEV_CAPI_H
+#define SPIDEV_CAPI_H
+
+#include <Python.h>
+#include <stddef.h>
+#include <linux/spi/spidev.h>
+
+#define SPIDEV_CAPI_NAME	"spidev._C_API"
+#define SPIDEV_CAPI_VERSION	1
+
+// Scratch buffers of a SpiDev object
+enum {
+	SPIDEV_SCRATCH_TX,
+	SPIDEV_SCRATCH_RX,
+};
+
+typedef struct {
+	unsigned int version;	/* SPIDEV_CAPI_VERSION of the module */
+	size_t size;		/* sizeof(SpiDev_CAPI) of the module */
+	PyTypeObject *SpiDev_Type;
+
+	// File descriptor of the device, -1 if it is closed or the
+	// backend has none (loopback)
+	int (*fileno)(PyObject *spi);
+
+	// Largest number of bytes sent in one message (block_size)
+	size_t (*block_size)(PyObject *spi);
+
+	// Run count transfers in one SPI_IOC_MESSAGE(count) message. Fields
+	// left to 0 take the settings of the device. Returns 0, or a negative
+	// errno. May be called without the GIL, the object must stay alive.
+	int (*transfer)(PyObject *spi, struct spi_ioc_transfer *xfers, unsigned int count);
+
+	// Borrow the page aligned scratch buffer which (SPIDEV_SCRATCH_*) of
+	// the object, grown to at least len bytes. Returns NULL with an
+	// exception set on failure. The buffer must be given back with
+	// scratch_put, both with the GIL held (attached to the interpreter on
+	// free-threaded builds). Both run in a critical section on the object,
+	// like its methods, so a buffer in use by another thread is never
+	// handed out: a temporary one is returned instead.
+	void *(*scratch_get)(PyObject *spi, int which, size_t len);
+	void (*scratch_put)(PyObject *spi, int which, void *buf);
+} SpiDev_CAPI;
+
+#ifndef SPIDEV_MODULE
+
+static const SpiDev_CAPI *SpiDev_API;
+
+// Import the C API, to call once (in the module init function) before
+// using any of the functions below. Returns -1 with an exception set.
+static inline int
+SpiDev_ImportAPI(void)
+{
+	const SpiDev_CAPI *api = (const SpiDev_CAPI *)PyCapsule_Import(SPIDEV_CAPI_NAME, 0);
+
+	if (!api)
+		return -1;
+	if (api->version != SPIDEV_CAPI_VERSION || api->size < sizeof(SpiDev_CAPI)) {
+		PyErr_Format(PyExc_ImportError,
+			"spidev C API version %u is not compatible with version %u",
+			api->version, SPIDEV_CAPI_VERSION);
+		return -1;
+	}
+	SpiDev_API = api;
+	return 0;
+}
+
+static inline int
+SpiDev_Check(PyObject *obj)
+{
+	return PyObject_TypeCheck(obj, SpiDev_API->SpiDev_Type);
+}
+
+static inline int
+SpiDev_Fileno(PyObject *spi)
+{
+	return SpiDev_API->fileno(spi);
+}
+
+static inline size_t
+SpiDev_BlockSize(PyObject *spi)
+{
+	return SpiDev_API->block_size(spi);
+}
+
+static inline int
+SpiDev_Transfer(PyObject *spi, struct spi_ioc_transfer *xfers, unsigned int count)
+{
+	return SpiDev_API->transfer(spi, xfers, count);
+}
+
+static inline void *
+SpiDev_ScratchGet(PyObject *spi, int which, size_t len)
+{
+	return SpiDev_API->scratch_get(spi, which, len);
+}
+
+static inline void
+SpiDev_ScratchPut(PyObject *spi, int which, void *buf)
+{
+	SpiDev_API->scratch_put(spi, which, buf);
+}
+
+#endif /* SPIDEV_MODULE */
+
+#endif /* SPIDEV_CAPI_H */
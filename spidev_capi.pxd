@@ -0,0 +1,41 @@
+# Cython declarations of the spidev C API, see spidev_capi.h.
+#
+#   from spidev_capi cimport *
+#
+#   SpiDev_ImportAPI()
+#
+#   cdef spi_ioc_transfer xfer
+#   memset(&xfer, 0, sizeof(xfer))
+#   xfer.tx_buf = <unsigned long>tx
+#   xfer.rx_buf = <unsigned long>rx
+#   xfer.len = n
+#   with nogil:
+#       status = SpiDev_Transfer(<PyObject *>spi, &xfer, 1)
+
+from libc.stdint cimport uint8_t, uint16_t, uint32_t, uint64_t
+from cpython.object cimport PyObject
+
+cdef extern from "spidev_capi.h":
+    cdef struct spi_ioc_transfer:
+        uint64_t tx_buf
+        uint64_t rx_buf
+        uint32_t len
+        uint32_t speed_hz
+        uint16_t delay_usecs
+        uint8_t bits_per_word
+        uint8_t cs_change
+        uint8_t tx_nbits
+        uint8_t rx_nbits
+
+    enum:
+        SPIDEV_CAPI_VERSION
+        SPIDEV_SCRATCH_TX
+        SPIDEV_SCRATCH_RX
+
+    int SpiDev_ImportAPI() except -1
+    bint SpiDev_Check(object obj)
+    int SpiDev_Fileno(object spi)
+    size_t SpiDev_BlockSize(object spi)
+    int SpiDev_Transfer(PyObject *spi, spi_ioc_transfer *xfers, unsigned int count) nogil
+    void *SpiDev_ScratchGet(object spi, int which, size_t len) except NULL
+    void SpiDev_ScratchPut(object spi, int which, void *buf)
@@ -27,13 +27,26 @@
 
 #include <Python.h>
 #include "structmember.h"
+#if PY_MAJOR_VERSION >= 3 && PY_VERSION_HEX < 0x030B0000
+#include "longintrepr.h"
+#endif
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <linux/spi/spidev.h>
 #include <linux/types.h>
 #include <sys/ioctl.h>
 #include <linux/ioctl.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#define SPIDEV_MODULE
+#include "spidev_capi.h"
 
 #define _VERSION_ "3.6"
 #define SPIDEV_MAXPATH 4096
@@ -45,11 +58,14 @@
 // Largest block size for xfer3 - even if /sys/module/spidev/parameters/bufsiz allows bigger
 // blocks, we won't go above this value. As I understand, DMA is not used for anything bigger so why bother.
 #define XFER3_MAX_BLOCK_SIZE 65535
+// Largest number of transfers the kernel accepts in a single SPI_IOC_MESSAGE(N)
+#define SPIDEV_MAX_SEGMENTS (((1 << _IOC_SIZEBITS) - 1) / sizeof(struct spi_ioc_transfer))
 
 
 #if PY_MAJOR_VERSION < 3
 #define PyLong_AS_LONG(val) PyInt_AS_LONG(val)
 #define PyLong_AsLong(val) PyInt_AsLong(val)
+#define PyLong_AsSize_t(val) PyLong_AsUnsignedLong(val)
 #endif
 
 // Macros needed for Python 3
@@ -60,37 +76,250 @@
 #define PyInt_Type			PyLong_Type
 #endif
 
-// Maximum block size for xfer3
-// Initialised once by get_xfer3_block_size
-uint32_t xfer3_block_size = 0;
+// The transfer methods take their arguments as a C array (METH_FASTCALL) where
+// the interpreter supports it, and as a tuple and a dict before Python 3.7.
+// Both are parsed by spidev_parse_args() so the methods are written once.
+#if PY_VERSION_HEX >= 0x03070000
+#define SPIDEV_FASTCALL
+#define SPIDEV_METH_ARGS	(METH_FASTCALL | METH_KEYWORDS)
+#define SPIDEV_ARGS		PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames
+#define SPIDEV_ARGS_FWD		args, nargs, kwnames
+#else
+#define SPIDEV_METH_ARGS	(METH_VARARGS | METH_KEYWORDS)
+#define SPIDEV_ARGS		PyObject *args, PyObject *kwds
+#define SPIDEV_ARGS_FWD		args, kwds
+#endif
 
-// Read maximum block size from the /sys/module/spidev/parameters/bufsiz
-// In case of any problems reading the number, we fall back to XFER3_DEFAULT_BLOCK_SIZE.
-// If number is read ok but it exceeds the XFER3_MAX_BLOCK_SIZE, it will be capped to that value.
-// The value is read and cached on the first invocation. Following invocations just return the cached one.
-uint32_t get_xfer3_block_size(void) {
-	int value;
+// Description of the arguments of a method, in the spirit of Argument Clinic:
+// the keyword names are interned once and keywords are then matched by
+// identity, so a call does no format string parsing nor dict lookups.
+typedef struct {
+	const char *fname;
+	const char * const *keywords;	// NULL terminated
+	int required;			// number of required arguments
+	int count;			// set on first use
+	PyObject **names;		// interned keywords, published on first use
+} SpiDevArgParser;
+
+#define SPIDEV_MAX_ARGS 8
+
+static int
+spidev_parser_init(SpiDevArgParser *parser)
+{
+	int i, count;
+	PyObject **names;
+
+	for (count = 0; parser->keywords[count]; count++)
+		;
+
+	names = PyMem_Malloc(count * sizeof(*names));
+	if (!names) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+#if PY_MAJOR_VERSION < 3
+		names[i] = PyString_InternFromString(parser->keywords[i]);
+#else
+		names[i] = PyUnicode_InternFromString(parser->keywords[i]);
+#endif
+		if (!names[i]) {
+			while (i--)
+				Py_DECREF(names[i]);
+			PyMem_Free(names);
+			return -1;
+		}
+	}
+	// Threads may get here together without the GIL, the first one wins
+	__atomic_store_n(&parser->count, count, __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&parser->names, &(PyObject **){NULL}, names,
+			0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+		for (i = 0; i < count; i++)
+			Py_DECREF(names[i]);
+		PyMem_Free(names);
+	}
+	return 0;
+}
+
+static int
+spidev_parser_index(SpiDevArgParser *parser, PyObject *key)
+{
+	int i;
+
+	for (i = 0; i < parser->count; i++)
+		if (parser->names[i] == key)
+			return i;
+
+	// Keywords built at runtime are not interned
+	for (i = 0; i < parser->count; i++) {
+		int eq = PyObject_RichCompareBool(parser->names[i], key, Py_EQ);
+		if (eq)
+			return eq < 0 ? -2 : i;
+	}
+	return -1;
+}
+
+// Store the arguments of a call in out[], in the order of parser->keywords,
+// with NULL for those not given. The references are borrowed.
+static int
+spidev_parse_args(SpiDevArgParser *parser, SPIDEV_ARGS, PyObject **out)
+{
+	int i, index;
+	Py_ssize_t nkw = 0;
+	PyObject *key, *value;
+
+	if (!__atomic_load_n(&parser->names, __ATOMIC_ACQUIRE) && spidev_parser_init(parser) < 0)
+		return -1;
+
+#ifndef SPIDEV_FASTCALL
+	Py_ssize_t nargs = PyTuple_GET_SIZE(args);
+#endif
+
+	if (nargs > parser->count) {
+		PyErr_Format(PyExc_TypeError,
+			"%s() takes at most %d arguments (%zd given)",
+			parser->fname, parser->count, nargs);
+		return -1;
+	}
+
+	for (i = 0; i < parser->count; i++)
+#ifdef SPIDEV_FASTCALL
+		out[i] = i < nargs ? args[i] : NULL;
+#else
+		out[i] = i < nargs ? PyTuple_GET_ITEM(args, i) : NULL;
+#endif
+
+#ifdef SPIDEV_FASTCALL
+	if (kwnames)
+		nkw = PyTuple_GET_SIZE(kwnames);
+	for (i = 0; i < nkw; i++) {
+		key = PyTuple_GET_ITEM(kwnames, i);
+		value = args[nargs + i];
+#else
+	Py_ssize_t pos = 0;
+	if (kwds)
+		nkw = PyDict_Size(kwds);
+	while (nkw && PyDict_Next(kwds, &pos, &key, &value)) {
+#endif
+		index = spidev_parser_index(parser, key);
+		if (index == -2)
+			return -1;
+		if (index < 0) {
+#if PY_MAJOR_VERSION < 3
+			PyErr_Format(PyExc_TypeError,
+				"%s() got an unexpected keyword argument '%s'",
+				parser->fname, PyString_AsString(key));
+#else
+			PyErr_Format(PyExc_TypeError,
+				"%s() got an unexpected keyword argument '%S'",
+				parser->fname, key);
+#endif
+			return -1;
+		}
+		if (out[index]) {
+			PyErr_Format(PyExc_TypeError,
+				"argument for %s() given by name ('%s') and position (%d)",
+				parser->fname, parser->keywords[index], index + 1);
+			return -1;
+		}
+		out[index] = value;
+	}
+
+	for (i = 0; i < parser->required; i++) {
+		if (!out[i]) {
+			PyErr_Format(PyExc_TypeError,
+				"%s() missing required argument '%s' (pos %d)",
+				parser->fname, parser->keywords[i], i + 1);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Optional unsigned integer argument, truncated to its C type as the
+// "B", "H", "I" and "K" format units do. value is left alone if obj is NULL.
+static int
+spidev_arg_mask(PyObject *obj, unsigned long long *value)
+{
+	unsigned long long v;
+
+	if (!obj)
+		return 0;
+	if (PyFloat_Check(obj)) {
+		PyErr_SetString(PyExc_TypeError,
+			"integer argument expected, got float");
+		return -1;
+	}
+	v = PyLong_AsUnsignedLongLongMask(obj);
+	if (v == (unsigned long long)-1 && PyErr_Occurred())
+		return -1;
+	*value = v;
+	return 0;
+}
+
+// Optional Py_ssize_t argument, like the "n" format unit
+static int
+spidev_arg_ssize(PyObject *obj, Py_ssize_t *value)
+{
+	Py_ssize_t v;
 
-	// If value was already initialised, just use it
-	if (xfer3_block_size != 0) {
-		return xfer3_block_size;
+	if (!obj)
+		return 0;
+	if (PyFloat_Check(obj)) {
+		PyErr_SetString(PyExc_TypeError,
+			"integer argument expected, got float");
+		return -1;
 	}
+	v = PyNumber_AsSsize_t(obj, PyExc_OverflowError);
+	if (v == -1 && PyErr_Occurred())
+		return -1;
+	*value = v;
+	return 0;
+}
+
+// Maximum block size for xfer3
+// Initialised once by get_xfer3_block_size
+static uint32_t xfer3_block_size = 0;
+static pthread_once_t xfer3_block_size_once = PTHREAD_ONCE_INIT;
 
-	// Start with the default
-	xfer3_block_size = XFER3_DEFAULT_BLOCK_SIZE;
+// Read the largest message size spidev accepts from /sys/module/spidev/parameters/bufsiz
+// Returns 0 if the number cannot be read.
+static uint32_t spidev_read_bufsiz(void) {
+	int value;
+	uint32_t bufsiz = 0;
 
 	FILE *file = fopen(BLOCK_SIZE_CONTROL_FILE,"r");
 	if (file != NULL) {
 		if (fscanf(file, "%d", &value) == 1 && value > 0) {
-			if (value <= XFER3_MAX_BLOCK_SIZE) {
-				xfer3_block_size = value;
-			} else {
-				xfer3_block_size = XFER3_MAX_BLOCK_SIZE;
-			}
+			bufsiz = value;
 		}
 		fclose(file);
 	}
 
+	return bufsiz;
+}
+
+// Default block size for a device: spidev's bufsiz.
+// In case of any problems reading the number, we fall back to XFER3_DEFAULT_BLOCK_SIZE.
+// If number is read ok but it exceeds the XFER3_MAX_BLOCK_SIZE, it will be capped to that value.
+static uint32_t spidev_default_block_size(void) {
+	uint32_t value = spidev_read_bufsiz();
+
+	if (value == 0) {
+		return XFER3_DEFAULT_BLOCK_SIZE;
+	}
+	return (value <= XFER3_MAX_BLOCK_SIZE) ? value : XFER3_MAX_BLOCK_SIZE;
+}
+
+static void init_xfer3_block_size(void) {
+	xfer3_block_size = spidev_default_block_size();
+}
+
+// Block size used by objects that have not been opened yet.
+// The value is read and cached on the first invocation, once even if several
+// threads get there together. Following invocations just return the cached one.
+static uint32_t get_xfer3_block_size(void) {
+	pthread_once(&xfer3_block_size_once, init_xfer3_block_size);
 	return xfer3_block_size;
 }
 
@@ -104,1370 +333,7319 @@ PyDoc_STRVAR(SpiDev_module_doc,
 	"Because the SPI device interface is opened R/W, users of this\n"
 	"module usually must have root permissions.\n");
 
+struct spidev_backend;
+
+// Errors are counted by errno up to this value, larger ones together in slot 0
+#define SPIDEV_STATS_ERRNOS 128
+// Latency histogram buckets, bucket n counting calls of 2^n to 2^(n+1) ns
+#define SPIDEV_STATS_BUCKETS 40
+
+// Transfer statistics. The aio and stream threads update them too, so
+// every counter is atomic; relaxed increments keep them cheap.
+typedef struct {
+	atomic_ullong transfers;	/* transfer method calls and async requests */
+	atomic_ullong tx_bytes;
+	atomic_ullong rx_bytes;
+	atomic_ullong ioctls;	/* ioctl, read and write calls on the device */
+	atomic_ullong io_ns;	/* time spent in these calls */
+	atomic_ullong call_ns;	/* time spent in the transfer methods */
+	atomic_ullong released_ns;	/* part of call_ns spent without the GIL */
+	atomic_ullong errors[SPIDEV_STATS_ERRNOS];
+	atomic_ullong latency[SPIDEV_STATS_BUCKETS];	/* of device calls */
+} SpiDevStats;
+
+// Memory reused by the transfer methods from one call to the next
+typedef struct {
+	uint8_t *buf;	/* page aligned, NULL until first needed */
+	size_t size;
+	size_t peak;	/* largest request since the last shrink check */
+	unsigned int uses;	/* requests since the last shrink check */
+	int busy;	/* handed out; concurrent callers get a buffer of their own */
+} SpiDevScratch;
+
+// SPIDEV_SCRATCH_TX and SPIDEV_SCRATCH_RX, see spidev_capi.h
+#define SPIDEV_SCRATCH_COUNT 2
+
 typedef struct {
 	PyObject_HEAD
 
 	int fd;	/* open file descriptor: /dev/spidevX.Y */
-	uint8_t mode;	/* current SPI mode */
+	const struct spidev_backend *backend;	/* how the device is accessed */
+	void *backend_data;	/* state of backends other than the kernel one */
+	pthread_mutex_t dev_lock;	/* held by every call to the backend */
+	uint32_t mode;	/* current SPI mode, including the dual/quad bus widths */
 	uint8_t bits_per_word;	/* current SPI bits per word setting */
 	uint32_t max_speed_hz;	/* current SPI max speed setting in Hz */
 	uint8_t read0;	/* read 0 bytes after transfer to lwoer CS if SPI_CS_HIGH */
+	uint32_t block_size;	/* largest chunk sent in one message, 0 for the default */
+	uint8_t output_type;	/* type of received data, one of SPIDEV_OUTPUT_* */
+	PyObject *recycled;	/* bytearray reused for memoryview results */
+	struct spidev_aio *aio;	/* worker running asynchronous requests */
+	struct spidev_stream *stream;	/* continuous acquisition, if running */
+	struct spidev_frames *frames;	/* background frame writer, if started */
+	SpiDevScratch scratch[SPIDEV_SCRATCH_COUNT];
+	size_t scratch_limit;	/* largest scratch buffer kept between calls */
+	SpiDevStats stats;
 } SpiDevObject;
 
-static PyObject *
-SpiDev_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
-{
-	SpiDevObject *self;
-	if ((self = (SpiDevObject *)type->tp_alloc(type, 0)) == NULL)
-		return NULL;
+// Types received data can be returned as
+enum {
+	SPIDEV_OUTPUT_DEFAULT = 0,	/* lists (tuples for xfer3), as always */
+	SPIDEV_OUTPUT_LIST,
+	SPIDEV_OUTPUT_BYTES,
+	SPIDEV_OUTPUT_BYTEARRAY,
+	SPIDEV_OUTPUT_MEMORYVIEW,	/* view of a buffer recycled between calls */
+};
 
-	self->fd = -1;
-	self->mode = 0;
-	self->bits_per_word = 0;
-	self->max_speed_hz = 0;
+#define SPIDEV_OUTPUT_IS_BYTES(self) ((self)->output_type >= SPIDEV_OUTPUT_BYTES)
+
+// Scratch buffers up to this size are kept between calls by default
+#define SPIDEV_SCRATCH_LIMIT (1024 * 1024)
+// Scratch buffers up to this size are never shrunk
+#define SPIDEV_SCRATCH_KEEP (64 * 1024)
+// Number of calls over which the use of a scratch buffer is checked
+#define SPIDEV_SCRATCH_DECAY 256
+
+// Block size transfers of this object are split in
+#define SPIDEV_BLOCK_SIZE(self) ((self)->block_size ? (self)->block_size : get_xfer3_block_size())
+
+// I/O backends.
+// Every access to the device goes through spidev_ioctl, spidev_read and
+// spidev_write, which dispatch to the backend selected by open(). Like the
+// system calls they replace, they may be called without the GIL and return
+// -1 with errno set on failure. They hold dev_lock for the call, as do open()
+// and close() to change the backend, so a device is never closed under a
+// call running in another thread.
+typedef struct spidev_backend {
+	const char *name;
+	int (*open)(SpiDevObject *self, const char *path);
+	int (*close)(SpiDevObject *self);
+	int (*ioctl)(SpiDevObject *self, unsigned long request, void *arg);
+	ssize_t (*read)(SpiDevObject *self, void *buf, size_t len);
+	ssize_t (*write)(SpiDevObject *self, const void *buf, size_t len);
+} SpiDevBackend;
+
+static inline uint64_t
+spidev_now_ns(void)
+{
+	struct timespec ts;
 
-	Py_INCREF(self);
-	return (PyObject *)self;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-PyDoc_STRVAR(SpiDev_close_doc,
-	"close()\n\n"
-	"Disconnects the object from the interface.\n");
+#define spidev_stats_add(counter, value) \
+	atomic_fetch_add_explicit(counter, value, memory_order_relaxed)
 
-static PyObject *
-SpiDev_close(SpiDevObject *self)
+// Account one device call that started at t0 and returned status
+static inline void
+spidev_stats_io(SpiDevObject *self, uint64_t t0, long status)
 {
-	if ((self->fd != -1) && (close(self->fd) == -1)) {
-		PyErr_SetFromErrno(PyExc_IOError);
-		return NULL;
-	}
+	uint64_t ns = spidev_now_ns() - t0;
+	int bucket = 63 - __builtin_clzll(ns | 1);
 
-	self->fd = -1;
-	self->mode = 0;
-	self->bits_per_word = 0;
-	self->max_speed_hz = 0;
+	if (bucket >= SPIDEV_STATS_BUCKETS)
+		bucket = SPIDEV_STATS_BUCKETS - 1;
 
-	Py_INCREF(Py_None);
-	return Py_None;
+	spidev_stats_add(&self->stats.ioctls, 1);
+	spidev_stats_add(&self->stats.io_ns, ns);
+	spidev_stats_add(&self->stats.latency[bucket], 1);
+	if (status < 0)
+		spidev_stats_add(&self->stats.errors[(errno > 0 && errno < SPIDEV_STATS_ERRNOS) ? errno : 0], 1);
 }
 
-static void
-SpiDev_dealloc(SpiDevObject *self)
+// Account one call of a transfer method that started at t0
+static inline void
+spidev_stats_call(SpiDevObject *self, uint64_t t0)
 {
-	PyObject *ref = SpiDev_close(self);
-	Py_XDECREF(ref);
+	spidev_stats_add(&self->stats.transfers, 1);
+	spidev_stats_add(&self->stats.call_ns, spidev_now_ns() - t0);
+}
 
-	Py_TYPE(self)->tp_free((PyObject *)self);
+// Py_BEGIN/END_ALLOW_THREADS of the transfer methods, also accounting the
+// time spent without the GIL
+#define SPIDEV_BEGIN_ALLOW_THREADS(self) { \
+	uint64_t _spidev_released = spidev_now_ns(); \
+	Py_BEGIN_ALLOW_THREADS
+#define SPIDEV_END_ALLOW_THREADS(self) \
+	Py_END_ALLOW_THREADS \
+	spidev_stats_add(&(self)->stats.released_ns, spidev_now_ns() - _spidev_released); \
+	}
+
+// Free-threaded builds have no GIL serializing calls on the same object.
+// Methods and setters that use or change the state of a SpiDev are defined
+// as name##_impl, and SPIDEV_LOCKED_*(name) defines name running it in a
+// critical section on the object, as Argument Clinic does for
+// @critical_section. The section is suspended while the thread waits without
+// the GIL, there dev_lock keeps the device from being closed under a call.
+// With the GIL, the sections compile to nothing.
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
+
+#define SPIDEV_LOCKED_ON(obj, type, name, params, args) \
+static type \
+name params \
+{ \
+	type result; \
+	Py_BEGIN_CRITICAL_SECTION((PyObject *)(obj)); \
+	result = name##_impl args; \
+	Py_END_CRITICAL_SECTION(); \
+	return result; \
 }
+#define SPIDEV_LOCKED(type, name, params, args) \
+	SPIDEV_LOCKED_ON(self, type, name, params, args)
+
+#define SPIDEV_LOCKED_FASTCALL(name) \
+	SPIDEV_LOCKED(PyObject *, name, (SpiDevObject *self, SPIDEV_ARGS), (self, SPIDEV_ARGS_FWD))
+#define SPIDEV_LOCKED_VARARGS(name) \
+	SPIDEV_LOCKED(PyObject *, name, (SpiDevObject *self, PyObject *args), (self, args))
+#define SPIDEV_LOCKED_KEYWORDS(name) \
+	SPIDEV_LOCKED(PyObject *, name, (SpiDevObject *self, PyObject *args, PyObject *kwds), (self, args, kwds))
+#define SPIDEV_LOCKED_NOARGS(name) \
+	SPIDEV_LOCKED(PyObject *, name, (SpiDevObject *self, PyObject *unused), (self, unused))
+#define SPIDEV_LOCKED_SELF(name) \
+	SPIDEV_LOCKED(PyObject *, name, (SpiDevObject *self), (self))
+#define SPIDEV_LOCKED_SETTER(name) \
+	SPIDEV_LOCKED(int, name, (SpiDevObject *self, PyObject *val, void *closure), (self, val, closure))
+
+static inline int
+spidev_ioctl(SpiDevObject *self, unsigned long request, void *arg)
+{
+	uint64_t t0 = spidev_now_ns();
+	int status;
 
-static char *wrmsg_list0 = "Empty argument list.";
-static char *wrmsg_listmax = "Argument list size exceeds %d bytes.";
-static char *wrmsg_val = "Non-Int/Long value in arguments: %x.";
-static char *wrmsg_oom = "Out of memory.";
+	pthread_mutex_lock(&self->dev_lock);
+	status = self->backend->ioctl(self, request, arg);
+	pthread_mutex_unlock(&self->dev_lock);
 
+	spidev_stats_io(self, t0, status);
+	if (status >= 0 && _IOC_TYPE(request) == SPI_IOC_MAGIC && _IOC_NR(request) == 0) {
+		struct spi_ioc_transfer *xfers = arg;
+		unsigned ii, n = _IOC_SIZE(request) / sizeof(struct spi_ioc_transfer);
 
-PyDoc_STRVAR(SpiDev_write_doc,
-	"write([values]) -> None\n\n"
-	"Write bytes to SPI device.\n");
+		for (ii = 0; ii < n; ii++) {
+			if (xfers[ii].tx_buf)
+				spidev_stats_add(&self->stats.tx_bytes, xfers[ii].len);
+			if (xfers[ii].rx_buf)
+				spidev_stats_add(&self->stats.rx_bytes, xfers[ii].len);
+		}
+	}
+	return status;
+}
 
-static PyObject *
-SpiDev_writebytes(SpiDevObject *self, PyObject *args)
+static inline ssize_t
+spidev_read(SpiDevObject *self, void *buf, size_t len)
 {
-	int		status;
-	uint16_t	ii, len;
-	uint8_t	buf[SPIDEV_MAXPATH];
-	PyObject	*obj;
-	PyObject	*seq;
-	char	wrmsg_text[4096];
+	uint64_t t0 = spidev_now_ns();
+	ssize_t status;
 
-	if (!PyArg_ParseTuple(args, "O:write", &obj))
-		return NULL;
+	pthread_mutex_lock(&self->dev_lock);
+	status = self->backend->read(self, buf, len);
+	pthread_mutex_unlock(&self->dev_lock);
 
-	seq = PySequence_Fast(obj, "expected a sequence");
-	len = PySequence_Fast_GET_SIZE(seq);
-	if (!seq || len <= 0) {
-		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
-		return NULL;
-	}
+	spidev_stats_io(self, t0, status);
+	if (status > 0)
+		spidev_stats_add(&self->stats.rx_bytes, status);
+	return status;
+}
 
-	if (len > SPIDEV_MAXPATH) {
-		snprintf(wrmsg_text, sizeof (wrmsg_text) - 1, wrmsg_listmax, SPIDEV_MAXPATH);
-		PyErr_SetString(PyExc_OverflowError, wrmsg_text);
-		return NULL;
-	}
+static inline ssize_t
+spidev_write(SpiDevObject *self, const void *buf, size_t len)
+{
+	uint64_t t0 = spidev_now_ns();
+	ssize_t status;
 
-	for (ii = 0; ii < len; ii++) {
-		PyObject *val = PySequence_Fast_GET_ITEM(seq, ii);
-#if PY_MAJOR_VERSION < 3
-		if (PyInt_Check(val)) {
-			buf[ii] = (__u8)PyInt_AS_LONG(val);
-		} else
-#endif
-		{
-			if (PyLong_Check(val)) {
-				buf[ii] = (__u8)PyLong_AS_LONG(val);
-			} else {
-				snprintf(wrmsg_text, sizeof (wrmsg_text) - 1, wrmsg_val, val);
-				PyErr_SetString(PyExc_TypeError, wrmsg_text);
-				return NULL;
-			}
-		}
-	}
+	pthread_mutex_lock(&self->dev_lock);
+	status = self->backend->write(self, buf, len);
+	pthread_mutex_unlock(&self->dev_lock);
 
-	Py_DECREF(seq);
+	spidev_stats_io(self, t0, status);
+	if (status > 0)
+		spidev_stats_add(&self->stats.tx_bytes, status);
+	return status;
+}
 
-	status = write(self->fd, &buf[0], len);
+// WA:
+// in CS_HIGH mode CS isn't pulled to low after transfer, but after read
+// reading 0 bytes doesnt matter but brings cs down
+// tomdean:
+// Stop generating an extra CS except in mode CS_HIGH
+// Called after a successful transfer, without the GIL.
+static inline void
+spidev_read0(SpiDevObject *self)
+{
+	if (self->read0 && (self->mode & SPI_CS_HIGH))
+		(void)!spidev_read(self, NULL, 0);
+}
 
-	if (status < 0) {
-		PyErr_SetFromErrno(PyExc_IOError);
-		return NULL;
-	}
+// Kernel backend: /dev/spidevX.Y
 
-	if (status != len) {
-		perror("short write");
-		return NULL;
-	}
+static int
+spidev_kernel_open(SpiDevObject *self, const char *path)
+{
+	self->fd = open(path, O_RDWR, 0);
+	return (self->fd == -1) ? -1 : 0;
+}
 
-	Py_INCREF(Py_None);
-	return Py_None;
+static int
+spidev_kernel_close(SpiDevObject *self)
+{
+	if (self->fd != -1 && close(self->fd) == -1)
+		return -1;
+	self->fd = -1;
+	return 0;
 }
 
-PyDoc_STRVAR(SpiDev_read_doc,
-	"read(len) -> [values]\n\n"
-	"Read len bytes from SPI device.\n");
+static int
+spidev_kernel_ioctl(SpiDevObject *self, unsigned long request, void *arg)
+{
+	return ioctl(self->fd, request, arg);
+}
 
-static PyObject *
-SpiDev_readbytes(SpiDevObject *self, PyObject *args)
+static ssize_t
+spidev_kernel_read(SpiDevObject *self, void *buf, size_t len)
 {
-	uint8_t	rxbuf[SPIDEV_MAXPATH];
-	int		status, len, ii;
-	PyObject	*list;
+	return read(self->fd, buf, len);
+}
 
-	if (!PyArg_ParseTuple(args, "i:read", &len))
-		return NULL;
+static ssize_t
+spidev_kernel_write(SpiDevObject *self, const void *buf, size_t len)
+{
+	return write(self->fd, buf, len);
+}
 
-	/* read at least 1 byte, no more than SPIDEV_MAXPATH */
-	if (len < 1)
-		len = 1;
-	else if ((unsigned)len > sizeof(rxbuf))
-		len = sizeof(rxbuf);
+static const SpiDevBackend spidev_kernel_backend = {
+	"kernel",
+	spidev_kernel_open,
+	spidev_kernel_close,
+	spidev_kernel_ioctl,
+	spidev_kernel_read,
+	spidev_kernel_write,
+};
 
-	memset(rxbuf, 0, sizeof rxbuf);
-	status = read(self->fd, &rxbuf[0], len);
+// Loopback backend: an in-process device that sends back what it receives,
+// for testing and benchmarking without hardware. It takes byte_ns
+// nanoseconds per byte clocked, and responses queued by loopback() replace
+// the echo of the following transfers, one response per transfer.
+
+typedef struct spidev_loopback_response {
+	struct spidev_loopback_response *next;
+	size_t len;
+	uint8_t data[];
+} SpiDevLoopbackResponse;
+
+typedef struct spidev_loopback {
+	pthread_mutex_t lock;	/* the aio and stream threads share the device */
+	uint32_t mode;
+	uint8_t bits_per_word;
+	uint32_t max_speed_hz;
+	uint32_t bufsiz;	/* largest message, as spidev's bufsiz */
+	unsigned long long byte_ns;
+	SpiDevLoopbackResponse *responses, **responses_tail;
+	size_t nresponses;
+} SpiDevLoopback;
 
-	if (status < 0) {
-		PyErr_SetFromErrno(PyExc_IOError);
-		return NULL;
-	}
+static int
+spidev_loopback_open(SpiDevObject *self, const char *path)
+{
+	SpiDevLoopback *lb = calloc(1, sizeof(*lb));
 
-	if (status != len) {
-		perror("short read");
-		return NULL;
+	if (!lb) {
+		errno = ENOMEM;
+		return -1;
 	}
+	pthread_mutex_init(&lb->lock, NULL);
+	lb->bits_per_word = 8;
+	lb->max_speed_hz = 1000000;
+	lb->bufsiz = spidev_default_block_size();
+	lb->responses_tail = &lb->responses;
+	self->backend_data = lb;
+	return 0;
+}
 
-	list = PyList_New(len);
+static int
+spidev_loopback_close(SpiDevObject *self)
+{
+	SpiDevLoopback *lb = self->backend_data;
 
-	for (ii = 0; ii < len; ii++) {
-		PyObject *val = PyLong_FromLong((long)rxbuf[ii]);
-		PyList_SET_ITEM(list, ii, val);  // Steals reference, no need to Py_DECREF(val)
+	while (lb->responses) {
+		SpiDevLoopbackResponse *resp = lb->responses;
+		lb->responses = resp->next;
+		free(resp);
 	}
-
-	return list;
+	pthread_mutex_destroy(&lb->lock);
+	free(lb);
+	self->backend_data = NULL;
+	return 0;
 }
 
-static PyObject *
-SpiDev_writebytes2_buffer(SpiDevObject *self, Py_buffer *buffer)
+// Time taken by the device to clock len bytes. Long delays sleep,
+// the rest is spun to keep short transfers accurate.
+static void
+spidev_loopback_delay(SpiDevLoopback *lb, size_t len)
 {
-	int		status;
-	Py_ssize_t	remain, block_size, block_start, spi_max_block;
+	unsigned long long ns = lb->byte_ns * len;
+	struct timespec now, deadline;
 
-	spi_max_block = get_xfer3_block_size();
+	if (ns == 0)
+		return;
 
-	block_start = 0;
-	remain = buffer->len;
-	while (block_start < buffer->len) {
-		block_size = (remain < spi_max_block) ? remain : spi_max_block;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += ns / 1000000000ULL;
+	deadline.tv_nsec += ns % 1000000000ULL;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
 
-		Py_BEGIN_ALLOW_THREADS
-		status = write(self->fd, buffer->buf + block_start, block_size);
-		Py_END_ALLOW_THREADS
+	if (ns >= 100000)
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+			;
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (now.tv_sec < deadline.tv_sec ||
+		 (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec));
+}
 
-		if (status < 0) {
-			PyErr_SetFromErrno(PyExc_IOError);
-			return NULL;
-		}
+// Fill rx with the next response, or the echo of tx (zeros without tx).
+// Called with lb->lock held.
+static void
+spidev_loopback_respond(SpiDevLoopback *lb, const uint8_t *tx, uint8_t *rx, size_t len)
+{
+	SpiDevLoopbackResponse *resp = lb->responses;
 
-		if (status != block_size) {
-			perror("short write");
-			return NULL;
+	if (resp) {
+		size_t count = (resp->len < len) ? resp->len : len;
+
+		if (rx) {
+			memcpy(rx, resp->data, count);
+			memset(rx + count, 0, len - count);
 		}
+		lb->responses = resp->next;
+		if (!lb->responses)
+			lb->responses_tail = &lb->responses;
+		lb->nresponses--;
+		free(resp);
+	} else if (rx) {
+		if (tx)
+			memmove(rx, tx, len);
+		else
+			memset(rx, 0, len);
+	}
+}
 
-		block_start += block_size;
-		remain -= block_size;
+static int
+spidev_loopback_message(SpiDevLoopback *lb, struct spi_ioc_transfer *xfers, unsigned n)
+{
+	size_t tx_total = 0, rx_total = 0, total = 0;
+	unsigned ii;
+
+	for (ii = 0; ii < n; ii++) {
+		if (xfers[ii].tx_buf)
+			tx_total += xfers[ii].len;
+		if (xfers[ii].rx_buf)
+			rx_total += xfers[ii].len;
+		total += xfers[ii].len;
+	}
+	if (tx_total > lb->bufsiz || rx_total > lb->bufsiz) {
+		errno = EMSGSIZE;
+		return -1;
 	}
 
-	Py_INCREF(Py_None);
-	return Py_None;
+	pthread_mutex_lock(&lb->lock);
+	for (ii = 0; ii < n; ii++)
+		spidev_loopback_respond(lb,
+			(const uint8_t *)(uintptr_t)xfers[ii].tx_buf,
+			(uint8_t *)(uintptr_t)xfers[ii].rx_buf, xfers[ii].len);
+	pthread_mutex_unlock(&lb->lock);
+
+	spidev_loopback_delay(lb, total);
+	return (total > INT_MAX) ? INT_MAX : (int)total;
 }
 
-static PyObject *
-SpiDev_writebytes2_seq_internal(SpiDevObject *self, PyObject *seq, Py_ssize_t len, uint8_t *buf, Py_ssize_t bufsize)
+static int
+spidev_loopback_ioctl(SpiDevObject *self, unsigned long request, void *arg)
 {
-	int		status;
-	Py_ssize_t	ii, jj, remain, block_size;
-	char	wrmsg_text[4096];
+	SpiDevLoopback *lb = self->backend_data;
+
+	if (_IOC_TYPE(request) == SPI_IOC_MAGIC && _IOC_NR(request) == 0 &&
+	    _IOC_DIR(request) == _IOC_WRITE)
+		return spidev_loopback_message(lb, arg,
+			_IOC_SIZE(request) / sizeof(struct spi_ioc_transfer));
+
+	switch (request) {
+	case SPI_IOC_RD_MODE:
+		*(uint8_t *)arg = lb->mode;
+		return 0;
+	case SPI_IOC_WR_MODE:
+		lb->mode = (lb->mode & ~0xffu) | *(uint8_t *)arg;
+		return 0;
+#ifdef SPI_IOC_RD_MODE32
+	case SPI_IOC_RD_MODE32:
+		*(uint32_t *)arg = lb->mode;
+		return 0;
+	case SPI_IOC_WR_MODE32:
+		lb->mode = *(uint32_t *)arg;
+		return 0;
+#endif
+	case SPI_IOC_RD_BITS_PER_WORD:
+		*(uint8_t *)arg = lb->bits_per_word;
+		return 0;
+	case SPI_IOC_WR_BITS_PER_WORD:
+		lb->bits_per_word = *(uint8_t *)arg;
+		return 0;
+	case SPI_IOC_RD_MAX_SPEED_HZ:
+		*(uint32_t *)arg = lb->max_speed_hz;
+		return 0;
+	case SPI_IOC_WR_MAX_SPEED_HZ:
+		lb->max_speed_hz = *(uint32_t *)arg;
+		return 0;
+	}
+	errno = ENOTTY;
+	return -1;
+}
 
-	remain = len;
-	jj = 0;
-	while (remain > 0) {
-		block_size = (remain < bufsize) ? remain : bufsize;
+static ssize_t
+spidev_loopback_read(SpiDevObject *self, void *buf, size_t len)
+{
+	SpiDevLoopback *lb = self->backend_data;
 
-		for (ii = 0; ii < block_size; ii++, jj++) {
-			PyObject *val = PySequence_Fast_GET_ITEM(seq, jj);
-#if PY_MAJOR_VERSION < 3
-			if (PyInt_Check(val)) {
-				buf[ii] = (__u8)PyInt_AS_LONG(val);
-			} else
-#endif
-			{
-				if (PyLong_Check(val)) {
-					buf[ii] = (__u8)PyLong_AS_LONG(val);
-				} else {
-					snprintf(wrmsg_text, sizeof (wrmsg_text) - 1, wrmsg_val, val);
-					PyErr_SetString(PyExc_TypeError, wrmsg_text);
-					return NULL;
-				}
-			}
-		}
+	if (len > lb->bufsiz) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (len == 0)
+		return 0;
 
-		Py_BEGIN_ALLOW_THREADS
-		status = write(self->fd, buf, block_size);
-		Py_END_ALLOW_THREADS
+	pthread_mutex_lock(&lb->lock);
+	spidev_loopback_respond(lb, NULL, buf, len);
+	pthread_mutex_unlock(&lb->lock);
 
-		if (status < 0) {
-			PyErr_SetFromErrno(PyExc_IOError);
-			return NULL;
-		}
+	spidev_loopback_delay(lb, len);
+	return len;
+}
 
-		if (status != block_size) {
-			perror("short write");
-			return NULL;
-		}
+static ssize_t
+spidev_loopback_write(SpiDevObject *self, const void *buf, size_t len)
+{
+	SpiDevLoopback *lb = self->backend_data;
 
-		remain -= block_size;
+	if (len > lb->bufsiz) {
+		errno = EMSGSIZE;
+		return -1;
 	}
 
-	Py_INCREF(Py_None);
-	return Py_None;
+	pthread_mutex_lock(&lb->lock);
+	spidev_loopback_respond(lb, buf, NULL, len);
+	pthread_mutex_unlock(&lb->lock);
+
+	spidev_loopback_delay(lb, len);
+	return len;
 }
 
-// In writebytes2 we try to avoild doing malloc/free on each tiny block.
-// So for any transfer below this size we will use on-stack local buffer instead of allocating one on the heap.
-#define SMALL_BUFFER_SIZE 128
+static const SpiDevBackend spidev_loopback_backend = {
+	"loopback",
+	spidev_loopback_open,
+	spidev_loopback_close,
+	spidev_loopback_ioctl,
+	spidev_loopback_read,
+	spidev_loopback_write,
+};
+
+static const SpiDevBackend *spidev_backends[] = {
+	&spidev_kernel_backend,
+	&spidev_loopback_backend,
+	NULL
+};
 
 static PyObject *
-SpiDev_writebytes2_seq(SpiDevObject *self, PyObject *seq)
+SpiDev_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-	Py_ssize_t	len, bufsize, spi_max_block;
-	PyObject	*result = NULL;
-
-	len = PySequence_Fast_GET_SIZE(seq);
-	if (len <= 0) {
-		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+	SpiDevObject *self;
+	if ((self = (SpiDevObject *)type->tp_alloc(type, 0)) == NULL)
 		return NULL;
-	}
 
-	spi_max_block = get_xfer3_block_size();
+	self->fd = -1;
+	self->backend = &spidev_kernel_backend;
+	pthread_mutex_init(&self->dev_lock, NULL);
+	self->mode = 0;
+	self->bits_per_word = 0;
+	self->max_speed_hz = 0;
+	self->scratch_limit = SPIDEV_SCRATCH_LIMIT;
 
-	bufsize = (len < spi_max_block) ? len : spi_max_block;
+	Py_INCREF(self);
+	return (PyObject *)self;
+}
 
-	if (bufsize <= SMALL_BUFFER_SIZE) {
-		// The data size is very small so we can avoid malloc/free completely
-		// by using a small local buffer instead
-		uint8_t buf[SMALL_BUFFER_SIZE];
-		result = SpiDev_writebytes2_seq_internal(self, seq, len, buf, SMALL_BUFFER_SIZE);
-	} else {
-		// Large data, need to allocate buffer on heap
-		uint8_t	*buf;
-		Py_BEGIN_ALLOW_THREADS
-		buf = malloc(sizeof(__u8) * bufsize);
-		Py_END_ALLOW_THREADS
+PyDoc_STRVAR(SpiDev_close_doc,
+	"close()\n\n"
+	"Disconnects the object from the interface.\n");
 
-		if (!buf) {
-			PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
-			return NULL;
-		}
+static void spidev_aio_stop(SpiDevObject *self);
+static void spidev_stream_stop(SpiDevObject *self);
+static void spidev_frames_stop(SpiDevObject *self);
 
-		result = SpiDev_writebytes2_seq_internal(self, seq, len, buf, bufsize);
+static PyObject *
+SpiDev_close_impl(SpiDevObject *self)
+{
+	int status;
 
-		Py_BEGIN_ALLOW_THREADS
-		free(buf);
-		Py_END_ALLOW_THREADS
+	// Background users of the file descriptor go first
+	spidev_aio_stop(self);
+	spidev_stream_stop(self);
+	spidev_frames_stop(self);
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&self->dev_lock);
+	status = self->backend->close(self);
+	if (status != -1) {
+		self->fd = -1;
+		self->backend = &spidev_kernel_backend;
 	}
+	pthread_mutex_unlock(&self->dev_lock);
+	Py_END_ALLOW_THREADS
 
-	return result;
-}
+	if (status == -1) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return NULL;
+	}
 
-PyDoc_STRVAR(SpiDev_writebytes2_doc,
-	"writebytes2([values]) -> None\n\n"
-	"Write bytes to SPI device.\n"
-	"values must be a list or buffer.\n");
+	self->mode = 0;
+	self->bits_per_word = 0;
+	self->max_speed_hz = 0;
+	self->block_size = 0;
 
-static PyObject *
-SpiDev_writebytes2(SpiDevObject *self, PyObject *args)
-{
-	PyObject	*obj, *seq;;
-	PyObject	*result = NULL;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
 
-	if (!PyArg_ParseTuple(args, "O:writebytes2", &obj)) {
-		return NULL;
-	}
+SPIDEV_LOCKED_SELF(SpiDev_close)
 
-	// Try using buffer protocol if object supports it.
-	if (PyObject_CheckBuffer(obj) && 1) {
-		Py_buffer	buffer;
-		if (PyObject_GetBuffer(obj, &buffer, PyBUF_SIMPLE) != -1) {
-			result = SpiDev_writebytes2_buffer(self, &buffer);
-			PyBuffer_Release(&buffer);
-			return result;
-		}
-	}
+static void spidev_scratch_release(SpiDevScratch *scratch);
 
+static void
+SpiDev_dealloc(SpiDevObject *self)
+{
+	int ii;
+	PyObject *ref = SpiDev_close_impl(self);
+	Py_XDECREF(ref);
 
-	// Otherwise, fall back to sequence protocol
-	seq = PySequence_Fast(obj, "expected a sequence");
-	if (seq == NULL) {
-		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
-		return NULL;
-	}
+	Py_CLEAR(self->recycled);
+	for (ii = 0; ii < SPIDEV_SCRATCH_COUNT; ii++)
+		spidev_scratch_release(&self->scratch[ii]);
+	pthread_mutex_destroy(&self->dev_lock);
 
-	result = SpiDev_writebytes2_seq(self, seq);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
 
-	Py_DECREF(seq);
+static char *wrmsg_list0 = "Empty argument list.";
+static char *wrmsg_val = "Non-Int/Long value in arguments: %x.";
+static char *wrmsg_oom = "Out of memory.";
 
-	return result;
+static size_t
+spidev_page_size(void)
+{
+	static size_t page;
+	size_t value = __atomic_load_n(&page, __ATOMIC_RELAXED);
 
+	if (!value) {
+		long size = sysconf(_SC_PAGESIZE);
+		value = (size > 0) ? (size_t)size : 4096;
+		__atomic_store_n(&page, value, __ATOMIC_RELAXED);
+	}
+	return value;
 }
 
-PyDoc_STRVAR(SpiDev_xfer_doc,
-	"xfer([values]) -> [values]\n\n"
-	"Perform SPI transaction.\n"
-	"CS will be released and reactivated between blocks.\n"
-	"delay specifies delay in usec between blocks.\n");
+static void
+spidev_scratch_release(SpiDevScratch *scratch)
+{
+	free(scratch->buf);
+	scratch->buf = NULL;
+	scratch->size = 0;
+}
 
-static PyObject *
-SpiDev_xfer(SpiDevObject *self, PyObject *args)
+// Return a page aligned buffer of at least len bytes, the scratch buffer
+// which of the object, grown if needed. If it is already handed out, to
+// another thread transferring on the same object, a buffer of its own is
+// allocated instead. Either way it is given back with spidev_scratch_put().
+static uint8_t *
+spidev_scratch_get(SpiDevObject *self, int which, size_t len)
 {
-	uint16_t ii, len;
-	int status;
-	uint16_t delay_usecs = 0;
-	uint32_t speed_hz = 0;
-	uint8_t bits_per_word = 0;
-	PyObject *obj;
-	PyObject *seq;
-#ifdef SPIDEV_SINGLE
-	struct spi_ioc_transfer *xferptr;
-	memset(&xferptr, 0, sizeof(xferptr));
-#else
-	struct spi_ioc_transfer xfer;
-	memset(&xfer, 0, sizeof(xfer));
-#endif
-	uint8_t *txbuf, *rxbuf;
-	char	wrmsg_text[4096];
+	SpiDevScratch *scratch = &self->scratch[which];
+	size_t page = spidev_page_size(), size;
+	void *buf;
 
-	if (!PyArg_ParseTuple(args, "O|IHB:xfer", &obj, &speed_hz, &delay_usecs, &bits_per_word))
+	if (len == 0)
+		len = 1;
+	if (len > PY_SSIZE_T_MAX - page) {
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
 		return NULL;
+	}
+	size = (len + page - 1) & ~(page - 1);
+
+	if (!scratch->busy) {
+		if (scratch->peak < len)
+			scratch->peak = len;
+		if (scratch->size >= len) {
+			scratch->busy = 1;
+			return scratch->buf;
+		}
+		spidev_scratch_release(scratch);
+	}
 
-	seq = PySequence_Fast(obj, "expected a sequence");
-	if (!seq) {
-		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+	if (posix_memalign(&buf, page, size) != 0) {
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
 		return NULL;
 	}
+	if (!scratch->busy) {
+		scratch->buf = buf;
+		scratch->size = size;
+		scratch->busy = 1;
+	}
+	return buf;
+}
 
-	len = PySequence_Fast_GET_SIZE(seq);
-	if (len <= 0) {
-		Py_DECREF(seq);
-		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
-		return NULL;
+// Give back a buffer returned by spidev_scratch_get(). Scratch buffers above
+// scratch_limit are released, as are those that were grown for occasional
+// large transfers once SPIDEV_SCRATCH_DECAY calls needed a quarter of them.
+static void
+spidev_scratch_put(SpiDevObject *self, int which, uint8_t *buf)
+{
+	SpiDevScratch *scratch = &self->scratch[which];
+	int shrink = 0;
+
+	if (!buf)
+		return;
+	if (buf != scratch->buf) {
+		free(buf);
+		return;
 	}
 
-	if (len > SPIDEV_MAXPATH) {
-		snprintf(wrmsg_text, sizeof(wrmsg_text) - 1, wrmsg_listmax, SPIDEV_MAXPATH);
-		PyErr_SetString(PyExc_OverflowError, wrmsg_text);
-		Py_DECREF(seq);
-		return NULL;
+	scratch->busy = 0;
+	if (++scratch->uses >= SPIDEV_SCRATCH_DECAY) {
+		shrink = scratch->size > SPIDEV_SCRATCH_KEEP && scratch->peak <= scratch->size / 4;
+		scratch->uses = 0;
+		scratch->peak = 0;
 	}
+	if (shrink || scratch->size > self->scratch_limit)
+		spidev_scratch_release(scratch);
+}
 
-	txbuf = malloc(sizeof(__u8) * len);
-	rxbuf = malloc(sizeof(__u8) * len);
+// Size in bytes of the words the kernel expects for bits per word:
+// 1 byte up to 8 bits, 2 bytes up to 16 bits and 4 bytes above, in native order
+static int
+spidev_word_size(uint8_t bits)
+{
+	if (bits <= 8)
+		return 1;
+	return (bits <= 16) ? 2 : 4;
+}
 
-#ifdef SPIDEV_SINGLE
-	xferptr = (struct spi_ioc_transfer*) malloc(sizeof(struct spi_ioc_transfer) * len);
+// Word size of a transfer, bits being the per-call setting or 0 for the device one
+#define SPIDEV_WORD_SIZE(self, bits) spidev_word_size((bits) ? (bits) : (self)->bits_per_word)
 
-	for (ii = 0; ii < len; ii++) {
-		PyObject *val = PySequence_Fast_GET_ITEM(seq, ii);
-#if PY_MAJOR_VERSION < 3
-		if (PyInt_Check(val)) {
-			txbuf[ii] = (__u8)PyInt_AS_LONG(val);
-		} else
-#endif
-		{
-			if (PyLong_Check(val)) {
-				txbuf[ii] = (__u8)PyLong_AS_LONG(val);
-			} else {
-				snprintf(wrmsg_text, sizeof(wrmsg_text) - 1, wrmsg_val, val);
-				PyErr_SetString(PyExc_TypeError, wrmsg_text);
-				free(xferptr);
-				free(txbuf);
-				free(rxbuf);
-				Py_DECREF(seq);
-				return NULL;
-			}
-		}
-		xferptr[ii].tx_buf = (unsigned long)&txbuf[ii];
-		xferptr[ii].rx_buf = (unsigned long)&rxbuf[ii];
-		xferptr[ii].len = 1;
-		xferptr[ii].delay_usecs = delay;
-		xferptr[ii].speed_hz = speed_hz ? speed_hz : self->max_speed_hz;
-		xferptr[ii].bits_per_word = bits_per_word ? bits_per_word : self->bits_per_word;
-#ifdef SPI_IOC_WR_MODE32
-		xferptr[ii].tx_nbits = 0;
-#endif
-#ifdef SPI_IOC_RD_MODE32
-		xferptr[ii].rx_nbits = 0;
-#endif
-	}
+// Largest multiple of the word size not above block, so words never straddle two messages
+static Py_ssize_t
+spidev_word_block(Py_ssize_t block, int word)
+{
+	block -= block % word;
+	return block ? block : word;
+}
+
+// Value of one item of a sequence, truncated to the word size by the caller
+static int
+spidev_item_value_slow(PyObject *val, unsigned long *value)
+{
+	char	wrmsg_text[4096];
 
-	status = ioctl(self->fd, SPI_IOC_MESSAGE(len), xferptr);
-	free(xferptr);
-	if (status < 0) {
-		PyErr_SetFromErrno(PyExc_IOError);
-		free(txbuf);
-		free(rxbuf);
-		Py_DECREF(seq);
-		return NULL;
-	}
-#else
-	for (ii = 0; ii < len; ii++) {
-		PyObject *val = PySequence_Fast_GET_ITEM(seq, ii);
 #if PY_MAJOR_VERSION < 3
-		if (PyInt_Check(val)) {
-			txbuf[ii] = (__u8)PyInt_AS_LONG(val);
-		} else
+	if (PyInt_Check(val)) {
+		*value = (unsigned long)PyInt_AS_LONG(val);
+		return 0;
+	}
 #endif
-		{
-			if (PyLong_Check(val)) {
-				txbuf[ii] = (__u8)PyLong_AS_LONG(val);
-			} else {
-				snprintf(wrmsg_text, sizeof(wrmsg_text) - 1, wrmsg_val, val);
-				PyErr_SetString(PyExc_TypeError, wrmsg_text);
-				free(txbuf);
-				free(rxbuf);
-				Py_DECREF(seq);
-				return NULL;
-			}
-		}
+	if (PyLong_Check(val)) {
+		*value = PyLong_AsUnsignedLongMask(val);
+		return 0;
 	}
+	snprintf(wrmsg_text, sizeof (wrmsg_text) - 1, wrmsg_val, val);
+	PyErr_SetString(PyExc_TypeError, wrmsg_text);
+	return -1;
+}
 
-	if (PyTuple_Check(obj)) {
-		Py_DECREF(seq);
-		seq = PySequence_List(obj);
+// Value of a list item, truncated to the word by the caller.
+// Exact ints of a single digit (30 bits), which covers every word value,
+// are read straight from the object; anything else takes the checked path.
+static inline int
+spidev_item_value(PyObject *val, unsigned long *value)
+{
+#if PY_VERSION_HEX >= 0x030C0000
+	if (PyLong_CheckExact(val) && PyUnstable_Long_IsCompact((PyLongObject *)val)) {
+		*value = (unsigned long)PyUnstable_Long_CompactValue((PyLongObject *)val);
+		return 0;
 	}
+#elif PY_MAJOR_VERSION >= 3
+	if (PyLong_CheckExact(val)) {
+		Py_ssize_t size = Py_SIZE(val);
 
-	xfer.tx_buf = (unsigned long)txbuf;
-	xfer.rx_buf = (unsigned long)rxbuf;
-	xfer.len = len;
-	xfer.delay_usecs = delay_usecs;
-	xfer.speed_hz = speed_hz ? speed_hz : self->max_speed_hz;
-	xfer.bits_per_word = bits_per_word ? bits_per_word : self->bits_per_word;
-#ifdef SPI_IOC_WR_MODE32
-	xfer.tx_nbits = 0;
-#endif
-#ifdef SPI_IOC_RD_MODE32
-	xfer.rx_nbits = 0;
-#endif
-
-	status = ioctl(self->fd, SPI_IOC_MESSAGE(1), &xfer);
-	if (status < 0) {
-		PyErr_SetFromErrno(PyExc_IOError);
-		free(txbuf);
-		free(rxbuf);
-		Py_DECREF(seq);
-		return NULL;
+		if (size >= -1 && size <= 1) {
+			*value = (unsigned long)((long)size * (long)((PyLongObject *)val)->ob_digit[0]);
+			return 0;
+		}
 	}
 #endif
+	return spidev_item_value_slow(val, value);
+}
 
-	for (ii = 0; ii < len; ii++) {
-		PyObject *val = PyLong_FromLong((long)rxbuf[ii]);
-		PySequence_SetItem(seq, ii, val);
-		Py_DECREF(val); // PySequence_SetItem does not steal reference, must Py_DECREF(val)
+// Convert count integers of a PySequence_Fast sequence, starting at start, to
+// words of word bytes. Each word size has a loop of its own storing to a typed
+// pointer, which lets the compiler unroll and vectorize the stores.
+static int
+spidev_seq_copy(PyObject *seq, Py_ssize_t start, Py_ssize_t count, uint8_t *dst, int word)
+{
+	PyObject **items = PySequence_Fast_ITEMS(seq) + start;
+	unsigned long value = 0;
+	Py_ssize_t ii;
+
+	switch (word) {
+	case 1:
+		for (ii = 0; ii < count; ii++) {
+			if (spidev_item_value(items[ii], &value) < 0)
+				return -1;
+			dst[ii] = (uint8_t)value;
+		}
+		break;
+	case 2: {
+		uint16_t *dst16 = (uint16_t *)dst;
+
+		for (ii = 0; ii < count; ii++) {
+			if (spidev_item_value(items[ii], &value) < 0)
+				return -1;
+			dst16[ii] = (uint16_t)value;
+		}
+		break;
 	}
+	default: {
+		uint32_t *dst32 = (uint32_t *)dst;
 
-	// WA:
-	// in CS_HIGH mode CS isn't pulled to low after transfer, but after read
-	// reading 0 bytes doesnt matter but brings cs down
-	// tomdean:
-	// Stop generating an extra CS except in mode CS_HOGH
-	if (self->read0 && (self->mode & SPI_CS_HIGH)) status = read(self->fd, &rxbuf[0], 0);
-
-	free(txbuf);
-	free(rxbuf);
-
-	if (PyTuple_Check(obj)) {
-		PyObject *old = seq;
-		seq = PySequence_Tuple(seq);
-		Py_DECREF(old);
+		for (ii = 0; ii < count; ii++) {
+			if (spidev_item_value(items[ii], &value) < 0)
+				return -1;
+			dst32[ii] = (uint32_t)value;
+		}
+		break;
 	}
-
-	return seq;
+	}
+	return 0;
 }
 
-
-PyDoc_STRVAR(SpiDev_xfer2_doc,
-	"xfer2([values]) -> [values]\n\n"
-	"Perform SPI transaction.\n"
-	"CS will be held active between blocks.\n");
-
+// Build a bytes object from a sequence of integers, packed in words of word bytes
 static PyObject *
-SpiDev_xfer2(SpiDevObject *self, PyObject *args)
+spidev_seq_to_bytes(PyObject *obj, int word)
 {
-	int status;
-	uint16_t delay_usecs = 0;
-	uint32_t speed_hz = 0;
-	uint8_t bits_per_word = 0;
-	uint16_t ii, len;
-	PyObject *obj;
-	PyObject *seq;
-	struct spi_ioc_transfer xfer;
-	Py_BEGIN_ALLOW_THREADS
-	memset(&xfer, 0, sizeof(xfer));
-	Py_END_ALLOW_THREADS
-	uint8_t *txbuf, *rxbuf;
-	char	wrmsg_text[4096];
-
-	if (!PyArg_ParseTuple(args, "O|IHB:xfer2", &obj, &speed_hz, &delay_usecs, &bits_per_word))
-		return NULL;
+	PyObject *seq, *bytes;
+	Py_ssize_t len;
 
 	seq = PySequence_Fast(obj, "expected a sequence");
-	if (!seq) {
-		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+	if (!seq)
 		return NULL;
-	}
 
 	len = PySequence_Fast_GET_SIZE(seq);
-	if (len <= 0) {
-		Py_DECREF(seq);
-		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
-		return NULL;
-	}
-
-	if (len > SPIDEV_MAXPATH) {
-		snprintf(wrmsg_text, sizeof(wrmsg_text) - 1, wrmsg_listmax, SPIDEV_MAXPATH);
-		PyErr_SetString(PyExc_OverflowError, wrmsg_text);
+	if (len > PY_SSIZE_T_MAX / word) {
 		Py_DECREF(seq);
-		return NULL;
+		return PyErr_NoMemory();
 	}
+	bytes = PyBytes_FromStringAndSize(NULL, len * word);
+	if (bytes && spidev_seq_copy(seq, 0, len, (uint8_t *)PyBytes_AS_STRING(bytes), word) < 0)
+		Py_CLEAR(bytes);
 
-	Py_BEGIN_ALLOW_THREADS
-	txbuf = malloc(sizeof(__u8) * len);
-	rxbuf = malloc(sizeof(__u8) * len);
-	Py_END_ALLOW_THREADS
+	Py_DECREF(seq);
+	return bytes;
+}
 
-	for (ii = 0; ii < len; ii++) {
-		PyObject *val = PySequence_Fast_GET_ITEM(seq, ii);
-#if PY_MAJOR_VERSION < 3
-		if (PyInt_Check(val)) {
-			txbuf[ii] = (__u8)PyInt_AS_LONG(val);
-		} else
-#endif
-		{
-			if (PyLong_Check(val)) {
-				txbuf[ii] = (__u8)PyLong_AS_LONG(val);
-			} else {
-				snprintf(wrmsg_text, sizeof (wrmsg_text) - 1, wrmsg_val, val);
-				PyErr_SetString(PyExc_TypeError, wrmsg_text);
-				free(txbuf);
-				free(rxbuf);
-				Py_DECREF(seq);
-				return NULL;
-			}
+// Data to transmit, given either as a buffer or as a sequence of integers
+typedef struct {
+	Py_buffer view;		/* view.obj is set when the buffer protocol is used */
+	PyObject *seq;		/* PySequence_Fast result otherwise */
+	Py_ssize_t len;		/* number of bytes */
+	int word;		/* bytes per word */
+} SpiDevTxData;
+
+// Buffers already hold words in memory order (array('H'), numpy.uint16...)
+// and are used as they are, only their size must be a whole number of words.
+static int
+spidev_tx_open(PyObject *obj, SpiDevTxData *tx, int word)
+{
+	memset(tx, 0, sizeof(*tx));
+	tx->word = word;
+
+	if (PyObject_CheckBuffer(obj)) {
+		if (PyObject_GetBuffer(obj, &tx->view, PyBUF_SIMPLE) == -1)
+			return -1;
+		tx->len = tx->view.len;
+		if (tx->len % word) {
+			PyErr_Format(PyExc_ValueError,
+				"Buffer size is not a multiple of the word size (%d bytes).", word);
+			PyBuffer_Release(&tx->view);
+			return -1;
 		}
+		return 0;
 	}
 
-	if (PyTuple_Check(obj)) {
-		Py_DECREF(seq);
-		seq = PySequence_List(obj);
+	tx->seq = PySequence_Fast(obj, "expected a sequence");
+	if (!tx->seq) {
+		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+		return -1;
 	}
-
-	Py_BEGIN_ALLOW_THREADS
-	xfer.tx_buf = (unsigned long)txbuf;
-	xfer.rx_buf = (unsigned long)rxbuf;
-	xfer.len = len;
-	xfer.delay_usecs = delay_usecs;
-	xfer.speed_hz = speed_hz ? speed_hz : self->max_speed_hz;
-	xfer.bits_per_word = bits_per_word ? bits_per_word : self->bits_per_word;
-
-	status = ioctl(self->fd, SPI_IOC_MESSAGE(1), &xfer);
-	Py_END_ALLOW_THREADS
-	if (status < 0) {
-		PyErr_SetFromErrno(PyExc_IOError);
-		free(txbuf);
-		free(rxbuf);
-		Py_DECREF(seq);
-		return NULL;
+	if (PySequence_Fast_GET_SIZE(tx->seq) > PY_SSIZE_T_MAX / word) {
+		Py_CLEAR(tx->seq);
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+		return -1;
 	}
+	tx->len = PySequence_Fast_GET_SIZE(tx->seq) * word;
+	return 0;
+}
 
-	for (ii = 0; ii < len; ii++) {
-		PyObject *val = PyLong_FromLong((long)rxbuf[ii]);
-		PySequence_SetItem(seq, ii, val);
-		Py_DECREF(val); // PySequence_SetItem does not steal reference, must Py_DECREF(val)
+// Copy count bytes of tx data, starting at byte start, to dst.
+// Both must be multiples of the word size.
+static int
+spidev_tx_copy(SpiDevTxData *tx, Py_ssize_t start, Py_ssize_t count, uint8_t *dst)
+{
+	if (tx->view.obj) {
+		memcpy(dst, (uint8_t *)tx->view.buf + start, count);
+		return 0;
 	}
-	// WA:
-	// in CS_HIGH mode CS isnt pulled to low after transfer
-	// reading 0 bytes doesn't really matter but brings CS down
-	// tomdean:
-	// Stop generating an extra CS except in mode CS_HOGH
-	if (self->read0 && (self->mode & SPI_CS_HIGH)) status = read(self->fd, &rxbuf[0], 0);
+	return spidev_seq_copy(tx->seq, start / tx->word, count / tx->word, dst, tx->word);
+}
 
-	Py_BEGIN_ALLOW_THREADS
-	free(txbuf);
-	free(rxbuf);
-	Py_END_ALLOW_THREADS
+static void
+spidev_tx_close(SpiDevTxData *tx)
+{
+	PyBuffer_Release(&tx->view);
+	Py_CLEAR(tx->seq);
+}
 
+// Return a memoryview of obj, cast to unsigned words when word is above 1
+static PyObject *
+spidev_rx_view(PyObject *obj, int word)
+{
+	PyObject *view, *cast;
 
-	if (PyTuple_Check(obj)) {
-		PyObject *old = seq;
-		seq = PySequence_Tuple(seq);
-		Py_DECREF(old);
-	}
+	view = PyMemoryView_FromObject(obj);
+	if (!view || word == 1)
+		return view;
 
-	return seq;
+	cast = PyObject_CallMethod(view, "cast", "s", word == 2 ? "H" : "I");
+	Py_DECREF(view);
+	return cast;
 }
 
-PyDoc_STRVAR(SpiDev_xfer3_doc,
-	"xfer3([values]) -> [values]\n\n"
-	"Perform SPI transaction. Accepts input of arbitrary size.\n"
-	"Large blocks will be send as multiple transactions\n"
-	"CS will be held active between blocks.\n");
-
+// Return the object received data of len bytes will be stored in when one of the
+// bytes-like output types is selected, with *data pointing to its storage.
+// Unless recycle is set, memoryviews get a buffer of their own. They are
+// cast to words of the transfer, bytes and bytearrays hold the raw data.
 static PyObject *
-SpiDev_xfer3(SpiDevObject *self, PyObject *args)
+spidev_rx_new(SpiDevObject *self, Py_ssize_t len, uint8_t **data, int recycle, int word)
 {
-	int status;
-	uint16_t delay_usecs = 0;
-	uint32_t speed_hz = 0;
-	uint8_t bits_per_word = 0;
-	Py_ssize_t ii, jj, len, block_size, block_start, bufsize;
-	PyObject *obj;
-	PyObject *seq;
-	PyObject *rx_tuple;
-	struct spi_ioc_transfer xfer;
-	Py_BEGIN_ALLOW_THREADS
-	memset(&xfer, 0, sizeof(xfer));
-	Py_END_ALLOW_THREADS
-	uint8_t *txbuf, *rxbuf;
-	char	wrmsg_text[4096];
-
-	if (!PyArg_ParseTuple(args, "O|IHB:xfer3", &obj, &speed_hz, &delay_usecs, &bits_per_word))
-		return NULL;
+	PyObject *result;
 
-	seq = PySequence_Fast(obj, "expected a sequence");
-	if (!seq) {
-		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
-		return NULL;
+	switch (self->output_type) {
+	case SPIDEV_OUTPUT_BYTES:
+		result = PyBytes_FromStringAndSize(NULL, len);
+		if (result)
+			*data = (uint8_t *)PyBytes_AS_STRING(result);
+		return result;
+
+	case SPIDEV_OUTPUT_BYTEARRAY:
+		result = PyByteArray_FromStringAndSize(NULL, len);
+		if (result)
+			*data = (uint8_t *)PyByteArray_AS_STRING(result);
+		return result;
+
+	case SPIDEV_OUTPUT_MEMORYVIEW:
+		if (!recycle) {
+			PyObject *view;
+
+			result = PyByteArray_FromStringAndSize(NULL, len);
+			if (!result)
+				return NULL;
+			*data = (uint8_t *)PyByteArray_AS_STRING(result);
+			view = spidev_rx_view(result, word);
+			Py_DECREF(result);
+			return view;
+		}
+		// The same bytearray is handed out again as long as its size fits,
+		// or it can be resized because nobody else holds a reference to it
+		if (self->recycled == NULL ||
+		    (PyByteArray_GET_SIZE(self->recycled) != len &&
+		     (Py_REFCNT(self->recycled) > 1 || PyByteArray_Resize(self->recycled, len) < 0))) {
+			PyErr_Clear();
+			result = PyByteArray_FromStringAndSize(NULL, len);
+			if (!result)
+				return NULL;
+			Py_XSETREF(self->recycled, result);
+		}
+		*data = (uint8_t *)PyByteArray_AS_STRING(self->recycled);
+		return spidev_rx_view(self->recycled, word);
 	}
 
-	len = PySequence_Fast_GET_SIZE(seq);
-	if (len <= 0) {
-		Py_DECREF(seq);
-		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
-		return NULL;
-	}
+	PyErr_SetString(PyExc_SystemError, "not a bytes-like output type");
+	return NULL;
+}
 
-	bufsize = get_xfer3_block_size();
-	if (bufsize > len) {
-		bufsize = len;
+// Integer value of word index ii of received data
+static long
+spidev_rx_word(const uint8_t *data, Py_ssize_t ii, int word)
+{
+	switch (word) {
+	case 1:
+		return data[ii];
+	case 2:
+		return ((const uint16_t *)data)[ii];
+	default:
+		return (long)((const uint32_t *)data)[ii];
 	}
+}
 
-	rx_tuple = PyTuple_New(len);
-	if (!rx_tuple) {
-		Py_DECREF(seq);
-		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+// Build a list (or tuple) of integers from len bytes of received data
+static PyObject *
+spidev_rx_values(const uint8_t *data, Py_ssize_t len, int as_tuple, int word)
+{
+	Py_ssize_t ii, count = len / word;
+	PyObject *result = as_tuple ? PyTuple_New(count) : PyList_New(count);
+
+	if (!result)
 		return NULL;
-	}
 
-	Py_BEGIN_ALLOW_THREADS
-	// Allocate tx and rx buffers immediately releasing them if any allocation fails
-	if ((txbuf = malloc(sizeof(__u8) * bufsize)) != NULL) {
-		if ((rxbuf = malloc(sizeof(__u8) * bufsize)) != NULL) {
-			// All good, both buffers allocated
-		} else {
-			// rxbuf allocation failed while txbuf succeeded
-			free(txbuf);
-			txbuf = NULL;
+	for (ii = 0; ii < count; ii++) {
+		PyObject *val = PyLong_FromLong(spidev_rx_word(data, ii, word));
+		if (!val) {
+			Py_DECREF(result);
+			return NULL;
 		}
-	} else {
-		// txbuf allocation failed
-		rxbuf = NULL;
-	}
-	Py_END_ALLOW_THREADS
-	if (!txbuf || !rxbuf) {
-		// Allocation failed. Buffers has been freed already
-		Py_DECREF(seq);
-		Py_DECREF(rx_tuple);
-		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
-		return NULL;
+		if (as_tuple)
+			PyTuple_SET_ITEM(result, ii, val);  // Steals reference, no need to Py_DECREF(val)
+		else
+			PyList_SET_ITEM(result, ii, val);
 	}
+	return result;
+}
 
+// Result of xfer/xfer2 when no output type is set: a list passed in is
+// updated in place and returned, a tuple gives a tuple, anything else a list.
+static PyObject *
+spidev_rx_legacy(PyObject *obj, const uint8_t *data, Py_ssize_t len, int word)
+{
+	Py_ssize_t ii, count = len / word;
 
-	block_start = 0;
-	while (block_start < len) {
+	if (!PyList_Check(obj) || PyList_GET_SIZE(obj) != count)
+		return spidev_rx_values(data, len, PyTuple_Check(obj), word);
 
-		for (ii = 0, jj = block_start; jj < len && ii < bufsize; ii++, jj++) {
-			PyObject *val = PySequence_Fast_GET_ITEM(seq, jj);
-#if PY_MAJOR_VERSION < 3
-			if (PyInt_Check(val)) {
-				txbuf[ii] = (__u8)PyInt_AS_LONG(val);
-			} else
-#endif
-			{
-				if (PyLong_Check(val)) {
-					txbuf[ii] = (__u8)PyLong_AS_LONG(val);
-				} else {
-					snprintf(wrmsg_text, sizeof (wrmsg_text) - 1, wrmsg_val, val);
-					PyErr_SetString(PyExc_TypeError, wrmsg_text);
-					free(txbuf);
-					free(rxbuf);
-					Py_DECREF(rx_tuple);
-					Py_DECREF(seq);
-					return NULL;
-				}
-			}
-		}
+	for (ii = 0; ii < count; ii++) {
+		PyObject *val = PyLong_FromLong(spidev_rx_word(data, ii, word));
+		if (!val)
+			return NULL;
+		PyList_SetItem(obj, ii, val);  // Steals reference, no need to Py_DECREF(val)
+	}
+	Py_INCREF(obj);
+	return obj;
+}
 
-		block_size = ii;
 
-		Py_BEGIN_ALLOW_THREADS
-		xfer.tx_buf = (unsigned long)txbuf;
-		xfer.rx_buf = (unsigned long)rxbuf;
-		xfer.len = block_size;
-		xfer.delay_usecs = delay_usecs;
-		xfer.speed_hz = speed_hz ? speed_hz : self->max_speed_hz;
-		xfer.bits_per_word = bits_per_word ? bits_per_word : self->bits_per_word;
+// Chunked I/O engine shared by all transfer paths.
+// These functions must be called without the GIL: they only touch plain memory
+// and return 0 on success or a negative errno value on failure.
+// Every operation is split in blocks of at most block bytes, the largest message
+// spidev accepts at once.
 
-		status = ioctl(self->fd, SPI_IOC_MESSAGE(1), &xfer);
-		Py_END_ALLOW_THREADS
+static int
+spidev_write_blocks(SpiDevObject *dev, const uint8_t *buf, size_t len, size_t block)
+{
+	ssize_t status;
+	size_t block_size;
 
-		if (status < 0) {
-			PyErr_SetFromErrno(PyExc_IOError);
-			free(txbuf);
-			free(rxbuf);
-			Py_DECREF(rx_tuple);
-			Py_DECREF(seq);
-			return NULL;
-		}
-		for (ii = 0, jj = block_start; ii < block_size; ii++, jj++) {
-			PyObject *val = PyLong_FromLong((long)rxbuf[ii]);
-			PyTuple_SetItem(rx_tuple, jj, val);  // Steals reference, no need to Py_DECREF(val)
-		}
+	while (len > 0) {
+		block_size = (len < block) ? len : block;
 
-		block_start += block_size;
-	}
+		status = spidev_write(dev, buf, block_size);
+		if (status < 0)
+			return -errno;
+		if ((size_t)status != block_size)
+			return -EIO;	/* short write */
 
+		buf += block_size;
+		len -= block_size;
+	}
+	return 0;
+}
 
-	// WA:
-	// in CS_HIGH mode CS isnt pulled to low after transfer
-	// reading 0 bytes doesn't really matter but brings CS down
-	// tomdean:
-	// Stop generating an extra CS except in mode CS_HIGH
-	if (self->read0 && (self->mode & SPI_CS_HIGH)) status = read(self->fd, &rxbuf[0], 0);
+static int
+spidev_read_blocks(SpiDevObject *dev, uint8_t *buf, size_t len, size_t block)
+{
+	ssize_t status;
+	size_t block_size;
 
-	Py_BEGIN_ALLOW_THREADS
-	free(txbuf);
-	free(rxbuf);
-	Py_END_ALLOW_THREADS
+	while (len > 0) {
+		block_size = (len < block) ? len : block;
 
-	Py_DECREF(seq);
+		status = spidev_read(dev, buf, block_size);
+		if (status < 0)
+			return -errno;
+		if ((size_t)status != block_size)
+			return -EIO;	/* short read */
 
-	return rx_tuple;
+		buf += block_size;
+		len -= block_size;
+	}
+	return 0;
 }
 
-static int __spidev_set_mode( int fd, __u8 mode) {
-	__u8 test;
-	if (ioctl(fd, SPI_IOC_WR_MODE, &mode) == -1) {
-		PyErr_SetFromErrno(PyExc_IOError);
-		return -1;
-	}
-	if (ioctl(fd, SPI_IOC_RD_MODE, &test) == -1) {
-		PyErr_SetFromErrno(PyExc_IOError);
-		return -1;
-	}
-	if (test != mode) {
-		PyErr_Format(PyExc_IOError,
-			"Attempted to set mode 0x%x but mode 0x%x returned",
-			(unsigned int)mode, (unsigned int)test);
-		return -1;
+// Full duplex transfer of len bytes. tmpl supplies speed, delay and word size
+// of every message, buffers and length are filled in block by block.
+static int
+spidev_xfer_blocks(SpiDevObject *dev, const struct spi_ioc_transfer *tmpl,
+		const uint8_t *tx, uint8_t *rx, size_t len, size_t block)
+{
+	struct spi_ioc_transfer xfer = *tmpl;
+	size_t block_size;
+
+	while (len > 0) {
+		block_size = (len < block) ? len : block;
+
+		xfer.tx_buf = (unsigned long)tx;
+		xfer.rx_buf = (unsigned long)rx;
+		xfer.len = block_size;
+		if (spidev_ioctl(dev, SPI_IOC_MESSAGE(1), &xfer) < 0)
+			return -errno;
+
+		if (tx)
+			tx += block_size;
+		if (rx)
+			rx += block_size;
+		len -= block_size;
 	}
 	return 0;
 }
 
-PyDoc_STRVAR(SpiDev_fileno_doc,
-	"fileno() -> integer \"file descriptor\"\n\n"
-	"This is needed for lower-level file interfaces, such as os.read().\n");
-
-static PyObject *
-SpiDev_fileno(SpiDevObject *self)
+#ifdef SPIDEV_SINGLE
+// Same as spidev_xfer_blocks but with one transfer per word of word bytes
+static int
+spidev_xfer_single(SpiDevObject *dev, const struct spi_ioc_transfer *tmpl,
+		const uint8_t *tx, uint8_t *rx, size_t len, size_t word)
 {
-	PyObject *result = Py_BuildValue("i", self->fd);
-	Py_INCREF(result);
-	return result;
+	struct spi_ioc_transfer *xferptr;
+	size_t ii, block_size;
+	int status = 0;
+
+	len /= word;
+	block_size = (len < SPIDEV_MAX_SEGMENTS) ? len : SPIDEV_MAX_SEGMENTS;
+	xferptr = (struct spi_ioc_transfer*) malloc(sizeof(struct spi_ioc_transfer) * block_size);
+	if (!xferptr)
+		return -ENOMEM;
+
+	while (len > 0 && status == 0) {
+		block_size = (len < SPIDEV_MAX_SEGMENTS) ? len : SPIDEV_MAX_SEGMENTS;
+
+		for (ii = 0; ii < block_size; ii++) {
+			xferptr[ii] = *tmpl;
+			xferptr[ii].tx_buf = (unsigned long)&tx[ii * word];
+			xferptr[ii].rx_buf = (unsigned long)&rx[ii * word];
+			xferptr[ii].len = word;
+		}
+		if (spidev_ioctl(dev, SPI_IOC_MESSAGE(block_size), xferptr) < 0)
+			status = -errno;
+
+		tx += block_size * word;
+		rx += block_size * word;
+		len -= block_size;
+	}
+
+	free(xferptr);
+	return status;
 }
+#endif
 
-static PyObject *
-SpiDev_get_mode(SpiDevObject *self, void *closure)
+// Raise the exception matching a negative errno returned by the engine
+static void
+spidev_set_errno(int status)
 {
-	PyObject *result = Py_BuildValue("i", (self->mode & (SPI_CPHA | SPI_CPOL) ) );
-	Py_INCREF(result);
-	return result;
+	errno = -status;
+	PyErr_SetFromErrno(PyExc_IOError);
 }
 
-static PyObject *
-SpiDev_get_cshigh(SpiDevObject *self, void *closure)
+// Return a buffer holding all tx bytes: the buffer passed in is used in place,
+// sequences are converted into *alloc. That is the tx scratch buffer of self,
+// to give back with spidev_scratch_put(), or if self is NULL (data used after
+// the call returns) a buffer from malloc() which the caller must free.
+static uint8_t *
+spidev_tx_buffer(SpiDevObject *self, SpiDevTxData *tx, uint8_t **alloc)
 {
-	PyObject *result;
+	*alloc = NULL;
+	if (tx->view.obj)
+		return tx->view.buf;
 
-	if (self->mode & SPI_CS_HIGH)
-		result = Py_True;
-	else
-		result = Py_False;
+	if (self)
+		*alloc = spidev_scratch_get(self, SPIDEV_SCRATCH_TX, tx->len);
+	else if ((*alloc = malloc(sizeof(__u8) * (tx->len ? tx->len : 1))) == NULL)
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+	if (!*alloc)
+		return NULL;
 
-	Py_INCREF(result);
-	return result;
+	if (spidev_tx_copy(tx, 0, tx->len, *alloc) < 0) {
+		if (self)
+			spidev_scratch_put(self, SPIDEV_SCRATCH_TX, *alloc);
+		else
+			free(*alloc);
+		*alloc = NULL;
+		return NULL;
+	}
+	return *alloc;
 }
 
-static PyObject *
-SpiDev_get_lsbfirst(SpiDevObject *self, void *closure)
+// Return the object received data will be returned in together with the
+// buffer data must be received to. For bytes-like output types data is
+// received in place, otherwise result is NULL and data is received in *alloc.
+// recycle is set by calls that are done with the data when they return: they
+// get recycled memoryviews and the rx scratch buffer of self, to give back
+// with spidev_scratch_put(). Otherwise *alloc comes from malloc().
+static int
+spidev_rx_buffer(SpiDevObject *self, Py_ssize_t len, PyObject **result, uint8_t **data, uint8_t **alloc, int recycle, int word)
 {
-	PyObject *result;
+	*alloc = NULL;
+	*result = NULL;
 
-	if (self->mode & SPI_LSB_FIRST)
-		result = Py_True;
-	else
-		result = Py_False;
+	if (SPIDEV_OUTPUT_IS_BYTES(self)) {
+		*result = spidev_rx_new(self, len, data, recycle, word);
+		return *result ? 0 : -1;
+	}
 
-	Py_INCREF(result);
-	return result;
+	if (recycle)
+		*alloc = spidev_scratch_get(self, SPIDEV_SCRATCH_RX, len);
+	else if ((*alloc = malloc(sizeof(__u8) * (len ? len : 1))) == NULL)
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+	*data = *alloc;
+	return *alloc ? 0 : -1;
 }
 
+PyDoc_STRVAR(SpiDev_write_doc,
+	"write([values]) -> None\n\n"
+	"Write bytes to SPI device.\n"
+	"values must be a list or buffer, of any size.\n");
+
 static PyObject *
-SpiDev_get_3wire(SpiDevObject *self, void *closure)
+SpiDev_writebytes2_common(SpiDevObject *self, PyObject *obj);
+
+static const char * const spidev_values_keywords[] = {"values", NULL};
+static SpiDevArgParser SpiDev_writebytes_parser = {"writebytes", spidev_values_keywords, 1};
+
+static PyObject *
+SpiDev_writebytes_impl(SpiDevObject *self, SPIDEV_ARGS)
 {
-	PyObject *result;
+	PyObject	*obj;
 
-	if (self->mode & SPI_3WIRE)
-		result = Py_True;
-	else
-		result = Py_False;
+	uint64_t	t0;
 
-	Py_INCREF(result);
-	return result;
+	if (spidev_parse_args(&SpiDev_writebytes_parser, SPIDEV_ARGS_FWD, &obj) < 0)
+		return NULL;
+
+	t0 = spidev_now_ns();
+	obj = SpiDev_writebytes2_common(self, obj);
+	spidev_stats_call(self, t0);
+	return obj;
 }
 
+SPIDEV_LOCKED_FASTCALL(SpiDev_writebytes)
+
+PyDoc_STRVAR(SpiDev_read_doc,
+	"read(len) -> [values]\n\n"
+	"Read len words from SPI device.\n"
+	"Large reads will be done in multiple blocks.\n"
+	"The type of the result is selected by output_type.\n");
+
+static const char * const spidev_len_keywords[] = {"len", NULL};
+static SpiDevArgParser SpiDev_readbytes_parser = {"readbytes", spidev_len_keywords, 1};
+
 static PyObject *
-SpiDev_get_loop(SpiDevObject *self, void *closure)
+SpiDev_readbytes_impl(SpiDevObject *self, SPIDEV_ARGS)
 {
-	PyObject *result;
+	uint8_t	*data, *alloc;
+	int		status, word;
+	Py_ssize_t	len = 0, block;
+	PyObject	*result, *obj;
+	uint64_t	t0;
+
+	if (spidev_parse_args(&SpiDev_readbytes_parser, SPIDEV_ARGS_FWD, &obj) < 0 ||
+	    spidev_arg_ssize(obj, &len) < 0)
+		return NULL;
+	t0 = spidev_now_ns();
 
-	if (self->mode & SPI_LOOP)
-		result = Py_True;
-	else
-		result = Py_False;
+	/* read at least 1 word */
+	if (len < 1)
+		len = 1;
 
-	Py_INCREF(result);
+	word = SPIDEV_WORD_SIZE(self, 0);
+	if (len > PY_SSIZE_T_MAX / word) {
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+		return NULL;
+	}
+	len *= word;
+
+	if (spidev_rx_buffer(self, len, &result, &data, &alloc, 1, word) < 0)
+		return NULL;
+
+	block = spidev_word_block(SPIDEV_BLOCK_SIZE(self), word);
+
+	SPIDEV_BEGIN_ALLOW_THREADS(self)
+	status = spidev_read_blocks(self, data, len, block);
+	SPIDEV_END_ALLOW_THREADS(self)
+
+	if (status < 0) {
+		Py_XDECREF(result);
+		spidev_scratch_put(self, SPIDEV_SCRATCH_RX, alloc);
+		spidev_set_errno(status);
+		spidev_stats_call(self, t0);
+		return NULL;
+	}
+
+	if (!result)
+		result = spidev_rx_values(data, len, 0, word);
+
+	spidev_scratch_put(self, SPIDEV_SCRATCH_RX, alloc);
+	spidev_stats_call(self, t0);
 	return result;
 }
 
+SPIDEV_LOCKED_FASTCALL(SpiDev_readbytes)
+
 static PyObject *
-SpiDev_get_no_cs(SpiDevObject *self, void *closure)
+SpiDev_writebytes2_buffer(SpiDevObject *self, Py_buffer *buffer)
 {
-        PyObject *result;
+	int		status, word;
+	Py_ssize_t	spi_max_block;
 
-        if (self->mode & SPI_NO_CS)
-                result = Py_True;
-        else
-                result = Py_False;
+	word = SPIDEV_WORD_SIZE(self, 0);
+	if (buffer->len % word) {
+		PyErr_Format(PyExc_ValueError,
+			"Buffer size is not a multiple of the word size (%d bytes).", word);
+		return NULL;
+	}
 
-        Py_INCREF(result);
-        return result;
-}
+	spi_max_block = spidev_word_block(SPIDEV_BLOCK_SIZE(self), word);
 
+	SPIDEV_BEGIN_ALLOW_THREADS(self)
+	status = spidev_write_blocks(self, buffer->buf, buffer->len, spi_max_block);
+	SPIDEV_END_ALLOW_THREADS(self)
 
-static int
-SpiDev_set_mode(SpiDevObject *self, PyObject *val, void *closure)
-{
-	uint8_t mode, tmp;
-	int ret;
+	if (status < 0) {
+		spidev_set_errno(status);
+		return NULL;
+	}
 
-	if (val == NULL) {
-		PyErr_SetString(PyExc_TypeError,
-			"Cannot delete attribute");
-		return -1;
-	}
-#if PY_MAJOR_VERSION < 3
-	if (PyInt_Check(val)) {
-		mode = PyInt_AS_LONG(val);
-	} else
-#endif
-	{
-		if (PyLong_Check(val)) {
-			mode = PyLong_AS_LONG(val);
-		} else {
-			PyErr_SetString(PyExc_TypeError,
-				"The mode attribute must be an integer");
-			return -1;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+SpiDev_writebytes2_seq_internal(SpiDevObject *self, PyObject *seq, Py_ssize_t len, uint8_t *buf, Py_ssize_t bufsize, int word)
+{
+	int		status;
+	Py_ssize_t	jj, remain, block_size;
+
+	// len and block_size count words, bufsize bytes
+	bufsize /= word;
+	remain = len;
+	jj = 0;
+	while (remain > 0) {
+		block_size = (remain < bufsize) ? remain : bufsize;
+
+		if (spidev_seq_copy(seq, jj, block_size, buf, word) < 0)
+			return NULL;
+
+		SPIDEV_BEGIN_ALLOW_THREADS(self)
+		status = spidev_write_blocks(self, buf, block_size * word, block_size * word);
+		SPIDEV_END_ALLOW_THREADS(self)
+
+		if (status < 0) {
+			spidev_set_errno(status);
+			return NULL;
 		}
+
+		jj += block_size;
+		remain -= block_size;
 	}
 
+	Py_INCREF(Py_None);
+	return Py_None;
+}
 
-	if ( mode > 3 ) {
-		PyErr_SetString(PyExc_TypeError,
-			"The mode attribute must be an integer"
-				 "between 0 and 3.");
-		return -1;
+static PyObject *
+SpiDev_writebytes2_seq(SpiDevObject *self, PyObject *seq)
+{
+	Py_ssize_t	len, bufsize, spi_max_block;
+	PyObject	*result = NULL;
+	uint8_t	*buf;
+	int		word;
+
+	len = PySequence_Fast_GET_SIZE(seq);
+	if (len <= 0) {
+		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+		return NULL;
 	}
 
-	// clean and set CPHA and CPOL bits
-	tmp = ( self->mode & ~(SPI_CPHA | SPI_CPOL) ) | mode ;
+	word = SPIDEV_WORD_SIZE(self, 0);
+	spi_max_block = spidev_word_block(SPIDEV_BLOCK_SIZE(self), word);
 
-	ret = __spidev_set_mode(self->fd, tmp);
+	bufsize = (len < spi_max_block / word) ? len * word : spi_max_block;
 
-	if (ret != -1)
-		self->mode = tmp;
-	return ret;
+	// The values are converted one block at a time into the tx scratch buffer
+	if ((buf = spidev_scratch_get(self, SPIDEV_SCRATCH_TX, bufsize)) == NULL)
+		return NULL;
+
+	result = SpiDev_writebytes2_seq_internal(self, seq, len, buf, bufsize, word);
+
+	spidev_scratch_put(self, SPIDEV_SCRATCH_TX, buf);
+	return result;
 }
 
-static int
-SpiDev_set_cshigh(SpiDevObject *self, PyObject *val, void *closure)
+static PyObject *
+SpiDev_writebytes2_common(SpiDevObject *self, PyObject *obj)
 {
-	uint8_t tmp;
-	int ret;
+	PyObject	*seq;
+	PyObject	*result = NULL;
 
-	if (val == NULL) {
-		PyErr_SetString(PyExc_TypeError,
-			"Cannot delete attribute");
-		return -1;
+	// Try using buffer protocol if object supports it.
+	if (PyObject_CheckBuffer(obj) && 1) {
+		Py_buffer	buffer;
+		if (PyObject_GetBuffer(obj, &buffer, PyBUF_SIMPLE) != -1) {
+			result = SpiDev_writebytes2_buffer(self, &buffer);
+			PyBuffer_Release(&buffer);
+			return result;
+		}
 	}
-	else if (!PyBool_Check(val)) {
-		PyErr_SetString(PyExc_TypeError,
-			"The cshigh attribute must be boolean");
-		return -1;
+
+
+	// Otherwise, fall back to sequence protocol
+	seq = PySequence_Fast(obj, "expected a sequence");
+	if (seq == NULL) {
+		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+		return NULL;
 	}
 
-	if (val == Py_True)
-		tmp = self->mode | SPI_CS_HIGH;
-	else
-		tmp = self->mode & ~SPI_CS_HIGH;
+	result = SpiDev_writebytes2_seq(self, seq);
 
-	ret = __spidev_set_mode(self->fd, tmp);
+	Py_DECREF(seq);
 
-	if (ret != -1)
-		self->mode = tmp;
-	return ret;
+	return result;
 }
 
-static int
-SpiDev_set_lsbfirst(SpiDevObject *self, PyObject *val, void *closure)
+PyDoc_STRVAR(SpiDev_writebytes2_doc,
+	"writebytes2([values]) -> None\n\n"
+	"Write bytes to SPI device.\n"
+	"values must be a list or buffer.\n");
+
+static SpiDevArgParser SpiDev_writebytes2_parser = {"writebytes2", spidev_values_keywords, 1};
+
+static PyObject *
+SpiDev_writebytes2_impl(SpiDevObject *self, SPIDEV_ARGS)
 {
-	uint8_t tmp;
-	int ret;
+	PyObject	*obj;
 
-	if (val == NULL) {
-		PyErr_SetString(PyExc_TypeError,
-			"Cannot delete attribute");
-		return -1;
-	}
-	else if (!PyBool_Check(val)) {
-		PyErr_SetString(PyExc_TypeError,
-			"The lsbfirst attribute must be boolean");
-		return -1;
-	}
+	uint64_t	t0;
 
-	if (val == Py_True)
-		tmp = self->mode | SPI_LSB_FIRST;
-	else
-		tmp = self->mode & ~SPI_LSB_FIRST;
+	if (spidev_parse_args(&SpiDev_writebytes2_parser, SPIDEV_ARGS_FWD, &obj) < 0)
+		return NULL;
 
-	ret = __spidev_set_mode(self->fd, tmp);
+	t0 = spidev_now_ns();
+	obj = SpiDev_writebytes2_common(self, obj);
+	spidev_stats_call(self, t0);
+	return obj;
+}
 
-	if (ret != -1)
-		self->mode = tmp;
-	return ret;
+SPIDEV_LOCKED_FASTCALL(SpiDev_writebytes2)
+
+// Files.
+// Data is moved between the device and files in blocks, without the GIL.
+// When there is more than one block to move, a helper thread runs the
+// producer side (the device when reading to a file, the file when writing
+// from one) while the calling thread runs the consumer, every block going
+// through one of two buffers, so disk and bus I/O overlap.
+
+// Fill or empty len bytes of buf, pos bytes into the transfer. Returns 0 or
+// a negative errno value.
+typedef int (*spidev_pipe_fn)(void *ctx, uint8_t *buf, size_t len, unsigned long long pos);
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint8_t *buf[2];
+	size_t fill[2];		/* bytes ready in each buffer, 0 while empty */
+	size_t block;
+	unsigned long long total;
+	spidev_pipe_fn produce;
+	void *ctx;
+	int error;		/* of either side, stops the other one */
+} SpiDevPipe;
+
+static void *
+spidev_pipe_producer(void *arg)
+{
+	SpiDevPipe *pp = arg;
+	unsigned long long pos;
+	size_t len;
+	int slot = 0, status;
+
+	for (pos = 0; pos < pp->total; pos += len, slot ^= 1) {
+		len = (pp->total - pos < pp->block) ? pp->total - pos : pp->block;
+
+		pthread_mutex_lock(&pp->lock);
+		while (pp->fill[slot] && !pp->error)
+			pthread_cond_wait(&pp->cond, &pp->lock);
+		status = pp->error;
+		pthread_mutex_unlock(&pp->lock);
+		if (status)
+			break;
+
+		status = pp->produce(pp->ctx, pp->buf[slot], len, pos);
+
+		pthread_mutex_lock(&pp->lock);
+		if (status < 0)
+			pp->error = status;
+		else
+			pp->fill[slot] = len;
+		pthread_cond_signal(&pp->cond);
+		pthread_mutex_unlock(&pp->lock);
+		if (status < 0)
+			break;
+	}
+	return NULL;
 }
 
+// Move total bytes in blocks of at most block bytes, filled by produce() and
+// emptied by consume(), through the two buffers buf. Must be called without
+// the GIL, returns 0 or a negative errno value.
 static int
-SpiDev_set_3wire(SpiDevObject *self, PyObject *val, void *closure)
+spidev_pipe_run(uint8_t **buf, size_t block, unsigned long long total,
+		spidev_pipe_fn produce, void *pctx, spidev_pipe_fn consume, void *cctx)
 {
-	uint8_t tmp;
-	int ret;
-
-	if (val == NULL) {
-		PyErr_SetString(PyExc_TypeError,
-			"Cannot delete attribute");
-		return -1;
+	SpiDevPipe pp;
+	pthread_t thread;
+	unsigned long long pos;
+	size_t len;
+	int slot = 0, status = 0;
+
+	memset(&pp, 0, sizeof(pp));
+	pp.buf[0] = buf[0];
+	pp.buf[1] = buf[1];
+	pp.block = block;
+	pp.total = total;
+	pp.produce = produce;
+	pp.ctx = pctx;
+	pthread_mutex_init(&pp.lock, NULL);
+	pthread_cond_init(&pp.cond, NULL);
+
+	// A single block, or no thread: one side after the other
+	if (total <= block || pthread_create(&thread, NULL, spidev_pipe_producer, &pp) != 0) {
+		for (pos = 0; pos < total && status == 0; pos += len) {
+			len = (total - pos < block) ? total - pos : block;
+			status = produce(pctx, buf[0], len, pos);
+			if (status == 0)
+				status = consume(cctx, buf[0], len, pos);
+		}
+		goto out;
 	}
-	else if (!PyBool_Check(val)) {
-		PyErr_SetString(PyExc_TypeError,
-			"The 3wire attribute must be boolean");
-		return -1;
+
+	for (pos = 0; pos < total; pos += len, slot ^= 1) {
+		len = (total - pos < block) ? total - pos : block;
+
+		pthread_mutex_lock(&pp.lock);
+		while (!pp.fill[slot] && !pp.error)
+			pthread_cond_wait(&pp.cond, &pp.lock);
+		status = pp.fill[slot] ? 0 : pp.error;
+		pthread_mutex_unlock(&pp.lock);
+		if (status)
+			break;
+
+		status = consume(cctx, buf[slot], len, pos);
+
+		pthread_mutex_lock(&pp.lock);
+		pp.fill[slot] = 0;
+		if (status < 0)
+			pp.error = status;
+		pthread_cond_signal(&pp.cond);
+		pthread_mutex_unlock(&pp.lock);
+		if (status < 0)
+			break;
 	}
+	pthread_join(thread, NULL);
 
-	if (val == Py_True)
-		tmp = self->mode | SPI_3WIRE;
-	else
-		tmp = self->mode & ~SPI_3WIRE;
+out:
+	pthread_cond_destroy(&pp.cond);
+	pthread_mutex_destroy(&pp.lock);
+	return status;
+}
 
-	ret = __spidev_set_mode(self->fd, tmp);
+// Write all len bytes to fd. Without the GIL.
+static int
+spidev_write_fd(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t count;
+
+	while (len > 0) {
+		count = write(fd, buf, len);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += count;
+		len -= count;
+	}
+	return 0;
+}
 
-	if (ret != -1)
-		self->mode = tmp;
-	return ret;
+// Read all len bytes of fd at offset, or from its position if offset is
+// negative. Without the GIL.
+static int
+spidev_pread_fd(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+	ssize_t count;
+
+	while (len > 0) {
+		count = offset < 0 ? read(fd, buf, len) : pread(fd, buf, len, offset);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (count == 0)
+			return -ENODATA;	/* file truncated meanwhile */
+		buf += count;
+		if (offset >= 0)
+			offset += count;
+		len -= count;
+	}
+	return 0;
 }
 
+// The two kinds of pipe ends: a file descriptor, or the device in blocks
+typedef struct {
+	int fd;
+	off_t offset;		/* of the first byte for reads, -1 for pipes */
+} SpiDevFileEnd;
+
+typedef struct {
+	SpiDevObject *dev;
+	size_t block;
+} SpiDevDevEnd;
+
 static int
-SpiDev_set_no_cs(SpiDevObject *self, PyObject *val, void *closure)
+spidev_pipe_file_write(void *ctx, uint8_t *buf, size_t len, unsigned long long pos)
 {
-        uint8_t tmp;
-	int ret;
+	return spidev_write_fd(((SpiDevFileEnd *)ctx)->fd, buf, len);
+}
 
-        if (val == NULL) {
-                PyErr_SetString(PyExc_TypeError,
-                        "Cannot delete attribute");
-                return -1;
-        }
-        else if (!PyBool_Check(val)) {
-                PyErr_SetString(PyExc_TypeError,
-                        "The no_cs attribute must be boolean");
-                return -1;
-        }
+static int
+spidev_pipe_file_read(void *ctx, uint8_t *buf, size_t len, unsigned long long pos)
+{
+	SpiDevFileEnd *end = ctx;
 
-        if (val == Py_True)
-                tmp = self->mode | SPI_NO_CS;
-        else
-                tmp = self->mode & ~SPI_NO_CS;
+	return spidev_pread_fd(end->fd, buf, len, end->offset < 0 ? -1 : end->offset + (off_t)pos);
+}
 
-        ret = __spidev_set_mode(self->fd, tmp);
+static int
+spidev_pipe_dev_read(void *ctx, uint8_t *buf, size_t len, unsigned long long pos)
+{
+	SpiDevDevEnd *end = ctx;
 
-	if (ret != -1)
-		self->mode = tmp;
-        return ret;
+	return spidev_read_blocks(end->dev, buf, len, end->block);
 }
 
+static int
+spidev_pipe_dev_write(void *ctx, uint8_t *buf, size_t len, unsigned long long pos)
+{
+	SpiDevDevEnd *end = ctx;
+
+	return spidev_write_blocks(end->dev, buf, len, end->block);
+}
 
+// Get the two scratch buffers of dev for a pipe of total bytes in blocks
 static int
-SpiDev_set_loop(SpiDevObject *self, PyObject *val, void *closure)
+spidev_pipe_buffers(SpiDevObject *dev, uint8_t **buf, size_t block, unsigned long long total)
 {
-	uint8_t tmp;
-	int ret;
+	size_t len = (total < block) ? (total ? total : 1) : block;
 
-	if (val == NULL) {
-		PyErr_SetString(PyExc_TypeError,
-			"Cannot delete attribute");
+	if ((buf[0] = spidev_scratch_get(dev, SPIDEV_SCRATCH_TX, len)) == NULL)
 		return -1;
-	}
-	else if (!PyBool_Check(val)) {
-		PyErr_SetString(PyExc_TypeError,
-			"The loop attribute must be boolean");
+	if ((buf[1] = spidev_scratch_get(dev, SPIDEV_SCRATCH_RX, len)) == NULL) {
+		spidev_scratch_put(dev, SPIDEV_SCRATCH_TX, buf[0]);
 		return -1;
 	}
+	return 0;
+}
 
-	if (val == Py_True)
-		tmp = self->mode | SPI_LOOP;
-	else
-		tmp = self->mode & ~SPI_LOOP;
-
-	ret = __spidev_set_mode(self->fd, tmp);
-
-	if (ret != -1)
-		self->mode = tmp;
-	return ret;
+static void
+spidev_pipe_buffers_put(SpiDevObject *dev, uint8_t **buf)
+{
+	spidev_scratch_put(dev, SPIDEV_SCRATCH_RX, buf[1]);
+	spidev_scratch_put(dev, SPIDEV_SCRATCH_TX, buf[0]);
 }
 
-static PyObject *
-SpiDev_get_bits_per_word(SpiDevObject *self, void *closure)
+// Whether obj is a path: str, bytes or os.PathLike
+static int
+spidev_is_path(PyObject *obj)
 {
-	PyObject *result = Py_BuildValue("i", self->bits_per_word);
-	Py_INCREF(result);
-	return result;
+#if PY_MAJOR_VERSION >= 3
+	return PyUnicode_Check(obj) || PyBytes_Check(obj) ||
+		PyObject_HasAttrString(obj, "__fspath__");
+#else
+	return PyString_Check(obj) || PyUnicode_Check(obj);
+#endif
 }
 
+// File descriptor to move data to or from. obj is a path, opened with flags,
+// a file descriptor, or an object with fileno() such as an open file, which
+// is flushed first. *opened is set when spidev_file_close() must close it.
 static int
-SpiDev_set_bits_per_word(SpiDevObject *self, PyObject *val, void *closure)
+spidev_file_open(PyObject *obj, int flags, int *opened)
 {
-	uint8_t bits;
+	PyObject *ret;
+	int fd;
 
-	if (val == NULL) {
-		PyErr_SetString(PyExc_TypeError,
-			"Cannot delete attribute");
-		return -1;
-	}
-#if PY_MAJOR_VERSION < 3
-	if (PyInt_Check(val)) {
-		bits = PyInt_AS_LONG(val);
-	} else
+	*opened = 0;
+	if (spidev_is_path(obj)) {
+#if PY_MAJOR_VERSION >= 3
+		PyObject *path;
+
+		if (!PyUnicode_FSConverter(obj, &path))
+			return -1;
+		Py_BEGIN_ALLOW_THREADS
+		fd = open(PyBytes_AS_STRING(path), flags | O_CLOEXEC, 0666);
+		Py_END_ALLOW_THREADS
+		Py_DECREF(path);
+#else
+		const char *path = PyString_AsString(obj);
+
+		if (!path)
+			return -1;
+		Py_BEGIN_ALLOW_THREADS
+		fd = open(path, flags | O_CLOEXEC, 0666);
+		Py_END_ALLOW_THREADS
 #endif
-	{
-		if (PyLong_Check(val)) {
-			bits = PyLong_AS_LONG(val);
-		} else {
-			PyErr_SetString(PyExc_TypeError,
-				"The bits_per_word attribute must be an integer");
+		if (fd < 0) {
+			PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError, obj);
 			return -1;
 		}
+		*opened = 1;
+		return fd;
 	}
 
-		if (bits < 8 || bits > 32) {
-		PyErr_SetString(PyExc_TypeError,
-			"invalid bits_per_word (8 to 32)");
-		return -1;
+	// Data the file object buffered goes first
+	if (!PyInt_Check(obj) && !PyLong_Check(obj) && PyObject_HasAttrString(obj, "flush")) {
+		if ((ret = PyObject_CallMethod(obj, "flush", NULL)) == NULL)
+			return -1;
+		Py_DECREF(ret);
 	}
+	return PyObject_AsFileDescriptor(obj);
+}
 
-	if (self->bits_per_word != bits) {
-		if (ioctl(self->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) == -1) {
+// Done with a descriptor of spidev_file_open(): close it if it was opened,
+// otherwise bring the position of a file object back in step. close() can
+// report write errors deferred until then, so its result is checked.
+static int
+spidev_file_close(PyObject *obj, int fd, int opened)
+{
+	PyObject *ret;
+
+	if (opened) {
+		if (close(fd) < 0) {
 			PyErr_SetFromErrno(PyExc_IOError);
 			return -1;
 		}
-		self->bits_per_word = bits;
+		return 0;
+	}
+	if (!PyInt_Check(obj) && !PyLong_Check(obj) && PyObject_HasAttrString(obj, "seek")) {
+		if ((ret = PyObject_CallMethod(obj, "seek", "ii", 0, SEEK_CUR)) == NULL)
+			return -1;
+		Py_DECREF(ret);
+	}
+	return 0;
+}
+
+PyDoc_STRVAR(SpiDev_read_to_file_doc,
+	"read_to_file(file, nbytes) -> nbytes\n\n"
+	"Read nbytes bytes from the device into file: a path (the file is\n"
+	"created or truncated), a file descriptor or an open file, written at\n"
+	"its current position, or a writable buffer such as an mmap.\n"
+	"Reads overlap with the writes to the file.\n");
+
+static const char * const SpiDev_read_to_file_keywords[] = {"file", "nbytes", NULL};
+static SpiDevArgParser SpiDev_read_to_file_parser = {"read_to_file", SpiDev_read_to_file_keywords, 2};
+
+static PyObject *
+SpiDev_read_to_file_impl(SpiDevObject *self, SPIDEV_ARGS)
+{
+	PyObject *args_out[2], *obj;
+	Py_ssize_t nbytes = 0;
+	SpiDevDevEnd dev = {self, 0};
+	SpiDevFileEnd file = {-1, 0};
+	Py_buffer view;
+	uint8_t *buf[2];
+	int opened, status, word;
+	uint64_t t0;
+
+	if (spidev_parse_args(&SpiDev_read_to_file_parser, SPIDEV_ARGS_FWD, args_out) < 0 ||
+	    spidev_arg_ssize(args_out[1], &nbytes) < 0)
+		return NULL;
+	obj = args_out[0];
+
+	word = SPIDEV_WORD_SIZE(self, 0);
+	if (nbytes < 0) {
+		PyErr_SetString(PyExc_ValueError, "nbytes must not be negative");
+		return NULL;
+	}
+	if (nbytes % word) {
+		PyErr_Format(PyExc_ValueError,
+			"nbytes must be a multiple of the word size (%d bytes).", word);
+		return NULL;
+	}
+	dev.block = spidev_word_block(SPIDEV_BLOCK_SIZE(self), word);
+	t0 = spidev_now_ns();
+
+	if (PyObject_CheckBuffer(obj) && !spidev_is_path(obj)) {
+		if (PyObject_GetBuffer(obj, &view, PyBUF_WRITABLE) == -1)
+			return NULL;
+		if (view.len < nbytes) {
+			PyBuffer_Release(&view);
+			PyErr_SetString(PyExc_ValueError, "buffer is smaller than nbytes");
+			return NULL;
+		}
+		SPIDEV_BEGIN_ALLOW_THREADS(self)
+		status = spidev_read_blocks(self, view.buf, nbytes, dev.block);
+		SPIDEV_END_ALLOW_THREADS(self)
+		PyBuffer_Release(&view);
+	} else {
+		file.fd = spidev_file_open(obj, O_WRONLY | O_CREAT | O_TRUNC, &opened);
+		if (file.fd < 0)
+			return NULL;
+		if (spidev_pipe_buffers(self, buf, dev.block, nbytes) < 0) {
+			spidev_file_close(obj, file.fd, opened);
+			return NULL;
+		}
+
+		SPIDEV_BEGIN_ALLOW_THREADS(self)
+		posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		status = spidev_pipe_run(buf, dev.block, nbytes,
+			spidev_pipe_dev_read, &dev, spidev_pipe_file_write, &file);
+		SPIDEV_END_ALLOW_THREADS(self)
+
+		spidev_pipe_buffers_put(self, buf);
+		if (spidev_file_close(obj, file.fd, opened) < 0 && status == 0)
+			status = 1;
+	}
+	spidev_stats_call(self, t0);
+
+	if (status) {
+		if (status < 0)
+			spidev_set_errno(status);
+		return NULL;
+	}
+	return PyLong_FromSsize_t(nbytes);
+}
+
+SPIDEV_LOCKED_FASTCALL(SpiDev_read_to_file)
+
+PyDoc_STRVAR(SpiDev_write_from_file_doc,
+	"write_from_file(file[, offset, nbytes]) -> nbytes\n\n"
+	"Write nbytes bytes of file, starting at offset (0), to the device, as\n"
+	"writebytes2 does. file is a path, a file descriptor or an open file\n"
+	"(read at offset, its position is unchanged), or a buffer such as an\n"
+	"mmap. nbytes defaults to the rest of the file. Reads from the file\n"
+	"overlap with the writes to the device.\n");
+
+static const char * const SpiDev_write_from_file_keywords[] = {"file", "offset", "nbytes", NULL};
+static SpiDevArgParser SpiDev_write_from_file_parser = {"write_from_file", SpiDev_write_from_file_keywords, 1};
+
+static PyObject *
+SpiDev_write_from_file_impl(SpiDevObject *self, SPIDEV_ARGS)
+{
+	PyObject *args_out[3], *obj;
+	Py_ssize_t offset = 0, nbytes = -1;
+	SpiDevDevEnd dev = {self, 0};
+	SpiDevFileEnd file = {-1, 0};
+	Py_buffer view;
+	struct stat st;
+	uint8_t *buf[2];
+	int opened, status, word;
+	uint64_t t0;
+
+	if (spidev_parse_args(&SpiDev_write_from_file_parser, SPIDEV_ARGS_FWD, args_out) < 0 ||
+	    spidev_arg_ssize(args_out[1], &offset) < 0 ||
+	    spidev_arg_ssize(args_out[2] == Py_None ? NULL : args_out[2], &nbytes) < 0)
+		return NULL;
+	obj = args_out[0];
+
+	if (offset < 0) {
+		PyErr_SetString(PyExc_ValueError, "offset must not be negative");
+		return NULL;
+	}
+	// -1 stands for "not given", a negative count passed in is an error
+	if (args_out[2] && args_out[2] != Py_None && nbytes < 0) {
+		PyErr_SetString(PyExc_ValueError, "nbytes must not be negative");
+		return NULL;
+	}
+	word = SPIDEV_WORD_SIZE(self, 0);
+	dev.block = spidev_word_block(SPIDEV_BLOCK_SIZE(self), word);
+
+	if (PyObject_CheckBuffer(obj) && !spidev_is_path(obj)) {
+		if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) == -1)
+			return NULL;
+		if (nbytes < 0)
+			nbytes = view.len > offset ? view.len - offset : 0;
+		if (offset > view.len || nbytes > view.len - offset) {
+			PyBuffer_Release(&view);
+			PyErr_SetString(PyExc_ValueError, "range exceeds the buffer");
+			return NULL;
+		}
+	} else {
+		file.fd = spidev_file_open(obj, O_RDONLY, &opened);
+		if (file.fd < 0)
+			return NULL;
+		file.offset = offset;
+		if (fstat(file.fd, &st) < 0) {
+			PyErr_SetFromErrno(PyExc_IOError);
+			spidev_file_close(obj, file.fd, opened);
+			return NULL;
+		}
+		if (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || S_ISCHR(st.st_mode)) {
+			// No pread(), the data is read as it comes
+			if (offset) {
+				spidev_file_close(obj, file.fd, opened);
+				PyErr_SetString(PyExc_ValueError, "offset must be 0 for pipes and devices");
+				return NULL;
+			}
+			file.offset = -1;
+		}
+		if (S_ISREG(st.st_mode)) {
+			if (nbytes < 0)
+				nbytes = st.st_size > offset ? st.st_size - offset : 0;
+			if (offset > st.st_size || nbytes > st.st_size - offset) {
+				spidev_file_close(obj, file.fd, opened);
+				PyErr_SetString(PyExc_ValueError, "range exceeds the file");
+				return NULL;
+			}
+		} else if (nbytes < 0) {
+			spidev_file_close(obj, file.fd, opened);
+			PyErr_SetString(PyExc_ValueError, "nbytes is needed for files of unknown size");
+			return NULL;
+		}
+	}
+
+	if (nbytes % word) {
+		if (file.fd < 0)
+			PyBuffer_Release(&view);
+		else
+			spidev_file_close(obj, file.fd, opened);
+		PyErr_Format(PyExc_ValueError,
+			"nbytes must be a multiple of the word size (%d bytes).", word);
+		return NULL;
+	}
+	t0 = spidev_now_ns();
+
+	if (file.fd < 0) {
+		SPIDEV_BEGIN_ALLOW_THREADS(self)
+		status = spidev_write_blocks(self, (uint8_t *)view.buf + offset, nbytes, dev.block);
+		SPIDEV_END_ALLOW_THREADS(self)
+		PyBuffer_Release(&view);
+	} else {
+		if (spidev_pipe_buffers(self, buf, dev.block, nbytes) < 0) {
+			spidev_file_close(obj, file.fd, opened);
+			return NULL;
+		}
+
+		SPIDEV_BEGIN_ALLOW_THREADS(self)
+		if (file.offset >= 0) {
+			posix_fadvise(file.fd, offset, nbytes, POSIX_FADV_SEQUENTIAL);
+			posix_fadvise(file.fd, offset, nbytes, POSIX_FADV_WILLNEED);
+		}
+		status = spidev_pipe_run(buf, dev.block, nbytes,
+			spidev_pipe_file_read, &file, spidev_pipe_dev_write, &dev);
+		SPIDEV_END_ALLOW_THREADS(self)
+
+		spidev_pipe_buffers_put(self, buf);
+		if (spidev_file_close(obj, file.fd, opened) < 0 && status == 0)
+			status = 1;
+	}
+	spidev_stats_call(self, t0);
+
+	if (status) {
+		if (status < 0)
+			spidev_set_errno(status);
+		return NULL;
+	}
+	return PyLong_FromSsize_t(nbytes);
+}
+
+SPIDEV_LOCKED_FASTCALL(SpiDev_write_from_file)
+
+static const char * const spidev_xfer_keywords[] = {
+	"values", "speed_hz", "delay_usecs", "bits_per_word", NULL
+};
+
+// Parse the (values[, speed_hz, delay_usecs, bits_per_word]) arguments of
+// the xfer methods. Each optional argument is left alone if not given.
+static int
+spidev_xfer_args(SpiDevArgParser *parser, SPIDEV_ARGS, PyObject **obj,
+		uint32_t *speed_hz, uint16_t *delay_usecs, uint8_t *bits_per_word)
+{
+	PyObject *argv[4];
+	unsigned long long speed = *speed_hz, delay = *delay_usecs, bits = *bits_per_word;
+
+	if (spidev_parse_args(parser, SPIDEV_ARGS_FWD, argv) < 0 ||
+	    spidev_arg_mask(argv[1], &speed) < 0 ||
+	    spidev_arg_mask(argv[2], &delay) < 0 ||
+	    spidev_arg_mask(argv[3], &bits) < 0)
+		return -1;
+
+	*obj = argv[0];
+	*speed_hz = (uint32_t)speed;
+	*delay_usecs = (uint16_t)delay;
+	*bits_per_word = (uint8_t)bits;
+	return 0;
+}
+
+// Shared implementation of xfer, xfer2 and xfer3. Transfers of any size are
+// split in blocks, all of them run in a single GIL-free section.
+// (xfer uses one transfer per byte when built with SPIDEV_SINGLE)
+static PyObject *
+spidev_xfer_common(SpiDevObject *self, PyObject *obj, uint32_t speed_hz,
+		uint16_t delay_usecs, uint8_t bits_per_word, int single, int as_tuple)
+{
+	int status, word;
+	Py_ssize_t len, block;
+	PyObject *result = NULL;
+	SpiDevTxData tx;
+	struct spi_ioc_transfer xfer;
+	uint8_t *txbuf, *rxbuf;
+	uint8_t *txalloc = NULL, *rxalloc = NULL;
+	uint64_t t0 = spidev_now_ns();
+
+	word = SPIDEV_WORD_SIZE(self, bits_per_word);
+	if (spidev_tx_open(obj, &tx, word) < 0)
+		return NULL;
+
+	len = tx.len;
+	if (len <= 0) {
+		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+		goto out;
+	}
+
+	// Buffers are transmitted in place, sequences are converted first
+	if ((txbuf = spidev_tx_buffer(self, &tx, &txalloc)) == NULL)
+		goto out;
+
+	// Bytes-like results are received in place, lists are built afterwards
+	if (spidev_rx_buffer(self, len, &result, &rxbuf, &rxalloc, 1, word) < 0)
+		goto out;
+
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.delay_usecs = delay_usecs;
+	xfer.speed_hz = speed_hz ? speed_hz : self->max_speed_hz;
+	xfer.bits_per_word = bits_per_word ? bits_per_word : self->bits_per_word;
+
+	block = spidev_word_block(SPIDEV_BLOCK_SIZE(self), word);
+
+	SPIDEV_BEGIN_ALLOW_THREADS(self)
+#ifdef SPIDEV_SINGLE
+	if (single)
+		status = spidev_xfer_single(self, &xfer, txbuf, rxbuf, len, word);
+	else
+#endif
+	status = spidev_xfer_blocks(self, &xfer, txbuf, rxbuf, len, block);
+	if (status == 0)
+		spidev_read0(self);
+	SPIDEV_END_ALLOW_THREADS(self)
+
+	if (status < 0) {
+		Py_CLEAR(result);
+		spidev_set_errno(status);
+		goto out;
+	}
+
+	if (!result) {
+		if (self->output_type == SPIDEV_OUTPUT_LIST)
+			result = spidev_rx_values(rxbuf, len, 0, word);
+		else if (as_tuple)
+			result = spidev_rx_values(rxbuf, len, 1, word);
+		else
+			result = spidev_rx_legacy(obj, rxbuf, len, word);
+	}
+
+out:
+	spidev_scratch_put(self, SPIDEV_SCRATCH_TX, txalloc);
+	spidev_scratch_put(self, SPIDEV_SCRATCH_RX, rxalloc);
+	spidev_tx_close(&tx);
+	spidev_stats_call(self, t0);
+	return result;
+}
+
+PyDoc_STRVAR(SpiDev_xfer_doc,
+	"xfer([values]) -> [values]\n\n"
+	"Perform SPI transaction.\n"
+	"CS will be released and reactivated between blocks.\n"
+	"delay specifies delay in usec between blocks.\n");
+
+static SpiDevArgParser SpiDev_xfer_parser = {"xfer", spidev_xfer_keywords, 1};
+
+static PyObject *
+SpiDev_xfer_impl(SpiDevObject *self, SPIDEV_ARGS)
+{
+	uint16_t delay_usecs = 0;
+	uint32_t speed_hz = 0;
+	uint8_t bits_per_word = 0;
+	PyObject *obj;
+
+	if (spidev_xfer_args(&SpiDev_xfer_parser, SPIDEV_ARGS_FWD, &obj, &speed_hz, &delay_usecs, &bits_per_word) < 0)
+		return NULL;
+
+	return spidev_xfer_common(self, obj, speed_hz, delay_usecs, bits_per_word, 1, 0);
+}
+
+SPIDEV_LOCKED_FASTCALL(SpiDev_xfer)
+
+
+PyDoc_STRVAR(SpiDev_xfer2_doc,
+	"xfer2([values]) -> [values]\n\n"
+	"Perform SPI transaction.\n"
+	"CS will be held active between blocks.\n"
+	"Input larger than the block size is sent as multiple transactions.\n");
+
+static SpiDevArgParser SpiDev_xfer2_parser = {"xfer2", spidev_xfer_keywords, 1};
+
+static PyObject *
+SpiDev_xfer2_impl(SpiDevObject *self, SPIDEV_ARGS)
+{
+	uint16_t delay_usecs = 0;
+	uint32_t speed_hz = 0;
+	uint8_t bits_per_word = 0;
+	PyObject *obj;
+
+	if (spidev_xfer_args(&SpiDev_xfer2_parser, SPIDEV_ARGS_FWD, &obj, &speed_hz, &delay_usecs, &bits_per_word) < 0)
+		return NULL;
+
+	return spidev_xfer_common(self, obj, speed_hz, delay_usecs, bits_per_word, 0, 0);
+}
+
+SPIDEV_LOCKED_FASTCALL(SpiDev_xfer2)
+
+PyDoc_STRVAR(SpiDev_xfer3_doc,
+	"xfer3([values]) -> (values)\n\n"
+	"Perform SPI transaction. Accepts input of arbitrary size.\n"
+	"Large blocks will be send as multiple transactions\n"
+	"CS will be held active between blocks.\n");
+
+static SpiDevArgParser SpiDev_xfer3_parser = {"xfer3", spidev_xfer_keywords, 1};
+
+static PyObject *
+SpiDev_xfer3_impl(SpiDevObject *self, SPIDEV_ARGS)
+{
+	uint16_t delay_usecs = 0;
+	uint32_t speed_hz = 0;
+	uint8_t bits_per_word = 0;
+	PyObject *obj;
+
+	if (spidev_xfer_args(&SpiDev_xfer3_parser, SPIDEV_ARGS_FWD, &obj, &speed_hz, &delay_usecs, &bits_per_word) < 0)
+		return NULL;
+
+	return spidev_xfer_common(self, obj, speed_hz, delay_usecs, bits_per_word, 0, 1);
+}
+
+SPIDEV_LOCKED_FASTCALL(SpiDev_xfer3)
+
+PyDoc_STRVAR(SpiDev_xfer_into_doc,
+	"xfer_into(tx, rx[, speed_hz, delay_usecs, bits_per_word]) -> None\n\n"
+	"Perform SPI transaction directly on caller supplied buffers.\n"
+	"tx may be any object supporting the buffer protocol, rx must be\n"
+	"a writable buffer (bytearray, memoryview, numpy array, ...) at\n"
+	"least as large as tx. tx and rx may be the same object.\n"
+	"CS will be held active for the whole transaction.\n");
+
+static const char * const SpiDev_xfer_into_keywords[] = {
+	"tx", "rx", "speed_hz", "delay_usecs", "bits_per_word", NULL
+};
+static SpiDevArgParser SpiDev_xfer_into_parser = {"xfer_into", SpiDev_xfer_into_keywords, 2};
+
+static PyObject *
+SpiDev_xfer_into_impl(SpiDevObject *self, SPIDEV_ARGS)
+{
+	int status;
+	uint16_t delay_usecs;
+	uint32_t speed_hz;
+	uint8_t bits_per_word;
+	unsigned long long speed = 0, delay = 0, bits = 0;
+	PyObject *argv[5], *txobj, *rxobj;
+	Py_buffer txview, rxview;
+	struct spi_ioc_transfer xfer;
+	uint64_t t0;
+
+	if (spidev_parse_args(&SpiDev_xfer_into_parser, SPIDEV_ARGS_FWD, argv) < 0 ||
+	    spidev_arg_mask(argv[2], &speed) < 0 ||
+	    spidev_arg_mask(argv[3], &delay) < 0 ||
+	    spidev_arg_mask(argv[4], &bits) < 0)
+		return NULL;
+	txobj = argv[0];
+	rxobj = argv[1];
+	speed_hz = (uint32_t)speed;
+	delay_usecs = (uint16_t)delay;
+	bits_per_word = (uint8_t)bits;
+	t0 = spidev_now_ns();
+
+	if (PyObject_GetBuffer(txobj, &txview, PyBUF_SIMPLE) == -1)
+		return NULL;
+
+	if (PyObject_GetBuffer(rxobj, &rxview, PyBUF_WRITABLE) == -1) {
+		PyBuffer_Release(&txview);
+		return NULL;
+	}
+
+	if (txview.len <= 0) {
+		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+		goto fail;
+	}
+
+	if (rxview.len < txview.len) {
+		PyErr_Format(PyExc_ValueError,
+			"rx buffer too small (%zd bytes, %zd needed)",
+			rxview.len, txview.len);
+		goto fail;
+	}
+
+	if ((size_t)txview.len > UINT32_MAX) {
+		PyErr_Format(PyExc_OverflowError, "Argument size exceeds %u bytes.", UINT32_MAX);
+		goto fail;
+	}
+
+	if (txview.len % SPIDEV_WORD_SIZE(self, bits_per_word)) {
+		PyErr_Format(PyExc_ValueError,
+			"Buffer size is not a multiple of the word size (%d bytes).",
+			SPIDEV_WORD_SIZE(self, bits_per_word));
+		goto fail;
+	}
+
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.tx_buf = (unsigned long)txview.buf;
+	xfer.rx_buf = (unsigned long)rxview.buf;
+	xfer.len = txview.len;
+	xfer.delay_usecs = delay_usecs;
+	xfer.speed_hz = speed_hz ? speed_hz : self->max_speed_hz;
+	xfer.bits_per_word = bits_per_word ? bits_per_word : self->bits_per_word;
+
+	SPIDEV_BEGIN_ALLOW_THREADS(self)
+	status = spidev_ioctl(self, SPI_IOC_MESSAGE(1), &xfer);
+	if (status >= 0)
+		spidev_read0(self);
+	SPIDEV_END_ALLOW_THREADS(self)
+
+	if (status < 0) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		goto fail;
+	}
+
+	PyBuffer_Release(&rxview);
+	PyBuffer_Release(&txview);
+	spidev_stats_call(self, t0);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+
+fail:
+	PyBuffer_Release(&rxview);
+	PyBuffer_Release(&txview);
+	spidev_stats_call(self, t0);
+	return NULL;
+}
+
+SPIDEV_LOCKED_FASTCALL(SpiDev_xfer_into)
+
+// One entry of a multi-segment transaction as described by a Python dict.
+// Buffers are left as (borrowed) objects, callers decide how to map them.
+typedef struct {
+	PyObject *tx;		/* "tx" entry or NULL if missing */
+	PyObject *rx;		/* "rx" entry or NULL if missing */
+				/* tx and rx are strong references */
+	Py_ssize_t len;		/* "len" entry or -1 if missing */
+	uint32_t speed_hz;
+	uint16_t delay_usecs;
+	uint8_t bits_per_word;
+	uint8_t cs_change;
+	uint8_t tx_nbits;
+	uint8_t rx_nbits;
+} SpiDevSegment;
+
+static const char *spidev_segment_keys[] = {
+	"tx", "rx", "len", "speed_hz", "delay_usecs", "bits_per_word",
+	"cs_change", "tx_nbits", "rx_nbits", NULL
+};
+
+// Look up key in dict as a new reference, or NULL if it is missing.
+// Returns -1 with exception set on error.
+static int
+spidev_dict_get(PyObject *dict, const char *key, PyObject **value)
+{
+#if PY_VERSION_HEX >= 0x030D0000
+	return PyDict_GetItemStringRef(dict, key, value) < 0 ? -1 : 0;
+#elif PY_MAJOR_VERSION >= 3
+	PyObject *name = PyUnicode_FromString(key);
+
+	if (!name)
+		return -1;
+	*value = PyDict_GetItemWithError(dict, name);
+	Py_DECREF(name);
+	if (!*value)
+		return PyErr_Occurred() ? -1 : 0;
+	Py_INCREF(*value);
+	return 0;
+#else
+	*value = PyDict_GetItemString(dict, key);
+	Py_XINCREF(*value);
+	return 0;
+#endif
+}
+
+// Whether the dict key key is the string name
+static int
+spidev_segment_key_is(PyObject *key, const char *name)
+{
+#if PY_MAJOR_VERSION < 3
+	PyObject *ascii;
+	int equal;
+
+	if (PyString_Check(key))
+		return strcmp(PyString_AS_STRING(key), name) == 0;
+	if (!PyUnicode_Check(key))
+		return 0;
+	if ((ascii = PyUnicode_AsASCIIString(key)) == NULL) {
+		PyErr_Clear();
+		return 0;
+	}
+	equal = strcmp(PyString_AS_STRING(ascii), name) == 0;
+	Py_DECREF(ascii);
+	return equal;
+#else
+	return PyUnicode_Check(key) && PyUnicode_CompareWithASCIIString(key, name) == 0;
+#endif
+}
+
+// Fetch an optional unsigned integer entry from a segment dict.
+// Returns 1 if found, 0 if missing, -1 with exception set on error.
+static int
+spidev_segment_uint(PyObject *dict, const char *key, unsigned long max, unsigned long *value)
+{
+	PyObject *val;
+
+	if (spidev_dict_get(dict, key, &val) < 0)
+		return -1;
+	if (val == NULL)
+		return 0;
+
+	*value = PyLong_AsUnsignedLong(val);
+	Py_DECREF(val);
+	if (*value == (unsigned long)-1 && PyErr_Occurred())
+		return -1;
+
+	if (*value > max) {
+		PyErr_Format(PyExc_OverflowError,
+			"Segment %s out of range (0 to %lu).", key, max);
+		return -1;
+	}
+	return 1;
+}
+
+// Drop the references held by a parsed segment
+static void
+spidev_segment_clear(SpiDevSegment *seg)
+{
+	Py_CLEAR(seg->tx);
+	Py_CLEAR(seg->rx);
+}
+
+// Parse the segment dict obj into seg, to be released with
+// spidev_segment_clear() on success.
+static int
+spidev_parse_segment(PyObject *obj, SpiDevSegment *seg)
+{
+	PyObject *key, *val, *unknown = NULL;
+	Py_ssize_t pos = 0;
+	unsigned long tmp;
+	int ii;
+
+	memset(seg, 0, sizeof(*seg));
+	seg->len = -1;
+
+	if (!PyDict_Check(obj)) {
+		PyErr_SetString(PyExc_TypeError, "Segments must be dicts.");
+		return -1;
+	}
+
+	Py_BEGIN_CRITICAL_SECTION(obj);
+	while (!unknown && PyDict_Next(obj, &pos, &key, &val)) {
+		for (ii = 0; spidev_segment_keys[ii]; ii++) {
+			if (spidev_segment_key_is(key, spidev_segment_keys[ii]))
+				break;
+		}
+		if (spidev_segment_keys[ii] == NULL) {
+			Py_INCREF(key);
+			unknown = key;
+		}
+	}
+	Py_END_CRITICAL_SECTION();
+	if (unknown) {
+#if PY_MAJOR_VERSION < 3
+		PyObject *repr = PyObject_Repr(unknown);
+
+		if (repr) {
+			PyErr_Format(PyExc_KeyError, "Unknown segment key %s.", PyString_AS_STRING(repr));
+			Py_DECREF(repr);
+		}
+#else
+		PyErr_Format(PyExc_KeyError, "Unknown segment key %R.", unknown);
+#endif
+		Py_DECREF(unknown);
+		return -1;
+	}
+
+	if (spidev_dict_get(obj, "tx", &seg->tx) < 0 ||
+	    spidev_dict_get(obj, "rx", &seg->rx) < 0)
+		goto fail;
+
+	switch (spidev_segment_uint(obj, "len", UINT32_MAX, &tmp)) {
+	case -1: goto fail;
+	case 1: seg->len = tmp;
+	}
+	switch (spidev_segment_uint(obj, "speed_hz", UINT32_MAX, &tmp)) {
+	case -1: goto fail;
+	case 1: seg->speed_hz = tmp;
+	}
+	switch (spidev_segment_uint(obj, "delay_usecs", UINT16_MAX, &tmp)) {
+	case -1: goto fail;
+	case 1: seg->delay_usecs = tmp;
+	}
+	switch (spidev_segment_uint(obj, "bits_per_word", 32, &tmp)) {
+	case -1: goto fail;
+	case 1: seg->bits_per_word = tmp;
+	}
+	switch (spidev_segment_uint(obj, "tx_nbits", 8, &tmp)) {
+	case -1: goto fail;
+	case 1: seg->tx_nbits = tmp;
+	}
+	switch (spidev_segment_uint(obj, "rx_nbits", 8, &tmp)) {
+	case -1: goto fail;
+	case 1: seg->rx_nbits = tmp;
+	}
+
+	if (spidev_dict_get(obj, "cs_change", &val) < 0)
+		goto fail;
+	if (val != NULL) {
+		int truth = PyObject_IsTrue(val);
+
+		Py_DECREF(val);
+		if (truth < 0)
+			goto fail;
+		seg->cs_change = truth;
+	}
+
+	return 0;
+
+fail:
+	spidev_segment_clear(seg);
+	return -1;
+}
+
+// Copy per-segment settings into a kernel transfer descriptor.
+// Buffers and length are filled by the caller.
+static void
+spidev_segment_fill(const SpiDevSegment *seg, struct spi_ioc_transfer *xfer)
+{
+	xfer->speed_hz = seg->speed_hz;
+	xfer->delay_usecs = seg->delay_usecs;
+	xfer->bits_per_word = seg->bits_per_word;
+	xfer->cs_change = seg->cs_change;
+#ifdef SPI_IOC_WR_MODE32
+	xfer->tx_nbits = seg->tx_nbits;
+#endif
+#ifdef SPI_IOC_RD_MODE32
+	xfer->rx_nbits = seg->rx_nbits;
+#endif
+}
+
+// Buffers pinned for one segment while a transaction is in flight
+typedef struct {
+	Py_buffer tx;
+	Py_buffer rx;
+	PyObject *result;	/* what is reported back for this segment */
+} SpiDevSegmentRefs;
+
+// Map the tx/rx entries of a parsed segment onto xfer, lists being packed
+// in words of word bytes.
+// On success refs holds everything that must be released after the ioctl.
+static int
+spidev_segment_map(Py_ssize_t index, const SpiDevSegment *seg, int word,
+		struct spi_ioc_transfer *xfer, SpiDevSegmentRefs *refs)
+{
+	Py_ssize_t len = seg->len;
+
+	if (seg->tx != NULL && seg->tx != Py_None) {
+		if (PyObject_CheckBuffer(seg->tx)) {
+			if (PyObject_GetBuffer(seg->tx, &refs->tx, PyBUF_SIMPLE) == -1)
+				return -1;
+		} else {
+			PyObject *bytes = spidev_seq_to_bytes(seg->tx, word);
+			int status;
+
+			if (!bytes)
+				return -1;
+			status = PyObject_GetBuffer(bytes, &refs->tx, PyBUF_SIMPLE);
+			Py_DECREF(bytes);
+			if (status == -1)
+				return -1;
+		}
+		if (len < 0)
+			len = refs->tx.len;
+		else if (refs->tx.len < len) {
+			PyErr_Format(PyExc_ValueError,
+				"Segment %zd: tx holds %zd bytes, %zd needed.",
+				index, refs->tx.len, len);
+			return -1;
+		}
+		xfer->tx_buf = (unsigned long)refs->tx.buf;
+	}
+
+	if (seg->rx == NULL) {
+		// No rx given: collect received data into a new bytes object
+		if (len < 0) {
+			PyErr_Format(PyExc_ValueError,
+				"Segment %zd: either tx, rx or len must be given.", index);
+			return -1;
+		}
+		refs->result = PyBytes_FromStringAndSize(NULL, len);
+		if (!refs->result)
+			return -1;
+		xfer->rx_buf = (unsigned long)PyBytes_AS_STRING(refs->result);
+	} else if (seg->rx == Py_None) {
+		// Received data is explicitly discarded
+		if (len < 0) {
+			PyErr_Format(PyExc_ValueError,
+				"Segment %zd: either tx or len must be given.", index);
+			return -1;
+		}
+		Py_INCREF(Py_None);
+		refs->result = Py_None;
+	} else {
+		if (PyObject_GetBuffer(seg->rx, &refs->rx, PyBUF_WRITABLE) == -1)
+			return -1;
+		if (len < 0)
+			len = refs->rx.len;
+		else if (refs->rx.len < len) {
+			PyErr_Format(PyExc_ValueError,
+				"Segment %zd: rx holds %zd bytes, %zd needed.",
+				index, refs->rx.len, len);
+			return -1;
+		}
+		Py_INCREF(seg->rx);
+		refs->result = seg->rx;
+		xfer->rx_buf = (unsigned long)refs->rx.buf;
+	}
+
+	if ((size_t)len > UINT32_MAX) {
+		PyErr_Format(PyExc_OverflowError, "Argument size exceeds %u bytes.", UINT32_MAX);
+		return -1;
+	}
+	if (len % word) {
+		PyErr_Format(PyExc_ValueError,
+			"Segment %zd: length is not a multiple of the word size (%d bytes).",
+			index, word);
+		return -1;
+	}
+	xfer->len = len;
+	spidev_segment_fill(seg, xfer);
+	return 0;
+}
+
+static void
+spidev_segment_release(SpiDevSegmentRefs *refs)
+{
+	PyBuffer_Release(&refs->tx);
+	PyBuffer_Release(&refs->rx);
+	Py_CLEAR(refs->result);
+}
+
+PyDoc_STRVAR(SpiDev_transfer_doc,
+	"transfer([segments]) -> [results]\n\n"
+	"Perform a multi-segment SPI transaction with a single ioctl.\n"
+	"Each segment is a dict with the optional keys:\n"
+	"  tx            - buffer or list of values to send\n"
+	"  rx            - writable buffer receiving data, None to discard\n"
+	"                  it; if missing a bytes object is returned\n"
+	"  len           - number of bytes (defaults to len(tx) or len(rx))\n"
+	"  speed_hz, delay_usecs, bits_per_word, cs_change,\n"
+	"  tx_nbits, rx_nbits\n"
+	"Returns a list holding the received data of every segment.\n"
+	"CS is held active between segments unless cs_change is set.\n");
+
+static const char * const SpiDev_transfer_keywords[] = {"segments", NULL};
+static SpiDevArgParser SpiDev_transfer_parser = {"transfer", SpiDev_transfer_keywords, 1};
+
+static PyObject *
+SpiDev_transfer_impl(SpiDevObject *self, SPIDEV_ARGS)
+{
+	int status;
+	Py_ssize_t ii, nsegs;
+	PyObject *obj, *seq, *result = NULL;
+	struct spi_ioc_transfer *xfers = NULL;
+	SpiDevSegmentRefs *refs = NULL;
+	SpiDevSegment seg;
+	uint64_t t0;
+
+	if (spidev_parse_args(&SpiDev_transfer_parser, SPIDEV_ARGS_FWD, &obj) < 0)
+		return NULL;
+	t0 = spidev_now_ns();
+
+	seq = PySequence_Fast(obj, "expected a sequence of segments");
+	if (!seq)
+		return NULL;
+
+	nsegs = PySequence_Fast_GET_SIZE(seq);
+	if (nsegs <= 0) {
+		Py_DECREF(seq);
+		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+		return NULL;
+	}
+
+	if ((size_t)nsegs > SPIDEV_MAX_SEGMENTS) {
+		Py_DECREF(seq);
+		PyErr_Format(PyExc_OverflowError,
+			"Too many segments (max %d).", (int)SPIDEV_MAX_SEGMENTS);
+		return NULL;
+	}
+
+	// The transfers and the references they hold live in the scratch buffers
+	xfers = (struct spi_ioc_transfer *)spidev_scratch_get(self, SPIDEV_SCRATCH_TX, nsegs * sizeof(*xfers));
+	refs = (SpiDevSegmentRefs *)spidev_scratch_get(self, SPIDEV_SCRATCH_RX, nsegs * sizeof(*refs));
+	if (!xfers || !refs) {
+		spidev_scratch_put(self, SPIDEV_SCRATCH_RX, (uint8_t *)refs);
+		refs = NULL;
+		goto out;
+	}
+	memset(xfers, 0, nsegs * sizeof(*xfers));
+	memset(refs, 0, nsegs * sizeof(*refs));
+
+	for (ii = 0; ii < nsegs; ii++) {
+		if (spidev_parse_segment(PySequence_Fast_GET_ITEM(seq, ii), &seg) < 0)
+			goto out;
+		status = spidev_segment_map(ii, &seg, SPIDEV_WORD_SIZE(self, seg.bits_per_word),
+				&xfers[ii], &refs[ii]);
+		spidev_segment_clear(&seg);
+		if (status < 0)
+			goto out;
+	}
+
+	SPIDEV_BEGIN_ALLOW_THREADS(self)
+	status = spidev_ioctl(self, SPI_IOC_MESSAGE(nsegs), xfers);
+	if (status >= 0)
+		spidev_read0(self);
+	SPIDEV_END_ALLOW_THREADS(self)
+
+	if (status < 0) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		goto out;
+	}
+
+	result = PyList_New(nsegs);
+	if (!result)
+		goto out;
+	for (ii = 0; ii < nsegs; ii++) {
+		PyList_SET_ITEM(result, ii, refs[ii].result);  // Steals reference
+		refs[ii].result = NULL;
+	}
+
+out:
+	if (refs) {
+		for (ii = 0; ii < nsegs; ii++)
+			spidev_segment_release(&refs[ii]);
+	}
+	spidev_scratch_put(self, SPIDEV_SCRATCH_RX, (uint8_t *)refs);
+	spidev_scratch_put(self, SPIDEV_SCRATCH_TX, (uint8_t *)xfers);
+	Py_DECREF(seq);
+	spidev_stats_call(self, t0);
+	return result;
+}
+
+SPIDEV_LOCKED_FASTCALL(SpiDev_transfer)
+
+typedef struct {
+	PyObject_HEAD
+
+	Py_ssize_t nsegs;	/* number of segments */
+	struct spi_ioc_transfer *xfers;	/* prebuilt kernel descriptors */
+	uint8_t *data;	/* tx and rx storage of all segments */
+	Py_ssize_t size;	/* size of data in bytes */
+	Py_ssize_t unsized;	/* first segment without bits_per_word, or -1 */
+} SpiMessageObject;
+
+static PyTypeObject SpiMessageObjectType;
+
+static PyObject *
+SpiMessage_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	SpiMessageObject *self;
+	PyObject *obj, *seq;
+	SpiDevSegment *segs = NULL;
+	Py_ssize_t ii, nsegs, offset;
+	static char *kwlist[] = {"segments", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:SpiMessage", kwlist, &obj))
+		return NULL;
+
+	seq = PySequence_Fast(obj, "expected a sequence of segments");
+	if (!seq)
+		return NULL;
+
+	nsegs = PySequence_Fast_GET_SIZE(seq);
+	if (nsegs <= 0) {
+		Py_DECREF(seq);
+		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+		return NULL;
+	}
+
+	if ((size_t)nsegs > SPIDEV_MAX_SEGMENTS) {
+		Py_DECREF(seq);
+		PyErr_Format(PyExc_OverflowError,
+			"Too many segments (max %d).", (int)SPIDEV_MAX_SEGMENTS);
+		return NULL;
+	}
+
+	if ((self = (SpiMessageObject *)type->tp_alloc(type, 0)) == NULL) {
+		Py_DECREF(seq);
+		return NULL;
+	}
+
+	self->nsegs = nsegs;
+	self->unsized = -1;
+	self->xfers = calloc(nsegs, sizeof(*self->xfers));
+	segs = calloc(nsegs, sizeof(*segs));
+	if (!self->xfers || !segs) {
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+		goto fail;
+	}
+
+	// First pass: validate segments and lay out the storage
+	for (ii = 0; ii < nsegs; ii++) {
+		SpiDevSegment *seg = &segs[ii];
+
+		if (spidev_parse_segment(PySequence_Fast_GET_ITEM(seq, ii), seg) < 0)
+			goto fail;
+
+		if (seg->rx != NULL && seg->rx != Py_None) {
+			PyErr_Format(PyExc_TypeError,
+				"Segment %zd: SpiMessage owns its rx storage, rx may only be None.", ii);
+			goto fail;
+		}
+
+		// Without bits_per_word the segment is packed in bytes, execute()
+		// checks that the device has 8 bit words
+		if (!seg->bits_per_word && self->unsized < 0)
+			self->unsized = ii;
+
+		if (seg->len < 0) {
+			SpiDevTxData tx;
+
+			if (seg->tx == NULL || seg->tx == Py_None) {
+				PyErr_Format(PyExc_ValueError,
+					"Segment %zd: either tx or len must be given.", ii);
+				goto fail;
+			}
+			if (spidev_tx_open(seg->tx, &tx, spidev_word_size(seg->bits_per_word)) < 0)
+				goto fail;
+			seg->len = tx.len;
+			spidev_tx_close(&tx);
+		}
+		if (seg->len % spidev_word_size(seg->bits_per_word)) {
+			PyErr_Format(PyExc_ValueError,
+				"Segment %zd: length is not a multiple of the word size (%d bytes).",
+				ii, spidev_word_size(seg->bits_per_word));
+			goto fail;
+		}
+
+		self->size += seg->len;
+		if (seg->rx == NULL)
+			self->size += seg->len;
+	}
+
+	// A single page aligned block keeps the whole message in as few pages as possible
+	if (self->size > 0) {
+		if (posix_memalign((void **)&self->data, spidev_page_size(), self->size) != 0) {
+			self->data = NULL;
+			PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+			goto fail;
+		}
+		memset(self->data, 0, self->size);
+	}
+
+	// Second pass: fill in initial tx data and the kernel descriptors
+	for (offset = 0, ii = 0; ii < nsegs; ii++) {
+		SpiDevSegment *seg = &segs[ii];
+		struct spi_ioc_transfer *xfer = &self->xfers[ii];
+
+		xfer->len = seg->len;
+		xfer->tx_buf = (unsigned long)(self->data + offset);
+		if (seg->tx != NULL && seg->tx != Py_None) {
+			SpiDevTxData tx;
+			int status;
+
+			if (spidev_tx_open(seg->tx, &tx, spidev_word_size(seg->bits_per_word)) < 0)
+				goto fail;
+			status = spidev_tx_copy(&tx, 0, tx.len < seg->len ? tx.len : seg->len,
+					self->data + offset);
+			spidev_tx_close(&tx);
+			if (status < 0)
+				goto fail;
+		}
+		offset += seg->len;
+
+		if (seg->rx == NULL) {
+			xfer->rx_buf = (unsigned long)(self->data + offset);
+			offset += seg->len;
+		}
+		spidev_segment_fill(seg, xfer);
+	}
+
+	for (ii = 0; ii < nsegs; ii++)
+		spidev_segment_clear(&segs[ii]);
+	free(segs);
+	Py_DECREF(seq);
+	return (PyObject *)self;
+
+fail:
+	if (segs) {
+		for (ii = 0; ii < nsegs; ii++)
+			spidev_segment_clear(&segs[ii]);
+	}
+	free(segs);
+	Py_DECREF(seq);
+	Py_DECREF(self);
+	return NULL;
+}
+
+static void
+SpiMessage_dealloc(SpiMessageObject *self)
+{
+	free(self->xfers);
+	free(self->data);
+
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static Py_ssize_t
+SpiMessage_length(SpiMessageObject *self)
+{
+	return self->nsegs;
+}
+
+static int
+SpiMessage_getbuffer(SpiMessageObject *self, Py_buffer *view, int flags)
+{
+	return PyBuffer_FillInfo(view, (PyObject *)self, self->data, self->size, 0, flags);
+}
+
+// Return a memoryview over [ptr, ptr + len) of the message storage.
+// The view keeps the message alive for as long as it exists.
+static PyObject *
+SpiMessage_view(SpiMessageObject *self, unsigned long ptr, Py_ssize_t len)
+{
+	PyObject *full, *view;
+	Py_ssize_t start = (uint8_t *)(uintptr_t)ptr - self->data;
+
+	if ((full = PyMemoryView_FromObject((PyObject *)self)) == NULL)
+		return NULL;
+	view = PySequence_GetSlice(full, start, start + len);
+	Py_DECREF(full);
+	return view;
+}
+
+static int
+SpiMessage_index(SpiMessageObject *self, Py_ssize_t *index)
+{
+	if (*index < 0)
+		*index += self->nsegs;
+	if (*index < 0 || *index >= self->nsegs) {
+		PyErr_SetString(PyExc_IndexError, "segment index out of range");
+		return -1;
+	}
+	return 0;
+}
+
+PyDoc_STRVAR(SpiMessage_tx_doc,
+	"tx(index) -> memoryview\n\n"
+	"Writable view of the tx bytes of segment index.\n");
+
+static PyObject *
+SpiMessage_tx(SpiMessageObject *self, PyObject *args)
+{
+	Py_ssize_t index;
+
+	if (!PyArg_ParseTuple(args, "n:tx", &index))
+		return NULL;
+	if (SpiMessage_index(self, &index) < 0)
+		return NULL;
+
+	return SpiMessage_view(self, self->xfers[index].tx_buf, self->xfers[index].len);
+}
+
+PyDoc_STRVAR(SpiMessage_rx_doc,
+	"rx(index) -> memoryview\n\n"
+	"View of the bytes received by segment index during the last execute().\n"
+	"Returns None for segments created with rx=None.\n");
+
+static PyObject *
+SpiMessage_rx(SpiMessageObject *self, PyObject *args)
+{
+	Py_ssize_t index;
+
+	if (!PyArg_ParseTuple(args, "n:rx", &index))
+		return NULL;
+	if (SpiMessage_index(self, &index) < 0)
+		return NULL;
+
+	if (!self->xfers[index].rx_buf) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	return SpiMessage_view(self, self->xfers[index].rx_buf, self->xfers[index].len);
+}
+
+PyDoc_STRVAR(SpiMessage_set_tx_doc,
+	"set_tx(index, data[, offset]) -> None\n\n"
+	"Patch the tx bytes of segment index in place, starting at byte offset.\n"
+	"data may be a buffer or a list of values, packed by the segment bits_per_word.\n");
+
+static PyObject *
+SpiMessage_set_tx(SpiMessageObject *self, PyObject *args)
+{
+	Py_ssize_t index, offset = 0;
+	PyObject *obj, *bytes = NULL;
+	Py_buffer view;
+	struct spi_ioc_transfer *xfer;
+
+	if (!PyArg_ParseTuple(args, "nO|n:set_tx", &index, &obj, &offset))
+		return NULL;
+	if (SpiMessage_index(self, &index) < 0)
+		return NULL;
+	xfer = &self->xfers[index];
+
+	if (!PyObject_CheckBuffer(obj)) {
+		bytes = spidev_seq_to_bytes(obj, spidev_word_size(xfer->bits_per_word));
+		if (!bytes)
+			return NULL;
+	}
+	if (PyObject_GetBuffer(bytes ? bytes : obj, &view, PyBUF_SIMPLE) == -1) {
+		Py_XDECREF(bytes);
+		return NULL;
+	}
+
+	if (offset < 0 || offset > (Py_ssize_t)xfer->len ||
+	    view.len > (Py_ssize_t)xfer->len - offset) {
+		PyErr_Format(PyExc_ValueError,
+			"Data does not fit segment %zd (%u bytes).", index, xfer->len);
+		PyBuffer_Release(&view);
+		Py_XDECREF(bytes);
+		return NULL;
+	}
+
+	memcpy((uint8_t *)(uintptr_t)xfer->tx_buf + offset, view.buf, view.len);
+	PyBuffer_Release(&view);
+	Py_XDECREF(bytes);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyMethodDef SpiMessage_methods[] = {
+	{"tx", (PyCFunction)SpiMessage_tx, METH_VARARGS,
+		SpiMessage_tx_doc},
+	{"rx", (PyCFunction)SpiMessage_rx, METH_VARARGS,
+		SpiMessage_rx_doc},
+	{"set_tx", (PyCFunction)SpiMessage_set_tx, METH_VARARGS,
+		SpiMessage_set_tx_doc},
+	{NULL},
+};
+
+static PySequenceMethods SpiMessage_as_sequence = {
+	(lenfunc)SpiMessage_length,	/* sq_length */
+};
+
+static PyBufferProcs SpiMessage_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+	0,				/* bf_getreadbuffer */
+	0,				/* bf_getwritebuffer */
+	0,				/* bf_getsegcount */
+	0,				/* bf_getcharbuffer */
+#endif
+	(getbufferproc)SpiMessage_getbuffer,	/* bf_getbuffer */
+	0,				/* bf_releasebuffer */
+};
+
+#if PY_MAJOR_VERSION < 3
+#define SPIMESSAGE_TPFLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER)
+#else
+#define SPIMESSAGE_TPFLAGS Py_TPFLAGS_DEFAULT
+#endif
+
+PyDoc_STRVAR(SpiMessageObjectType_doc,
+	"SpiMessage([segments]) -> message\n\n"
+	"Precompiled SPI transaction, run it with SpiDev.execute().\n"
+	"segments use the same format as SpiDev.transfer(); tx data is\n"
+	"copied into storage owned by the message, received data is\n"
+	"kept there as well and can be read with rx(index).\n");
+
+static PyTypeObject SpiMessageObjectType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"SpiMessage",			/* tp_name */
+	sizeof(SpiMessageObject),	/* tp_basicsize */
+	0,				/* tp_itemsize */
+	(destructor)SpiMessage_dealloc,	/* tp_dealloc */
+	0,				/* tp_print */
+	0,				/* tp_getattr */
+	0,				/* tp_setattr */
+	0,				/* tp_compare */
+	0,				/* tp_repr */
+	0,				/* tp_as_number */
+	&SpiMessage_as_sequence,	/* tp_as_sequence */
+	0,				/* tp_as_mapping */
+	0,				/* tp_hash */
+	0,				/* tp_call */
+	0,				/* tp_str */
+	0,				/* tp_getattro */
+	0,				/* tp_setattro */
+	&SpiMessage_as_buffer,		/* tp_as_buffer */
+	SPIMESSAGE_TPFLAGS,		/* tp_flags */
+	SpiMessageObjectType_doc,	/* tp_doc */
+	0,				/* tp_traverse */
+	0,				/* tp_clear */
+	0,				/* tp_richcompare */
+	0,				/* tp_weaklistoffset */
+	0,				/* tp_iter */
+	0,				/* tp_iternext */
+	SpiMessage_methods,		/* tp_methods */
+	0,				/* tp_members */
+	0,				/* tp_getset */
+	0,				/* tp_base */
+	0,				/* tp_dict */
+	0,				/* tp_descr_get */
+	0,				/* tp_descr_set */
+	0,				/* tp_dictoffset */
+	0,				/* tp_init */
+	0,				/* tp_alloc */
+	SpiMessage_new,			/* tp_new */
+};
+
+PyDoc_STRVAR(SpiDev_execute_doc,
+	"execute(message) -> None\n\n"
+	"Run a precompiled SpiMessage with a single ioctl. Segments without\n"
+	"bits_per_word need a device with 8 bits per word.\n"
+	"Received data is stored in the message, see SpiMessage.rx().\n");
+
+static const char * const SpiDev_execute_keywords[] = {"message", NULL};
+static SpiDevArgParser SpiDev_execute_parser = {"execute", SpiDev_execute_keywords, 1};
+
+static PyObject *
+SpiDev_execute_impl(SpiDevObject *self, SPIDEV_ARGS)
+{
+	int status;
+	SpiMessageObject *msg;
+	uint64_t t0;
+
+	if (spidev_parse_args(&SpiDev_execute_parser, SPIDEV_ARGS_FWD, (PyObject **)&msg) < 0)
+		return NULL;
+	if (!PyObject_TypeCheck(msg, &SpiMessageObjectType)) {
+		PyErr_Format(PyExc_TypeError,
+			"execute() argument 1 must be spidev.SpiMessage, not %.50s",
+			Py_TYPE(msg)->tp_name);
+		return NULL;
+	}
+	// As transfer() would, segments without bits_per_word take the word
+	// size of the device, which must match the bytes they were packed in
+	if (msg->unsized >= 0 && SPIDEV_WORD_SIZE(self, 0) != 1) {
+		PyErr_Format(PyExc_ValueError,
+			"Segment %zd: packed in bytes, but the device has %u bits per word; "
+			"give the segment bits_per_word.", msg->unsized, (unsigned)self->bits_per_word);
+		return NULL;
+	}
+	t0 = spidev_now_ns();
+
+	SPIDEV_BEGIN_ALLOW_THREADS(self)
+	status = spidev_ioctl(self, SPI_IOC_MESSAGE(msg->nsegs), msg->xfers);
+	if (status >= 0)
+		spidev_read0(self);
+	SPIDEV_END_ALLOW_THREADS(self)
+
+	if (status < 0) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		spidev_stats_call(self, t0);
+		return NULL;
+	}
+	spidev_stats_call(self, t0);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+SPIDEV_LOCKED_FASTCALL(SpiDev_execute)
+
+// Largest dummy phase accepted by flash_read
+#define FLASH_READ_MAX_DUMMY 16
+
+// Read len bytes of a serial flash starting at address, as messages of two
+// transfers: command, address and dummy bytes from hdr at single width, then
+// at most block bytes of data at the width set in tmpl[1]. The address in hdr
+// is advanced message by message. Must be called without the GIL, returns 0
+// or a negative errno value.
+static int
+spidev_flash_read_blocks(SpiDevObject *dev, const struct spi_ioc_transfer *tmpl, uint8_t *hdr,
+		int addr_bytes, unsigned long long address, uint8_t *rx, size_t len, size_t block)
+{
+	struct spi_ioc_transfer xfer[2];
+	size_t block_size;
+	int ii;
+
+	xfer[0] = tmpl[0];
+	xfer[1] = tmpl[1];
+	xfer[0].tx_buf = (unsigned long)hdr;
+
+	while (len > 0) {
+		block_size = (len < block) ? len : block;
+
+		for (ii = 0; ii < addr_bytes; ii++)
+			hdr[1 + ii] = (uint8_t)(address >> (8 * (addr_bytes - 1 - ii)));
+		xfer[1].rx_buf = (unsigned long)rx;
+		xfer[1].len = block_size;
+		if (spidev_ioctl(dev, SPI_IOC_MESSAGE(2), xfer) < 0)
+			return -errno;
+
+		rx += block_size;
+		address += block_size;
+		len -= block_size;
+	}
+	return 0;
+}
+
+PyDoc_STRVAR(SpiDev_flash_read_doc,
+	"flash_read(address, length[, command, address_bytes, dummy_bytes, data_nbits, into])\n\n"
+	"Read length bytes of a serial NOR flash from address. Command (0x6B,\n"
+	"quad output fast read, by default), address_bytes address bytes and\n"
+	"dummy_bytes dummy bytes are sent at single width, the data is received\n"
+	"with data_nbits (1, 2 or 4) wires in the same message.\n"
+	"Reads larger than block_size take several messages.\n"
+	"The data is returned as selected by output_type, or stored into the\n"
+	"writable buffer into, and None returned.\n");
+
+static const char * const SpiDev_flash_read_keywords[] = {
+	"address", "length", "command", "address_bytes", "dummy_bytes",
+	"data_nbits", "into", NULL
+};
+static SpiDevArgParser SpiDev_flash_read_parser = {"flash_read", SpiDev_flash_read_keywords, 2};
+
+static PyObject *
+SpiDev_flash_read_impl(SpiDevObject *self, SPIDEV_ARGS)
+{
+	unsigned long long address = 0;
+	Py_ssize_t length = 0, block;
+	uint8_t command = 0x6B, address_bytes = 3, dummy_bytes = 1, data_nbits = 4;
+	uint8_t hdr[1 + 4 + FLASH_READ_MAX_DUMMY];
+	uint8_t *data, *alloc = NULL;
+	int status, hdr_len;
+	unsigned long long opt[4], limit;
+	PyObject *argv[7], *into, *result = NULL;
+	Py_buffer view;
+	struct spi_ioc_transfer tmpl[2];
+	uint64_t t0 = spidev_now_ns();
+
+	opt[0] = command;
+	opt[1] = address_bytes;
+	opt[2] = dummy_bytes;
+	opt[3] = data_nbits;
+	if (spidev_parse_args(&SpiDev_flash_read_parser, SPIDEV_ARGS_FWD, argv) < 0 ||
+	    spidev_arg_mask(argv[0], &address) < 0 ||
+	    spidev_arg_ssize(argv[1], &length) < 0 ||
+	    spidev_arg_mask(argv[2], &opt[0]) < 0 ||
+	    spidev_arg_mask(argv[3], &opt[1]) < 0 ||
+	    spidev_arg_mask(argv[4], &opt[2]) < 0 ||
+	    spidev_arg_mask(argv[5], &opt[3]) < 0)
+		return NULL;
+	into = argv[6] ? argv[6] : Py_None;
+
+	if (length <= 0) {
+		PyErr_SetString(PyExc_ValueError, "length must be positive");
+		return NULL;
+	}
+	if (opt[0] > 0xFF) {
+		PyErr_SetString(PyExc_ValueError, "command must be 0 to 255");
+		return NULL;
+	}
+	if (opt[1] < 1 || opt[1] > 4) {
+		PyErr_SetString(PyExc_ValueError, "address_bytes must be 1 to 4");
+		return NULL;
+	}
+	if (opt[2] > FLASH_READ_MAX_DUMMY) {
+		PyErr_Format(PyExc_ValueError, "dummy_bytes must be 0 to %d", FLASH_READ_MAX_DUMMY);
+		return NULL;
+	}
+	if (opt[3] != 1 && opt[3] != 2 && opt[3] != 4) {
+		PyErr_SetString(PyExc_ValueError, "data_nbits must be 1, 2 or 4");
+		return NULL;
+	}
+	command = (uint8_t)opt[0];
+	address_bytes = (uint8_t)opt[1];
+	dummy_bytes = (uint8_t)opt[2];
+	data_nbits = (uint8_t)opt[3];
+
+	limit = 1ULL << (8 * address_bytes);
+	if (address > limit || (unsigned long long)length > limit - address) {
+		PyErr_SetString(PyExc_OverflowError, "Read exceeds the address range.");
+		return NULL;
+	}
+
+	if (into != Py_None) {
+		if (PyObject_GetBuffer(into, &view, PyBUF_WRITABLE) == -1)
+			return NULL;
+		if (view.len < length) {
+			PyErr_Format(PyExc_ValueError,
+				"into buffer too small (%zd bytes, %zd needed)", view.len, length);
+			PyBuffer_Release(&view);
+			return NULL;
+		}
+		data = view.buf;
+	} else if (spidev_rx_buffer(self, length, &result, &data, &alloc, 1, 1) < 0)
+		return NULL;
+
+	hdr_len = 1 + address_bytes + dummy_bytes;
+	memset(hdr, 0, sizeof(hdr));
+	hdr[0] = command;
+
+	memset(tmpl, 0, sizeof(tmpl));
+	tmpl[0].len = hdr_len;
+	tmpl[0].speed_hz = tmpl[1].speed_hz = self->max_speed_hz;
+	tmpl[0].bits_per_word = tmpl[1].bits_per_word = 8;
+#ifdef SPI_IOC_WR_MODE32
+	tmpl[0].tx_nbits = 1;
+	tmpl[1].rx_nbits = data_nbits;
+#endif
+
+	// Older kernels count the header in the per message limit as well
+	block = SPIDEV_BLOCK_SIZE(self);
+	block = (block > hdr_len) ? block - hdr_len : 1;
+
+	SPIDEV_BEGIN_ALLOW_THREADS(self)
+	status = spidev_flash_read_blocks(self, tmpl, hdr, address_bytes, address,
+			data, length, block);
+	if (status == 0)
+		spidev_read0(self);
+	SPIDEV_END_ALLOW_THREADS(self)
+
+	if (status < 0) {
+		Py_CLEAR(result);
+		spidev_set_errno(status);
+		goto out;
+	}
+
+	if (into != Py_None) {
+		Py_INCREF(Py_None);
+		result = Py_None;
+	} else if (!result)
+		result = spidev_rx_values(data, length, 0, 1);
+
+out:
+	if (into != Py_None)
+		PyBuffer_Release(&view);
+	spidev_scratch_put(self, SPIDEV_SCRATCH_RX, alloc);
+	spidev_stats_call(self, t0);
+	return result;
+}
+
+SPIDEV_LOCKED_FASTCALL(SpiDev_flash_read)
+
+PyDoc_STRVAR(SpiDev_poll_until_doc,
+	"poll_until(cmd, mask, value[, timeout, interval_us, speed_hz]) -> (ready, status, polls, elapsed)\n\n"
+	"Repeat the transaction cmd (as xfer2 does) without the GIL until the\n"
+	"last word received, and'ed with mask, equals value, or until timeout\n"
+	"seconds (1.0 by default) have passed. Sleep interval_us microseconds\n"
+	"between transactions, 0 (the default) to poll back to back. Return\n"
+	"whether the value was seen, the last status word, the number of\n"
+	"transactions and the seconds spent.\n");
+
+static const char * const SpiDev_poll_until_keywords[] = {"cmd", "mask", "value", "timeout", "interval_us", "speed_hz", NULL};
+static SpiDevArgParser SpiDev_poll_until_parser = {"poll_until", SpiDev_poll_until_keywords, 3};
+
+static PyObject *
+SpiDev_poll_until_impl(SpiDevObject *self, SPIDEV_ARGS)
+{
+	PyObject *args_out[6];
+	unsigned long long mask = 0, value = 0, interval_us = 0, speed_hz = 0;
+	unsigned long long polls = 0;
+	double timeout = 1.0;
+	uint64_t t0, start, deadline, now, sleep_ns;
+	struct spi_ioc_transfer xfer;
+	struct timespec ts;
+	SpiDevTxData tx;
+	uint8_t *txbuf, *alloc = NULL, *rx;
+	unsigned long status_word = 0;
+	int status = 0, ready = 0, word;
+
+	if (spidev_parse_args(&SpiDev_poll_until_parser, SPIDEV_ARGS_FWD, args_out) < 0 ||
+	    spidev_arg_mask(args_out[1], &mask) < 0 ||
+	    spidev_arg_mask(args_out[2], &value) < 0 ||
+	    spidev_arg_mask(args_out[4], &interval_us) < 0 ||
+	    spidev_arg_mask(args_out[5], &speed_hz) < 0)
+		return NULL;
+
+	if (args_out[3]) {
+		timeout = PyFloat_AsDouble(args_out[3]);
+		if (timeout == -1 && PyErr_Occurred())
+			return NULL;
+		if (Py_IS_NAN(timeout)) {
+			PyErr_SetString(PyExc_ValueError, "timeout must not be NaN");
+			return NULL;
+		}
+		if (timeout < 0)
+			timeout = 0;
+		if (timeout > 1e9)
+			timeout = 1e9;
+	}
+	// Longer sleeps are cut at the deadline anyway, this keeps the ns product in range
+	if (interval_us > 1000000000ULL * 1000000)
+		interval_us = 1000000000ULL * 1000000;
+
+	word = SPIDEV_WORD_SIZE(self, 0);
+	if (spidev_tx_open(args_out[0], &tx, word) < 0)
+		return NULL;
+
+	if (tx.len <= 0) {
+		spidev_tx_close(&tx);
+		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+		return NULL;
+	}
+
+	if ((txbuf = spidev_tx_buffer(self, &tx, &alloc)) == NULL) {
+		spidev_tx_close(&tx);
+		return NULL;
+	}
+	if ((rx = spidev_scratch_get(self, SPIDEV_SCRATCH_RX, tx.len)) == NULL) {
+		if (alloc)
+			spidev_scratch_put(self, SPIDEV_SCRATCH_TX, alloc);
+		spidev_tx_close(&tx);
+		return NULL;
+	}
+
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.tx_buf = (unsigned long)txbuf;
+	xfer.rx_buf = (unsigned long)rx;
+	xfer.len = tx.len;
+	xfer.speed_hz = speed_hz ? speed_hz : self->max_speed_hz;
+	xfer.bits_per_word = self->bits_per_word;
+
+	t0 = spidev_now_ns();
+
+	SPIDEV_BEGIN_ALLOW_THREADS(self)
+	start = spidev_now_ns();
+	deadline = start + (uint64_t)(timeout * 1e9);
+	for (;;) {
+		polls++;
+		status = spidev_ioctl(self, SPI_IOC_MESSAGE(1), &xfer);
+		if (status < 0) {
+			status = -errno;
+			break;
+		}
+		spidev_read0(self);
+
+		status_word = (unsigned long)spidev_rx_word(rx, tx.len / word - 1, word);
+		if ((status_word & mask) == value) {
+			ready = 1;
+			break;
+		}
+
+		now = spidev_now_ns();
+		if (now >= deadline)
+			break;
+		if (interval_us) {
+			sleep_ns = interval_us * 1000;
+			if (sleep_ns > deadline - now)
+				sleep_ns = deadline - now;
+			ts.tv_sec = sleep_ns / 1000000000;
+			ts.tv_nsec = sleep_ns % 1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+		}
+	}
+	now = spidev_now_ns();
+	SPIDEV_END_ALLOW_THREADS(self)
+
+	spidev_scratch_put(self, SPIDEV_SCRATCH_RX, rx);
+	if (alloc)
+		spidev_scratch_put(self, SPIDEV_SCRATCH_TX, alloc);
+	spidev_tx_close(&tx);
+	spidev_stats_call(self, t0);
+
+	if (status < 0) {
+		spidev_set_errno(status);
+		return NULL;
+	}
+
+	return Py_BuildValue("(NkKd)", PyBool_FromLong(ready), status_word,
+		polls, (now - start) / 1e9);
+}
+
+SPIDEV_LOCKED_FASTCALL(SpiDev_poll_until)
+
+// Upper bound on the number of block sizes tried by calibrate_block_size
+#define CALIBRATE_MAX_CANDIDATES 64
+
+PyDoc_STRVAR(SpiDev_calibrate_block_size_doc,
+	"calibrate_block_size([candidates, total, repeat]) -> block_size\n\n"
+	"Time full duplex transfers of total bytes (64 KiB by default) split in\n"
+	"each candidate block size (powers of two up to spidev's bufsiz by default),\n"
+	"keeping the best of repeat runs, and select the fastest one as block_size.\n"
+	"The device is clocked with zero bytes, only use it on devices tolerating that.\n");
+
+static PyObject *
+SpiDev_calibrate_block_size_impl(SpiDevObject *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *candidates = Py_None;
+	Py_ssize_t total = 65536, ii, ncandidates = 0;
+	int repeat = 3, rr, status = 0;
+	uint32_t sizes[CALIBRATE_MAX_CANDIDATES], bufsiz, limit, best_size = 0;
+	double best_rate = 0.0;
+	struct spi_ioc_transfer xfer;
+	struct timespec t0, t1;
+	uint8_t *buf;
+	static char *kwlist[] = {"candidates", "total", "repeat", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Oni:calibrate_block_size", kwlist,
+			&candidates, &total, &repeat))
+		return NULL;
+
+	if (total < 1 || repeat < 1) {
+		PyErr_SetString(PyExc_ValueError, "total and repeat must be positive");
+		return NULL;
+	}
+
+	bufsiz = spidev_read_bufsiz();
+	limit = bufsiz ? bufsiz : XFER3_DEFAULT_BLOCK_SIZE;
+
+	if (candidates == Py_None) {
+		uint32_t size;
+
+		for (size = 256; size < limit && ncandidates < CALIBRATE_MAX_CANDIDATES - 1; size *= 2)
+			sizes[ncandidates++] = size;
+		sizes[ncandidates++] = limit;
+	} else {
+		PyObject *seq = PySequence_Fast(candidates, "candidates must be a sequence");
+
+		if (!seq)
+			return NULL;
+		ncandidates = PySequence_Fast_GET_SIZE(seq);
+		if (ncandidates < 1 || ncandidates > CALIBRATE_MAX_CANDIDATES) {
+			Py_DECREF(seq);
+			PyErr_Format(PyExc_ValueError,
+				"between 1 and %d candidates expected", CALIBRATE_MAX_CANDIDATES);
+			return NULL;
+		}
+		for (ii = 0; ii < ncandidates; ii++) {
+			unsigned long size = PyLong_AsUnsignedLong(PySequence_Fast_GET_ITEM(seq, ii));
+
+			if (PyErr_Occurred()) {
+				Py_DECREF(seq);
+				return NULL;
+			}
+			if (size < 1 || (bufsiz && size > bufsiz) || size > UINT32_MAX) {
+				Py_DECREF(seq);
+				PyErr_Format(PyExc_ValueError,
+					"invalid candidate block size %lu", size);
+				return NULL;
+			}
+			sizes[ii] = size;
+		}
+		Py_DECREF(seq);
+	}
+
+	// Zeros are sent, received data goes to the same buffer
+	buf = calloc(total, 1);
+	if (!buf) {
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+		return NULL;
+	}
+
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.speed_hz = self->max_speed_hz;
+	xfer.bits_per_word = self->bits_per_word;
+
+	Py_BEGIN_ALLOW_THREADS
+	for (ii = 0; ii < ncandidates && status == 0; ii++) {
+		double best_time = 0.0;
+
+		for (rr = 0; rr < repeat && status == 0; rr++) {
+			double elapsed;
+
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			status = spidev_xfer_blocks(self, &xfer, buf, buf, total, sizes[ii]);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+
+			elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+			if (rr == 0 || elapsed < best_time)
+				best_time = elapsed;
+		}
+
+		if (status == 0 && best_time > 0.0 && total / best_time > best_rate) {
+			best_rate = total / best_time;
+			best_size = sizes[ii];
+		}
+	}
+	Py_END_ALLOW_THREADS
+
+	free(buf);
+
+	if (status < 0) {
+		spidev_set_errno(status);
+		return NULL;
+	}
+
+	if (best_size)
+		self->block_size = best_size;
+
+	return PyLong_FromUnsignedLong(SPIDEV_BLOCK_SIZE(self));
+}
+
+SPIDEV_LOCKED_KEYWORDS(SpiDev_calibrate_block_size)
+
+// Asynchronous transfers.
+// Requests are queued to a worker thread owned by the SpiDev object which
+// runs them back to back without the GIL. Completion is signalled through
+// an eventfd watched by the asyncio event loop the requests came from.
+
+enum {
+	SPIDEV_AIO_XFER,
+	SPIDEV_AIO_WRITE,
+	SPIDEV_AIO_READ,
+};
+
+typedef struct spidev_aio_req {
+	struct spidev_aio_req *next;
+	int op;			/* one of SPIDEV_AIO_* */
+	SpiDevObject *dev;	/* owner, outlives the request */
+	int read0;		/* lower CS after the transfer, see xfer2 */
+	struct spi_ioc_transfer xfer;	/* settings for SPIDEV_AIO_XFER */
+	uint8_t *tx, *rx;
+	size_t len, block;
+	int word;		/* bytes per word */
+	int status;		/* 0 or -errno once done */
+
+	/* Only touched with the GIL held */
+	PyObject *future;
+	PyObject *result;	/* bytes-like object rx points into, or NULL */
+	SpiDevTxData txdata;	/* keeps the tx source alive */
+	uint8_t *txalloc, *rxalloc;
+} SpiDevAioRequest;
+
+typedef struct spidev_aio {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	SpiDevAioRequest *pending, **pending_tail;	/* waiting for the worker */
+	SpiDevAioRequest *done, **done_tail;	/* waiting for the event loop */
+	int stop;
+	int efd;		/* eventfd signalled when requests are done */
+
+	/* Only touched with the GIL held */
+	PyObject *loop;		/* loop the eventfd is registered with */
+	Py_ssize_t inflight;	/* requests whose future is not resolved yet */
+} SpiDevAio;
+
+static void
+spidev_aio_push(SpiDevAioRequest ***tail, SpiDevAioRequest *req)
+{
+	req->next = NULL;
+	**tail = req;
+	*tail = &req->next;
+}
+
+static void *
+spidev_aio_worker(void *arg)
+{
+	SpiDevAio *aio = arg;
+	SpiDevAioRequest *req;
+	uint64_t one = 1;
+
+	for (;;) {
+		pthread_mutex_lock(&aio->lock);
+		while (!aio->pending && !aio->stop)
+			pthread_cond_wait(&aio->cond, &aio->lock);
+		if (aio->stop) {
+			pthread_mutex_unlock(&aio->lock);
+			break;
+		}
+		req = aio->pending;
+		aio->pending = req->next;
+		if (!aio->pending)
+			aio->pending_tail = &aio->pending;
+		pthread_mutex_unlock(&aio->lock);
+
+		switch (req->op) {
+		case SPIDEV_AIO_XFER:
+			req->status = spidev_xfer_blocks(req->dev, &req->xfer, req->tx, req->rx, req->len, req->block);
+			break;
+		case SPIDEV_AIO_WRITE:
+			req->status = spidev_write_blocks(req->dev, req->tx, req->len, req->block);
+			break;
+		case SPIDEV_AIO_READ:
+			req->status = spidev_read_blocks(req->dev, req->rx, req->len, req->block);
+			break;
+		}
+		if (req->status == 0 && req->read0)
+			(void)!spidev_read(req->dev, NULL, 0);
+
+		pthread_mutex_lock(&aio->lock);
+		spidev_aio_push(&aio->done_tail, req);
+		pthread_mutex_unlock(&aio->lock);
+
+		(void)!write(aio->efd, &one, sizeof(one));
+	}
+
+	return NULL;
+}
+
+static void
+spidev_aio_free_request(SpiDevAioRequest *req)
+{
+	Py_XDECREF(req->future);
+	Py_XDECREF(req->result);
+	spidev_tx_close(&req->txdata);
+	free(req->txalloc);
+	free(req->rxalloc);
+	free(req);
+}
+
+// Resolve the future of a finished request
+static void
+spidev_aio_resolve(SpiDevAioRequest *req)
+{
+	PyObject *done, *value, *ret;
+
+	done = PyObject_CallMethod(req->future, "done", NULL);
+	if (!done) {
+		PyErr_WriteUnraisable(req->future);
+		return;
+	}
+	if (PyObject_IsTrue(done)) {
+		// Cancelled while the transfer was running
+		Py_DECREF(done);
+		return;
+	}
+	Py_DECREF(done);
+
+	if (req->status < 0) {
+		value = PyObject_CallFunction(PyExc_IOError, "is", -req->status, strerror(-req->status));
+		ret = value ? PyObject_CallMethod(req->future, "set_exception", "O", value) : NULL;
+	} else {
+		if (req->result) {
+			value = req->result;
+			Py_INCREF(value);
+		} else if (req->op == SPIDEV_AIO_WRITE) {
+			value = Py_None;
+			Py_INCREF(value);
+		} else {
+			value = spidev_rx_values(req->rx, req->len, 0, req->word);
+		}
+		ret = value ? PyObject_CallMethod(req->future, "set_result", "O", value) : NULL;
+	}
+	Py_XDECREF(value);
+
+	if (!ret)
+		PyErr_WriteUnraisable(req->future);
+	Py_XDECREF(ret);
+}
+
+static void
+spidev_aio_unregister(SpiDevAio *aio)
+{
+	PyObject *ret;
+
+	if (!aio->loop)
+		return;
+
+	ret = PyObject_CallMethod(aio->loop, "remove_reader", "i", aio->efd);
+	if (!ret)
+		PyErr_WriteUnraisable(aio->loop);
+	Py_XDECREF(ret);
+	Py_CLEAR(aio->loop);
+}
+
+// Called by the event loop when the eventfd is readable
+static PyObject *
+SpiDev_aio_complete_impl(SpiDevObject *self, PyObject *unused)
+{
+	SpiDevAio *aio = self->aio;
+	SpiDevAioRequest *req, *next;
+	uint64_t count;
+
+	if (!aio) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+
+	(void)!read(aio->efd, &count, sizeof(count));
+
+	pthread_mutex_lock(&aio->lock);
+	req = aio->done;
+	aio->done = NULL;
+	aio->done_tail = &aio->done;
+	pthread_mutex_unlock(&aio->lock);
+
+	for (; req; req = next) {
+		next = req->next;
+		spidev_aio_resolve(req);
+		spidev_aio_free_request(req);
+		aio->inflight--;
+	}
+
+	// Keep the loop (and with it this object) referenced only while needed
+	if (aio->inflight == 0)
+		spidev_aio_unregister(aio);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+SPIDEV_LOCKED_NOARGS(SpiDev_aio_complete)
+
+static PyMethodDef SpiDev_aio_complete_def = {
+	"_aio_complete", (PyCFunction)SpiDev_aio_complete, METH_NOARGS, NULL
+};
+
+static SpiDevAio *
+spidev_aio_start(SpiDevObject *self)
+{
+	SpiDevAio *aio;
+
+	if (self->aio)
+		return self->aio;
+
+	aio = calloc(1, sizeof(*aio));
+	if (!aio) {
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+		return NULL;
+	}
+	aio->pending_tail = &aio->pending;
+	aio->done_tail = &aio->done;
+
+	aio->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (aio->efd < 0) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		free(aio);
+		return NULL;
+	}
+
+	pthread_mutex_init(&aio->lock, NULL);
+	pthread_cond_init(&aio->cond, NULL);
+	if (pthread_create(&aio->thread, NULL, spidev_aio_worker, aio) != 0) {
+		PyErr_SetString(PyExc_RuntimeError, "can't start worker thread");
+		pthread_cond_destroy(&aio->cond);
+		pthread_mutex_destroy(&aio->lock);
+		close(aio->efd);
+		free(aio);
+		return NULL;
+	}
+
+	self->aio = aio;
+	return aio;
+}
+
+// Stop the worker. Finished requests are resolved, queued ones cancelled.
+static void
+spidev_aio_stop(SpiDevObject *self)
+{
+	SpiDevAio *aio = self->aio;
+	SpiDevAioRequest *req, *next;
+	PyObject *ret;
+
+	if (!aio)
+		return;
+
+	// Another thread may be stopping it already, while it waits below
+	pthread_mutex_lock(&aio->lock);
+	if (aio->stop) {
+		pthread_mutex_unlock(&aio->lock);
+		return;
+	}
+	aio->stop = 1;
+	pthread_cond_signal(&aio->cond);
+	pthread_mutex_unlock(&aio->lock);
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_join(aio->thread, NULL);
+	Py_END_ALLOW_THREADS
+
+	Py_XDECREF(SpiDev_aio_complete_impl(self, NULL));
+
+	for (req = aio->pending; req; req = next) {
+		next = req->next;
+		ret = PyObject_CallMethod(req->future, "cancel", NULL);
+		if (!ret)
+			PyErr_WriteUnraisable(req->future);
+		Py_XDECREF(ret);
+		spidev_aio_free_request(req);
+	}
+
+	spidev_aio_unregister(aio);
+	pthread_cond_destroy(&aio->cond);
+	pthread_mutex_destroy(&aio->lock);
+	close(aio->efd);
+	free(aio);
+	self->aio = NULL;
+}
+
+// Create a request with a future bound to the running event loop,
+// for words of bits_per_word bits (0 for the device setting)
+static SpiDevAioRequest *
+spidev_aio_request(SpiDevObject *self, int op, uint8_t bits_per_word)
+{
+	static PyObject *get_running_loop = NULL;
+	SpiDevAioRequest *req;
+	PyObject *func, *loop;
+
+	func = __atomic_load_n(&get_running_loop, __ATOMIC_ACQUIRE);
+	if (!func) {
+		PyObject *asyncio = PyImport_ImportModule("asyncio");
+
+		if (!asyncio)
+			return NULL;
+		func = PyObject_GetAttrString(asyncio, "get_running_loop");
+		Py_DECREF(asyncio);
+		if (!func)
+			return NULL;
+		// Threads may get here together without the GIL, the first one wins
+		if (!__atomic_compare_exchange_n(&get_running_loop, &(PyObject *){NULL}, func,
+				0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+			Py_DECREF(func);
+			func = __atomic_load_n(&get_running_loop, __ATOMIC_ACQUIRE);
+		}
+	}
+
+	loop = PyObject_CallObject(func, NULL);
+	if (!loop)
+		return NULL;
+
+	if (self->aio && self->aio->loop && self->aio->loop != loop) {
+		PyErr_SetString(PyExc_RuntimeError,
+			"requests of another event loop are still in flight");
+		Py_DECREF(loop);
+		return NULL;
+	}
+
+	req = calloc(1, sizeof(*req));
+	if (!req) {
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+		Py_DECREF(loop);
+		return NULL;
+	}
+	req->op = op;
+	req->dev = self;
+	req->word = SPIDEV_WORD_SIZE(self, bits_per_word);
+	req->block = spidev_word_block(SPIDEV_BLOCK_SIZE(self), req->word);
+	req->read0 = self->read0 && (self->mode & SPI_CS_HIGH);
+
+	req->future = PyObject_CallMethod(loop, "create_future", NULL);
+	Py_DECREF(loop);
+	if (!req->future) {
+		free(req);
+		return NULL;
+	}
+	return req;
+}
+
+// Hand a prepared request to the worker and return its future
+static PyObject *
+spidev_aio_submit(SpiDevObject *self, SpiDevAioRequest *req)
+{
+	SpiDevAio *aio;
+	PyObject *future;
+
+	if ((aio = spidev_aio_start(self)) == NULL)
+		goto fail;
+
+	if (!aio->loop) {
+		PyObject *callback, *ret;
+
+		aio->loop = PyObject_CallMethod(req->future, "get_loop", NULL);
+		if (!aio->loop)
+			goto fail;
+		callback = PyCFunction_New(&SpiDev_aio_complete_def, (PyObject *)self);
+		if (!callback) {
+			Py_CLEAR(aio->loop);
+			goto fail;
+		}
+		ret = PyObject_CallMethod(aio->loop, "add_reader", "iO", aio->efd, callback);
+		Py_DECREF(callback);
+		if (!ret) {
+			Py_CLEAR(aio->loop);
+			goto fail;
+		}
+		Py_DECREF(ret);
+	}
+
+	future = req->future;
+	Py_INCREF(future);
+	aio->inflight++;
+	spidev_stats_add(&self->stats.transfers, 1);
+
+	pthread_mutex_lock(&aio->lock);
+	spidev_aio_push(&aio->pending_tail, req);
+	pthread_cond_signal(&aio->cond);
+	pthread_mutex_unlock(&aio->lock);
+
+	return future;
+
+fail:
+	spidev_aio_free_request(req);
+	return NULL;
+}
+
+PyDoc_STRVAR(SpiDev_axfer_doc,
+	"axfer([values][, speed_hz, delay_usecs, bits_per_word]) -> Future\n\n"
+	"Asynchronous xfer3: queue the transaction to the worker thread of this\n"
+	"object and return an asyncio future for the received data. Must be\n"
+	"called from a running event loop. Requests are executed in order;\n"
+	"buffers passed in must not be modified until the future is done.\n");
+
+static SpiDevArgParser SpiDev_axfer_parser = {"axfer", spidev_xfer_keywords, 1};
+
+static PyObject *
+SpiDev_axfer_impl(SpiDevObject *self, SPIDEV_ARGS)
+{
+	uint16_t delay_usecs = 0;
+	uint32_t speed_hz = 0;
+	uint8_t bits_per_word = 0;
+	PyObject *obj;
+	SpiDevAioRequest *req;
+
+	if (spidev_xfer_args(&SpiDev_axfer_parser, SPIDEV_ARGS_FWD, &obj, &speed_hz, &delay_usecs, &bits_per_word) < 0)
+		return NULL;
+
+	if ((req = spidev_aio_request(self, SPIDEV_AIO_XFER, bits_per_word)) == NULL)
+		return NULL;
+
+	if (spidev_tx_open(obj, &req->txdata, req->word) < 0)
+		goto fail;
+	req->len = req->txdata.len;
+	if (req->len == 0) {
+		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+		goto fail;
+	}
+	if ((req->tx = spidev_tx_buffer(NULL, &req->txdata, &req->txalloc)) == NULL)
+		goto fail;
+	if (spidev_rx_buffer(self, req->len, &req->result, &req->rx, &req->rxalloc, 0, req->word) < 0)
+		goto fail;
+
+	req->xfer.delay_usecs = delay_usecs;
+	req->xfer.speed_hz = speed_hz ? speed_hz : self->max_speed_hz;
+	req->xfer.bits_per_word = bits_per_word ? bits_per_word : self->bits_per_word;
+
+	return spidev_aio_submit(self, req);
+
+fail:
+	spidev_aio_free_request(req);
+	return NULL;
+}
+
+SPIDEV_LOCKED_FASTCALL(SpiDev_axfer)
+
+PyDoc_STRVAR(SpiDev_awrite_doc,
+	"awrite([values]) -> Future\n\n"
+	"Asynchronous writebytes2, see axfer().\n");
+
+static SpiDevArgParser SpiDev_awrite_parser = {"awrite", spidev_values_keywords, 1};
+
+static PyObject *
+SpiDev_awrite_impl(SpiDevObject *self, SPIDEV_ARGS)
+{
+	PyObject *obj;
+	SpiDevAioRequest *req;
+
+	if (spidev_parse_args(&SpiDev_awrite_parser, SPIDEV_ARGS_FWD, &obj) < 0)
+		return NULL;
+
+	if ((req = spidev_aio_request(self, SPIDEV_AIO_WRITE, 0)) == NULL)
+		return NULL;
+
+	if (spidev_tx_open(obj, &req->txdata, req->word) < 0)
+		goto fail;
+	req->len = req->txdata.len;
+	if ((req->tx = spidev_tx_buffer(NULL, &req->txdata, &req->txalloc)) == NULL)
+		goto fail;
+	req->read0 = 0;
+
+	return spidev_aio_submit(self, req);
+
+fail:
+	spidev_aio_free_request(req);
+	return NULL;
+}
+
+SPIDEV_LOCKED_FASTCALL(SpiDev_awrite)
+
+PyDoc_STRVAR(SpiDev_aread_doc,
+	"aread(len) -> Future\n\n"
+	"Asynchronous readbytes, see axfer().\n");
+
+static SpiDevArgParser SpiDev_aread_parser = {"aread", spidev_len_keywords, 1};
+
+static PyObject *
+SpiDev_aread_impl(SpiDevObject *self, SPIDEV_ARGS)
+{
+	Py_ssize_t len = 0;
+	PyObject *obj;
+	SpiDevAioRequest *req;
+
+	if (spidev_parse_args(&SpiDev_aread_parser, SPIDEV_ARGS_FWD, &obj) < 0 ||
+	    spidev_arg_ssize(obj, &len) < 0)
+		return NULL;
+
+	/* read at least 1 word */
+	if (len < 1)
+		len = 1;
+
+	if ((req = spidev_aio_request(self, SPIDEV_AIO_READ, 0)) == NULL)
+		return NULL;
+
+	if (len > PY_SSIZE_T_MAX / req->word) {
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+		goto fail;
+	}
+	req->len = len * req->word;
+	if (spidev_rx_buffer(self, req->len, &req->result, &req->rx, &req->rxalloc, 0, req->word) < 0)
+		goto fail;
+	req->read0 = 0;
+
+	return spidev_aio_submit(self, req);
+
+fail:
+	spidev_aio_free_request(req);
+	return NULL;
+}
+
+SPIDEV_LOCKED_FASTCALL(SpiDev_aread)
+
+// Continuous acquisition.
+// A native thread runs the same transaction over and over and stores the
+// received data in a single-producer/single-consumer ring of fixed size
+// records. Python drains whole records in bulk.
+
+typedef struct spidev_stream {
+	pthread_t thread;
+	SpiDevObject *dev;	/* owner, stops the thread before closing */
+	int read0;		/* lower CS after each transfer, see xfer2 */
+	struct spi_ioc_transfer xfer;
+	uint64_t interval_ns;	/* period of the transfers, 0 for back to back */
+	size_t record;		/* bytes per record */
+	uint64_t capacity;	/* records the ring can hold */
+	uint8_t *tx;		/* data sent in each transfer */
+	uint8_t *ring;		/* capacity * record bytes */
+	uint8_t *spill;		/* receives records dropped on overrun */
+
+	atomic_uint_fast64_t head;	/* records produced, written by the thread only */
+	atomic_uint_fast64_t tail;	/* records consumed, written by Python only */
+	atomic_uint_fast64_t overruns;	/* records dropped because the ring was full */
+	atomic_int error;	/* errno that stopped the thread, 0 if none */
+	atomic_int stop;
+} SpiDevStream;
+
+static void *
+spidev_stream_worker(void *arg)
+{
+	SpiDevStream *st = arg;
+	struct timespec next, now;
+	uint64_t head, tail;
+	uint8_t *rx;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!atomic_load_explicit(&st->stop, memory_order_relaxed)) {
+		head = atomic_load_explicit(&st->head, memory_order_relaxed);
+		tail = atomic_load_explicit(&st->tail, memory_order_acquire);
+
+		if (head - tail < st->capacity)
+			rx = st->ring + (head % st->capacity) * st->record;
+		else
+			rx = st->spill;
+
+		st->xfer.rx_buf = (unsigned long)rx;
+		if (spidev_ioctl(st->dev, SPI_IOC_MESSAGE(1), &st->xfer) < 0) {
+			atomic_store(&st->error, errno);
+			break;
+		}
+		if (st->read0)
+			(void)!spidev_read(st->dev, NULL, 0);
+
+		if (rx == st->spill)
+			atomic_fetch_add_explicit(&st->overruns, 1, memory_order_relaxed);
+		else
+			atomic_store_explicit(&st->head, head + 1, memory_order_release);
+
+		if (st->interval_ns) {
+			next.tv_nsec += st->interval_ns % 1000000000;
+			next.tv_sec += st->interval_ns / 1000000000 + next.tv_nsec / 1000000000;
+			next.tv_nsec %= 1000000000;
+
+			// Don't try to catch up after falling more than a period behind
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if ((now.tv_sec - next.tv_sec) * 1000000000LL + (now.tv_nsec - next.tv_nsec) > (int64_t)st->interval_ns)
+				next = now;
+			else
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+spidev_stream_free(SpiDevStream *st)
+{
+	free(st->tx);
+	free(st->ring);
+	free(st->spill);
+	free(st);
+}
+
+// Stop the acquisition thread, data left in the ring is discarded
+static void
+spidev_stream_stop(SpiDevObject *self)
+{
+	SpiDevStream *st = self->stream;
+
+	if (!st)
+		return;
+
+	// Detached first, other threads may call in while this one waits
+	self->stream = NULL;
+	atomic_store(&st->stop, 1);
+	Py_BEGIN_ALLOW_THREADS
+	pthread_join(st->thread, NULL);
+	Py_END_ALLOW_THREADS
+
+	spidev_stream_free(st);
+}
+
+PyDoc_STRVAR(SpiDev_stream_start_doc,
+	"stream_start([values][, records, interval_us, speed_hz, delay_usecs, bits_per_word])\n\n"
+	"Start continuous acquisition: a native thread repeats the transaction\n"
+	"values (as xfer2 does, CS held active) every interval_us microseconds,\n"
+	"or back to back if 0, and stores the received bytes as one record per\n"
+	"transaction in a ring buffer of records entries (1024 by default).\n"
+	"Drain it with stream_read() or stream_readinto().\n");
+
+static PyObject *
+SpiDev_stream_start_impl(SpiDevObject *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *obj;
+	Py_ssize_t records = 1024;
+	unsigned long long interval_us = 0;
+	uint16_t delay_usecs = 0;
+	uint32_t speed_hz = 0;
+	uint8_t bits_per_word = 0;
+	SpiDevTxData tx;
+	SpiDevStream *st;
+	static char *kwlist[] = {"values", "records", "interval_us", "speed_hz", "delay_usecs", "bits_per_word", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|nKIHB:stream_start", kwlist,
+			&obj, &records, &interval_us, &speed_hz, &delay_usecs, &bits_per_word))
+		return NULL;
+
+	if (self->stream) {
+		PyErr_SetString(PyExc_RuntimeError, "stream already running");
+		return NULL;
+	}
+
+	if (records < 1) {
+		PyErr_SetString(PyExc_ValueError, "records must be positive");
+		return NULL;
+	}
+
+	if (spidev_tx_open(obj, &tx, SPIDEV_WORD_SIZE(self, bits_per_word)) < 0)
+		return NULL;
+
+	if (tx.len <= 0) {
+		spidev_tx_close(&tx);
+		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+		return NULL;
+	}
+
+	if (tx.len > SPIDEV_BLOCK_SIZE(self)) {
+		spidev_tx_close(&tx);
+		PyErr_Format(PyExc_OverflowError,
+			"Transaction exceeds block_size (%u bytes).", SPIDEV_BLOCK_SIZE(self));
+		return NULL;
+	}
+
+	st = calloc(1, sizeof(*st));
+	if (!st || (size_t)records > SIZE_MAX / tx.len) {
+		free(st);
+		spidev_tx_close(&tx);
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+		return NULL;
+	}
+
+	st->record = tx.len;
+	st->capacity = records;
+	st->tx = malloc(st->record);
+	st->ring = malloc(st->record * records);
+	st->spill = malloc(st->record);
+	if (!st->tx || !st->ring || !st->spill) {
+		spidev_tx_close(&tx);
+		spidev_stream_free(st);
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+		return NULL;
+	}
+
+	if (spidev_tx_copy(&tx, 0, tx.len, st->tx) < 0) {
+		spidev_tx_close(&tx);
+		spidev_stream_free(st);
+		return NULL;
+	}
+	spidev_tx_close(&tx);
+
+	st->dev = self;
+	st->read0 = self->read0 && (self->mode & SPI_CS_HIGH);
+	st->interval_ns = interval_us * 1000;
+	st->xfer.tx_buf = (unsigned long)st->tx;
+	st->xfer.len = st->record;
+	st->xfer.delay_usecs = delay_usecs;
+	st->xfer.speed_hz = speed_hz ? speed_hz : self->max_speed_hz;
+	st->xfer.bits_per_word = bits_per_word ? bits_per_word : self->bits_per_word;
+
+	if (pthread_create(&st->thread, NULL, spidev_stream_worker, st) != 0) {
+		spidev_stream_free(st);
+		PyErr_SetString(PyExc_RuntimeError, "can't start stream thread");
+		return NULL;
+	}
+
+	self->stream = st;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+SPIDEV_LOCKED_KEYWORDS(SpiDev_stream_start)
+
+PyDoc_STRVAR(SpiDev_stream_stop_doc,
+	"stream_stop()\n\n"
+	"Stop continuous acquisition. Data not read yet is discarded.\n");
+
+static PyObject *
+SpiDev_stream_stop_impl(SpiDevObject *self, PyObject *unused)
+{
+	spidev_stream_stop(self);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+SPIDEV_LOCKED_NOARGS(SpiDev_stream_stop)
+
+// Copy up to max records out of the ring, returns the number of records copied
+static Py_ssize_t
+spidev_stream_drain(SpiDevStream *st, uint8_t *dst, Py_ssize_t max)
+{
+	uint64_t head, tail, count, first;
+	size_t start;
+
+	head = atomic_load_explicit(&st->head, memory_order_acquire);
+	tail = atomic_load_explicit(&st->tail, memory_order_relaxed);
+	count = head - tail;
+	if (count > (uint64_t)max)
+		count = max;
+
+	start = tail % st->capacity;
+	first = st->capacity - start;
+	if (first > count)
+		first = count;
+	memcpy(dst, st->ring + start * st->record, first * st->record);
+	memcpy(dst + first * st->record, st->ring, (count - first) * st->record);
+
+	atomic_store_explicit(&st->tail, tail + count, memory_order_release);
+	return count;
+}
+
+// Check a stream is running before draining it. When the thread stopped
+// on an error and no data is left, the error is raised.
+static SpiDevStream *
+spidev_stream_check(SpiDevObject *self)
+{
+	SpiDevStream *st = self->stream;
+	int error;
+
+	if (!st) {
+		PyErr_SetString(PyExc_RuntimeError, "stream not running");
+		return NULL;
+	}
+
+	error = atomic_load(&st->error);
+	if (error && atomic_load(&st->head) == atomic_load(&st->tail)) {
+		errno = error;
+		PyErr_SetFromErrno(PyExc_IOError);
+		return NULL;
+	}
+	return st;
+}
+
+PyDoc_STRVAR(SpiDev_stream_read_doc,
+	"stream_read([max_records]) -> memoryview\n\n"
+	"Return all complete records acquired so far (at most max_records)\n"
+	"as a flat memoryview of bytes, record after record. Use e.g.\n"
+	"numpy.frombuffer(view, numpy.uint8).reshape(-1, record_size).\n");
+
+static PyObject *
+SpiDev_stream_read_impl(SpiDevObject *self, PyObject *args)
+{
+	Py_ssize_t max = PY_SSIZE_T_MAX, avail, count;
+	SpiDevStream *st;
+	PyObject *data, *view;
+
+	if (!PyArg_ParseTuple(args, "|n:stream_read", &max))
+		return NULL;
+
+	if ((st = spidev_stream_check(self)) == NULL)
+		return NULL;
+
+	avail = atomic_load_explicit(&st->head, memory_order_acquire) - atomic_load(&st->tail);
+	if (max > avail)
+		max = avail;
+	if (max < 0)
+		max = 0;
+
+	data = PyByteArray_FromStringAndSize(NULL, max * st->record);
+	if (!data)
+		return NULL;
+
+	count = spidev_stream_drain(st, (uint8_t *)PyByteArray_AS_STRING(data), max);
+	if (count < max && PyByteArray_Resize(data, count * st->record) < 0) {
+		Py_DECREF(data);
+		return NULL;
+	}
+
+	view = PyMemoryView_FromObject(data);
+	Py_DECREF(data);
+	return view;
+}
+
+SPIDEV_LOCKED_VARARGS(SpiDev_stream_read)
+
+PyDoc_STRVAR(SpiDev_stream_readinto_doc,
+	"stream_readinto(buffer) -> records\n\n"
+	"Copy as many complete records as fit into the writable buffer and\n"
+	"return how many were copied.\n");
+
+static PyObject *
+SpiDev_stream_readinto_impl(SpiDevObject *self, PyObject *args)
+{
+	PyObject *obj;
+	Py_buffer view;
+	SpiDevStream *st;
+	Py_ssize_t count;
+
+	if (!PyArg_ParseTuple(args, "O:stream_readinto", &obj))
+		return NULL;
+
+	if ((st = spidev_stream_check(self)) == NULL)
+		return NULL;
+
+	if (PyObject_GetBuffer(obj, &view, PyBUF_WRITABLE) == -1)
+		return NULL;
+
+	count = spidev_stream_drain(st, view.buf, view.len / st->record);
+	PyBuffer_Release(&view);
+
+	return PyLong_FromSsize_t(count);
+}
+
+SPIDEV_LOCKED_VARARGS(SpiDev_stream_readinto)
+
+PyDoc_STRVAR(SpiDev_stream_stats_doc,
+	"stream_stats() -> dict\n\n"
+	"Counters of the running stream: record size, records acquired,\n"
+	"records available, overruns (records dropped because the ring was\n"
+	"full) and errno of the error that stopped it (0 if none).\n");
+
+static PyObject *
+SpiDev_stream_stats_impl(SpiDevObject *self, PyObject *unused)
+{
+	SpiDevStream *st = self->stream;
+	uint64_t head, tail;
+
+	if (!st) {
+		PyErr_SetString(PyExc_RuntimeError, "stream not running");
+		return NULL;
+	}
+
+	head = atomic_load(&st->head);
+	tail = atomic_load(&st->tail);
+
+	return Py_BuildValue("{s:n,s:K,s:K,s:K,s:i}",
+		"record_size", (Py_ssize_t)st->record,
+		"records", (unsigned long long)head,
+		"available", (unsigned long long)(head - tail),
+		"overruns", (unsigned long long)atomic_load(&st->overruns),
+		"error", atomic_load(&st->error));
+}
+
+SPIDEV_LOCKED_NOARGS(SpiDev_stream_stats)
+
+// Background frame writer.
+// submit_frame() copies a frame into one of a few buffers and queues it to a
+// native thread, which writes it out block by block as writebytes2 does while
+// Python renders the next one. The queue holds depth frames; when it is full
+// the oldest queued frame is dropped, so the display never holds up the
+// renderer.
+
+#define SPIDEV_FRAMES_DEPTH 1
+#define SPIDEV_FRAMES_MAX_DEPTH 16
+
+enum {
+	SPIDEV_FRAME_FREE,	/* may be filled by submit_frame() */
+	SPIDEV_FRAME_QUEUED,
+	SPIDEV_FRAME_WRITING,
+};
+
+typedef struct {
+	uint8_t *buf;
+	size_t size;		/* allocated bytes */
+	size_t len;		/* bytes of the frame it holds */
+	int state;		/* one of SPIDEV_FRAME_*, changed with the lock held */
+} SpiDevFrame;
+
+typedef struct spidev_frames {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* wakes the writer: frame queued or stop */
+	pthread_cond_t idle;	/* wakes flush(): queue drained, error or stop */
+	SpiDevObject *dev;	/* owner, stops the thread before closing */
+	int read0;		/* lower CS after each frame, see xfer2 */
+	size_t block;		/* bytes per write */
+	unsigned int depth;	/* frames queued at most */
+	// Queued, being written and being filled: depth + 2 buffers, so
+	// submit_frame() always finds a free one
+	SpiDevFrame *frames;
+	unsigned int *queue;	/* ring of depth indices into frames, oldest first */
+	unsigned int first, queued;
+	int writing;		/* a frame is being written */
+	int waiters;		/* threads in flush() */
+	int stop;
+	int error;		/* errno that stopped the thread, 0 if none */
+
+	unsigned long long submitted;
+	unsigned long long written;
+	unsigned long long dropped;	/* replaced by a newer frame before being written */
+} SpiDevFrames;
+
+static void *
+spidev_frames_worker(void *arg)
+{
+	SpiDevFrames *fr = arg;
+	SpiDevFrame *frame;
+	int status;
+
+	pthread_mutex_lock(&fr->lock);
+	for (;;) {
+		while (!fr->queued && !fr->stop)
+			pthread_cond_wait(&fr->cond, &fr->lock);
+		if (fr->stop)
+			break;
+		frame = &fr->frames[fr->queue[fr->first]];
+		fr->first = (fr->first + 1) % fr->depth;
+		fr->queued--;
+		frame->state = SPIDEV_FRAME_WRITING;
+		fr->writing = 1;
+		pthread_mutex_unlock(&fr->lock);
+
+		status = spidev_write_blocks(fr->dev, frame->buf, frame->len, fr->block);
+		if (status == 0 && fr->read0)
+			(void)!spidev_read(fr->dev, NULL, 0);
+		spidev_stats_add(&fr->dev->stats.transfers, 1);
+
+		pthread_mutex_lock(&fr->lock);
+		frame->state = SPIDEV_FRAME_FREE;
+		fr->writing = 0;
+		if (status < 0) {
+			// Frames still queued are dropped, the error is raised by
+			// the next call
+			fr->error = -status;
+			fr->dropped += fr->queued;
+			while (fr->queued) {
+				fr->frames[fr->queue[fr->first]].state = SPIDEV_FRAME_FREE;
+				fr->first = (fr->first + 1) % fr->depth;
+				fr->queued--;
+			}
+			pthread_cond_broadcast(&fr->idle);
+			break;
+		}
+		fr->written++;
+		if (!fr->queued)
+			pthread_cond_broadcast(&fr->idle);
+	}
+	pthread_mutex_unlock(&fr->lock);
+
+	return NULL;
+}
+
+static void
+spidev_frames_free(SpiDevFrames *fr)
+{
+	unsigned int ii;
+
+	if (fr->frames)
+		for (ii = 0; ii < fr->depth + 2; ii++)
+			free(fr->frames[ii].buf);
+	free(fr->frames);
+	free(fr->queue);
+	pthread_cond_destroy(&fr->idle);
+	pthread_cond_destroy(&fr->cond);
+	pthread_mutex_destroy(&fr->lock);
+	free(fr);
+}
+
+// Stop the writer thread, frames not written yet are discarded
+static void
+spidev_frames_stop(SpiDevObject *self)
+{
+	SpiDevFrames *fr = self->frames;
+
+	if (!fr)
+		return;
+
+	// Detached first, other threads may call in while this one waits
+	self->frames = NULL;
+	pthread_mutex_lock(&fr->lock);
+	fr->stop = 1;
+	pthread_cond_signal(&fr->cond);
+	pthread_cond_broadcast(&fr->idle);
+	pthread_mutex_unlock(&fr->lock);
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_join(fr->thread, NULL);
+	// flush() calls in other threads still hold a pointer
+	pthread_mutex_lock(&fr->lock);
+	while (fr->waiters)
+		pthread_cond_wait(&fr->idle, &fr->lock);
+	pthread_mutex_unlock(&fr->lock);
+	Py_END_ALLOW_THREADS
+
+	spidev_frames_free(fr);
+}
+
+static SpiDevFrames *
+spidev_frames_start(SpiDevObject *self, unsigned int depth, int word)
+{
+	SpiDevFrames *fr;
+	pthread_condattr_t attr;
+
+	fr = calloc(1, sizeof(*fr));
+	if (!fr) {
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+		return NULL;
+	}
+	pthread_mutex_init(&fr->lock, NULL);
+	pthread_cond_init(&fr->cond, NULL);
+	// flush() timeouts are measured on the monotonic clock
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&fr->idle, &attr);
+	pthread_condattr_destroy(&attr);
+
+	fr->dev = self;
+	fr->depth = depth;
+	fr->frames = calloc(depth + 2, sizeof(*fr->frames));
+	fr->queue = calloc(depth, sizeof(*fr->queue));
+	if (!fr->frames || !fr->queue) {
+		spidev_frames_free(fr);
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+		return NULL;
+	}
+	fr->read0 = self->read0 && (self->mode & SPI_CS_HIGH);
+	fr->block = spidev_word_block(SPIDEV_BLOCK_SIZE(self), word);
+
+	if (pthread_create(&fr->thread, NULL, spidev_frames_worker, fr) != 0) {
+		spidev_frames_free(fr);
+		PyErr_SetString(PyExc_RuntimeError, "can't start frame writer thread");
+		return NULL;
+	}
+
+	self->frames = fr;
+	return fr;
+}
+
+// Raise the error that stopped the writer, if any. The writer is then
+// discarded and the next submit_frame() starts a new one.
+static int
+spidev_frames_check(SpiDevObject *self)
+{
+	SpiDevFrames *fr = self->frames;
+	int error;
+
+	if (!fr)
+		return 0;
+
+	pthread_mutex_lock(&fr->lock);
+	error = fr->error;
+	pthread_mutex_unlock(&fr->lock);
+	if (!error)
+		return 0;
+
+	spidev_frames_stop(self);
+	errno = error;
+	PyErr_SetFromErrno(PyExc_IOError);
+	return -1;
+}
+
+// Borrow a free frame buffer of at least len bytes, starting the writer
+// if needed. Only one thread fills buffers at a time (the object is locked),
+// the writer leaves free ones alone.
+static SpiDevFrame *
+spidev_frame_get(SpiDevObject *self, Py_ssize_t depth, size_t len, int word)
+{
+	SpiDevFrames *fr;
+	SpiDevFrame *frame = NULL;
+	unsigned int ii;
+
+	if (depth < 1 || depth > SPIDEV_FRAMES_MAX_DEPTH) {
+		PyErr_Format(PyExc_ValueError, "depth must be between 1 and %d",
+			SPIDEV_FRAMES_MAX_DEPTH);
+		return NULL;
+	}
+
+	if (spidev_frames_check(self) < 0)
+		return NULL;
+
+	fr = self->frames;
+	if (!fr && (fr = spidev_frames_start(self, depth, word)) == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&fr->lock);
+	for (ii = 0; ii < fr->depth + 2; ii++) {
+		if (fr->frames[ii].state == SPIDEV_FRAME_FREE) {
+			frame = &fr->frames[ii];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fr->lock);
+
+	if (frame->size < len) {
+		free(frame->buf);
+		frame->size = 0;
+		frame->buf = malloc(len);
+		if (!frame->buf) {
+			PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+			return NULL;
+		}
+		frame->size = len;
+	}
+	return frame;
+}
+
+// Queue a frame filled by the caller, dropping the oldest queued one if
+// the queue is full. Returns 0 if a frame was dropped, 1 otherwise.
+static int
+spidev_frame_put(SpiDevObject *self, SpiDevFrame *frame, size_t len)
+{
+	SpiDevFrames *fr = self->frames;
+	int dropped = 0;
+
+	frame->len = len;
+
+	pthread_mutex_lock(&fr->lock);
+	if (fr->queued == fr->depth) {
+		fr->frames[fr->queue[fr->first]].state = SPIDEV_FRAME_FREE;
+		fr->first = (fr->first + 1) % fr->depth;
+		fr->queued--;
+		fr->dropped++;
+		dropped = 1;
+	}
+	fr->queue[(fr->first + fr->queued) % fr->depth] = frame - fr->frames;
+	fr->queued++;
+	frame->state = SPIDEV_FRAME_QUEUED;
+	fr->submitted++;
+	pthread_cond_signal(&fr->cond);
+	pthread_mutex_unlock(&fr->lock);
+
+	return !dropped;
+}
+
+PyDoc_STRVAR(SpiDev_submit_frame_doc,
+	"submit_frame(frame[, depth]) -> bool\n\n"
+	"Copy frame (a buffer or list of values) and queue it to a native\n"
+	"thread which writes it as writebytes2 does, then return at once. When\n"
+	"depth frames (1 by default) are already queued the oldest one is\n"
+	"dropped and False is returned. depth is set when the thread starts,\n"
+	"on the first call after open() or after an error.\n");
+
+static const char * const spidev_frame_keywords[] = {"frame", "depth", NULL};
+static SpiDevArgParser SpiDev_submit_frame_parser = {"submit_frame", spidev_frame_keywords, 1};
+
+static PyObject *
+SpiDev_submit_frame_impl(SpiDevObject *self, SPIDEV_ARGS)
+{
+	PyObject *args_out[2];
+	Py_ssize_t depth = SPIDEV_FRAMES_DEPTH;
+	SpiDevTxData tx;
+	SpiDevFrame *frame;
+	int word;
+
+	if (spidev_parse_args(&SpiDev_submit_frame_parser, SPIDEV_ARGS_FWD, args_out) < 0 ||
+	    spidev_arg_ssize(args_out[1], &depth) < 0)
+		return NULL;
+
+	word = SPIDEV_WORD_SIZE(self, 0);
+	if (spidev_tx_open(args_out[0], &tx, word) < 0)
+		return NULL;
+
+	if (tx.len <= 0) {
+		spidev_tx_close(&tx);
+		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+		return NULL;
+	}
+
+	if ((frame = spidev_frame_get(self, depth, tx.len, word)) == NULL ||
+	    spidev_tx_copy(&tx, 0, tx.len, frame->buf) < 0) {
+		spidev_tx_close(&tx);
+		return NULL;
+	}
+	spidev_tx_close(&tx);
+
+	return PyBool_FromLong(spidev_frame_put(self, frame, tx.len));
+}
+
+SPIDEV_LOCKED_FASTCALL(SpiDev_submit_frame)
+
+PyDoc_STRVAR(SpiDev_flush_doc,
+	"flush([timeout]) -> bool\n\n"
+	"Wait until every frame queued by submit_frame() has been written, at\n"
+	"most timeout seconds if given. Return False if the timeout expired,\n"
+	"or if close() discarded the frames first.\n");
+
+static PyObject *
+SpiDev_flush_impl(SpiDevObject *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *timeout = Py_None;
+	SpiDevFrames *fr;
+	struct timespec deadline;
+	double seconds = 0;
+	int status = 0, drained, timed = 0;
+	static char *kwlist[] = {"timeout", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:flush", kwlist, &timeout))
+		return NULL;
+
+	if (timeout != Py_None) {
+		seconds = PyFloat_AsDouble(timeout);
+		if (seconds == -1 && PyErr_Occurred())
+			return NULL;
+		if (Py_IS_NAN(seconds)) {
+			PyErr_SetString(PyExc_ValueError, "timeout must not be NaN");
+			return NULL;
+		}
+		if (seconds < 0)
+			seconds = 0;
+		// Past the range of time_t anyway, wait without a deadline
+		timed = seconds <= 1e9;
+	}
+	if (timed) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += (time_t)seconds;
+		deadline.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+		deadline.tv_sec += deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+	}
+
+	if ((fr = self->frames) == NULL)
+		return PyBool_FromLong(1);
+
+	// Counted before the GIL is released, so close() cannot free fr under us
+	pthread_mutex_lock(&fr->lock);
+	fr->waiters++;
+	pthread_mutex_unlock(&fr->lock);
+
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&fr->lock);
+	while ((fr->queued || fr->writing) && !fr->error && !fr->stop && status == 0) {
+		if (!timed)
+			pthread_cond_wait(&fr->idle, &fr->lock);
+		else
+			status = pthread_cond_timedwait(&fr->idle, &fr->lock, &deadline);
+	}
+	drained = !fr->queued && !fr->writing;
+	fr->waiters--;
+	// Let close() free the writer once the last waiter is gone
+	if (fr->stop && !fr->waiters)
+		pthread_cond_broadcast(&fr->idle);
+	pthread_mutex_unlock(&fr->lock);
+	Py_END_ALLOW_THREADS
+
+	if (spidev_frames_check(self) < 0)
+		return NULL;
+
+	return PyBool_FromLong(drained);
+}
+
+SPIDEV_LOCKED_KEYWORDS(SpiDev_flush)
+
+PyDoc_STRVAR(SpiDev_frame_stats_doc,
+	"frame_stats() -> dict\n\n"
+	"Counters of the frame writer: queue depth, frames submitted, written,\n"
+	"dropped (replaced by a newer frame before being written), queued or\n"
+	"being written, and errno of the error that stopped it (0 if none).\n");
+
+static PyObject *
+SpiDev_frame_stats_impl(SpiDevObject *self, PyObject *unused)
+{
+	SpiDevFrames *fr = self->frames;
+	unsigned long long submitted, written, dropped;
+	unsigned int depth, queued;
+	int error;
+
+	if (!fr)
+		return Py_BuildValue("{s:I,s:K,s:K,s:K,s:I,s:i}",
+			"depth", 0, "submitted", 0ULL, "written", 0ULL,
+			"dropped", 0ULL, "queued", 0, "error", 0);
+
+	pthread_mutex_lock(&fr->lock);
+	depth = fr->depth;
+	submitted = fr->submitted;
+	written = fr->written;
+	dropped = fr->dropped;
+	queued = fr->queued + fr->writing;
+	error = fr->error;
+	pthread_mutex_unlock(&fr->lock);
+
+	return Py_BuildValue("{s:I,s:K,s:K,s:K,s:I,s:i}",
+		"depth", depth,
+		"submitted", submitted,
+		"written", written,
+		"dropped", dropped,
+		"queued", queued,
+		"error", error);
+}
+
+SPIDEV_LOCKED_NOARGS(SpiDev_frame_stats)
+
+// WS2812/SK6812 LED strips.
+// Every bit of color data is sent as a symbol of 3 or 4 SPI bits, 1 bit high
+// for a 0 and 2 (3) bits high for a 1, so the SPI clock sets the timing:
+// 2.4 MHz for 3 bit symbols, 3.2 MHz for 4 bit ones. Color bytes are expanded
+// with a table of their 24 or 32 bit encodings, most significant bit first.
+
+#define WS2812_CHANNELS "RGBW"
+
+static uint8_t ws2812_table3[256][3];
+static uint8_t ws2812_table4[256][4];
+static pthread_once_t ws2812_table_once = PTHREAD_ONCE_INIT;
+
+static void init_ws2812_table(void) {
+	uint32_t code3, code4;
+	int value, bit;
+
+	for (value = 0; value < 256; value++) {
+		code3 = code4 = 0;
+		for (bit = 7; bit >= 0; bit--) {
+			code3 = (code3 << 3) | ((value >> bit) & 1 ? 0x6 : 0x4);
+			code4 = (code4 << 4) | ((value >> bit) & 1 ? 0xe : 0x8);
+		}
+		ws2812_table3[value][0] = code3 >> 16;
+		ws2812_table3[value][1] = code3 >> 8;
+		ws2812_table3[value][2] = code3;
+		ws2812_table4[value][0] = code4 >> 24;
+		ws2812_table4[value][1] = code4 >> 16;
+		ws2812_table4[value][2] = code4 >> 8;
+		ws2812_table4[value][3] = code4;
+	}
+}
+
+// Encode count pixels of channels bytes each. Output channel ii is taken
+// from input channel map[ii].
+static void
+ws2812_encode(const uint8_t *src, uint8_t *dst, size_t count, int channels,
+		const int *map, int symbol)
+{
+	size_t ii;
+	int jj;
+
+	if (symbol == 3) {
+		for (ii = 0; ii < count; ii++, src += channels) {
+			for (jj = 0; jj < channels; jj++, dst += 3)
+				memcpy(dst, ws2812_table3[src[map[jj]]], 3);
+		}
+	} else {
+		for (ii = 0; ii < count; ii++, src += channels) {
+			for (jj = 0; jj < channels; jj++, dst += 4)
+				memcpy(dst, ws2812_table4[src[map[jj]]], 4);
+		}
+	}
+}
+
+PyDoc_STRVAR(SpiDev_write_ws2812_doc,
+	"write_ws2812(pixels[, order, bits_per_symbol, background]) -> None\n\n"
+	"Write pixels to a WS2812/SK6812 LED strip. pixels is a buffer or list\n"
+	"of RGB (RGBW if order has 4 letters) bytes, sent in the channel order\n"
+	"of the strip, \"GRB\" by default. Every bit becomes a symbol of\n"
+	"bits_per_symbol (3 or 4) SPI bits; max_speed_hz must be 2400000 or\n"
+	"3200000 accordingly. With background=True the encoded frame is queued\n"
+	"as submit_frame() does and whether it was queued without dropping an\n"
+	"older one is returned.\n");
+
+static const char * const spidev_ws2812_keywords[] = {"pixels", "order", "bits_per_symbol", "background", NULL};
+static SpiDevArgParser SpiDev_write_ws2812_parser = {"write_ws2812", spidev_ws2812_keywords, 1};
+
+static PyObject *
+SpiDev_write_ws2812_impl(SpiDevObject *self, SPIDEV_ARGS)
+{
+	PyObject *args_out[4], *result = NULL;
+	const char *order = "GRB";
+	Py_ssize_t symbol = 3, count, len, order_len;
+	int map[4], channels, background = 0, status, ii;
+	SpiDevTxData tx;
+	SpiDevFrame *frame;
+	uint8_t *buf, *out;
+
+	if (spidev_parse_args(&SpiDev_write_ws2812_parser, SPIDEV_ARGS_FWD, args_out) < 0 ||
+	    spidev_arg_ssize(args_out[2], &symbol) < 0)
+		return NULL;
+
+	if (args_out[1]) {
+#if PY_MAJOR_VERSION < 3
+		order = PyString_AsString(args_out[1]);
+#else
+		order = PyUnicode_AsUTF8(args_out[1]);
+#endif
+		if (!order)
+			return NULL;
+	}
+	if (args_out[3] && (background = PyObject_IsTrue(args_out[3])) < 0)
+		return NULL;
+
+	order_len = strlen(order);
+	if (order_len < 3 || order_len > 4) {
+		PyErr_SetString(PyExc_ValueError, "order must have 3 or 4 letters of RGBW");
+		return NULL;
+	}
+	channels = order_len;
+	for (ii = 0; ii < channels; ii++) {
+		const char *pos = strchr(WS2812_CHANNELS, order[ii]);
+
+		if (!pos || pos - WS2812_CHANNELS >= channels) {
+			PyErr_Format(PyExc_ValueError, "invalid channel order '%s'", order);
+			return NULL;
+		}
+		map[ii] = pos - WS2812_CHANNELS;
+	}
+
+	if (symbol != 3 && symbol != 4) {
+		PyErr_SetString(PyExc_ValueError, "bits_per_symbol must be 3 or 4");
+		return NULL;
+	}
+
+	if (SPIDEV_WORD_SIZE(self, 0) != 1) {
+		PyErr_SetString(PyExc_ValueError, "write_ws2812 needs 8 bits per word");
+		return NULL;
+	}
+
+	if (spidev_tx_open(args_out[0], &tx, 1) < 0)
+		return NULL;
+
+	if (tx.len <= 0 || tx.len % channels) {
+		spidev_tx_close(&tx);
+		PyErr_Format(PyExc_ValueError,
+			"pixels must hold a positive multiple of %d bytes", channels);
+		return NULL;
+	}
+	count = tx.len / channels;
+	if (tx.len > PY_SSIZE_T_MAX / symbol) {
+		spidev_tx_close(&tx);
+		PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+		return NULL;
+	}
+	len = tx.len * symbol;
+
+	// A gap between two writes lets the LEDs latch early, the strip must
+	// go out in a single message
+	if ((size_t)len > SPIDEV_BLOCK_SIZE(self)) {
+		spidev_tx_close(&tx);
+		PyErr_Format(PyExc_ValueError,
+			"encoded strip of %zd bytes exceeds block_size (%lu), raise "
+			"block_size and spidev's bufsiz", len, (unsigned long)SPIDEV_BLOCK_SIZE(self));
+		return NULL;
+	}
+
+	pthread_once(&ws2812_table_once, init_ws2812_table);
+
+	// Lists are converted to bytes in the rx scratch buffer first
+	if (tx.view.obj) {
+		buf = tx.view.buf;
+	} else {
+		if ((buf = spidev_scratch_get(self, SPIDEV_SCRATCH_RX, tx.len)) == NULL) {
+			spidev_tx_close(&tx);
+			return NULL;
+		}
+		if (spidev_tx_copy(&tx, 0, tx.len, buf) < 0) {
+			spidev_scratch_put(self, SPIDEV_SCRATCH_RX, buf);
+			spidev_tx_close(&tx);
+			return NULL;
+		}
+	}
+
+	// The whole strip is encoded first, then written in one message
+	if (background) {
+		frame = spidev_frame_get(self, SPIDEV_FRAMES_DEPTH, len, 1);
+		if (frame) {
+			ws2812_encode(buf, frame->buf, count, channels, map, symbol);
+			result = PyBool_FromLong(spidev_frame_put(self, frame, len));
+		}
+	} else if ((out = spidev_scratch_get(self, SPIDEV_SCRATCH_TX, len)) != NULL) {
+		uint64_t t0 = spidev_now_ns();
+
+		ws2812_encode(buf, out, count, channels, map, symbol);
+
+		SPIDEV_BEGIN_ALLOW_THREADS(self)
+		status = spidev_write_blocks(self, out, len, len);
+		if (status == 0)
+			spidev_read0(self);
+		SPIDEV_END_ALLOW_THREADS(self)
+
+		spidev_scratch_put(self, SPIDEV_SCRATCH_TX, out);
+		spidev_stats_call(self, t0);
+		if (status < 0) {
+			spidev_set_errno(status);
+		} else {
+			Py_INCREF(Py_None);
+			result = Py_None;
+		}
+	}
+
+	if (!tx.view.obj)
+		spidev_scratch_put(self, SPIDEV_SCRATCH_RX, buf);
+	spidev_tx_close(&tx);
+	return result;
+}
+
+SPIDEV_LOCKED_FASTCALL(SpiDev_write_ws2812)
+
+// Read the mode of fd. The 32 bit request also reports the dual/quad bus
+// widths, kernels older than 3.15 only know the 8 bit one.
+static int
+spidev_read_mode(SpiDevObject *self, uint32_t *mode)
+{
+	__u8 tmp8;
+
+#ifdef SPI_IOC_RD_MODE32
+	if (spidev_ioctl(self, SPI_IOC_RD_MODE32, mode) != -1)
+		return 0;
+	if (errno != ENOTTY)
+		return -1;
+#endif
+	if (spidev_ioctl(self, SPI_IOC_RD_MODE, &tmp8) == -1)
+		return -1;
+	*mode = tmp8;
+	return 0;
+}
+
+static int
+spidev_write_mode(SpiDevObject *self, uint32_t mode)
+{
+	__u8 tmp8 = mode;
+
+#ifdef SPI_IOC_WR_MODE32
+	if (spidev_ioctl(self, SPI_IOC_WR_MODE32, &mode) != -1)
+		return 0;
+	if (errno != ENOTTY)
+		return -1;
+#endif
+	if (mode > 0xff) {
+		errno = EINVAL;
+		return -1;
+	}
+	return spidev_ioctl(self, SPI_IOC_WR_MODE, &tmp8);
+}
+
+PyDoc_STRVAR(SpiDev_loopback_doc,
+	"loopback([byte_ns][, responses]) -> int\n\n"
+	"Configure a device opened with the loopback backend.\n"
+	"byte_ns sets the time taken per byte clocked, in nanoseconds.\n"
+	"responses is an iterable of buffers, queued to be received instead\n"
+	"of the echo by the following transfers, one per transfer (each block\n"
+	"of a large transfer is a transfer of its own). Responses are\n"
+	"truncated or padded with zeros to the length of the transfer.\n"
+	"Returns the number of responses still queued.\n");
+
+static PyObject *
+SpiDev_loopback_impl(SpiDevObject *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *byte_ns = Py_None, *responses = Py_None, *iter, *item;
+	SpiDevLoopback *lb;
+	size_t nresponses;
+	static char *kwlist[] = {"byte_ns", "responses", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO:loopback", kwlist, &byte_ns, &responses))
+		return NULL;
+
+	if (self->backend != &spidev_loopback_backend) {
+		PyErr_SetString(PyExc_RuntimeError, "device not opened with the loopback backend");
+		return NULL;
+	}
+	lb = self->backend_data;
+
+	if (byte_ns != Py_None) {
+		unsigned long long ns = PyLong_AsUnsignedLongLong(byte_ns);
+		if (ns == (unsigned long long)-1 && PyErr_Occurred())
+			return NULL;
+		lb->byte_ns = ns;
+	}
+
+	if (responses != Py_None) {
+		if ((iter = PyObject_GetIter(responses)) == NULL)
+			return NULL;
+		while ((item = PyIter_Next(iter)) != NULL) {
+			SpiDevLoopbackResponse *resp;
+			Py_buffer view;
+
+			if (PyObject_GetBuffer(item, &view, PyBUF_SIMPLE) == -1) {
+				Py_DECREF(item);
+				break;
+			}
+			resp = malloc(sizeof(*resp) + view.len);
+			if (resp) {
+				resp->next = NULL;
+				resp->len = view.len;
+				memcpy(resp->data, view.buf, view.len);
+
+				pthread_mutex_lock(&lb->lock);
+				*lb->responses_tail = resp;
+				lb->responses_tail = &resp->next;
+				lb->nresponses++;
+				pthread_mutex_unlock(&lb->lock);
+			} else
+				PyErr_SetString(PyExc_OverflowError, wrmsg_oom);
+			PyBuffer_Release(&view);
+			Py_DECREF(item);
+			if (!resp)
+				break;
+		}
+		Py_DECREF(iter);
+		if (PyErr_Occurred())
+			return NULL;
+	}
+
+	pthread_mutex_lock(&lb->lock);
+	nresponses = lb->nresponses;
+	pthread_mutex_unlock(&lb->lock);
+
+	return PyLong_FromSize_t(nresponses);
+}
+
+SPIDEV_LOCKED_KEYWORDS(SpiDev_loopback)
+
+#define spidev_stats_get(counter) atomic_load_explicit(counter, memory_order_relaxed)
+
+PyDoc_STRVAR(SpiDev_stats_doc,
+	"stats() -> dict\n\n"
+	"Return the transfer statistics of this object since it was created\n"
+	"or reset_stats() was called:\n"
+	"transfers: calls of the transfer methods and asynchronous requests\n"
+	"tx_bytes, rx_bytes: bytes sent and received\n"
+	"ioctls: ioctl, read and write calls on the device, taking io_ns ns\n"
+	"errors: {errno: count} of failed calls, errno 0 counting the others\n"
+	"call_ns: time spent in the transfer methods, of which released_ns\n"
+	"without the GIL and held_ns with it (preparing data and results)\n"
+	"latency: number of device calls taking 2**n to 2**(n+1) ns, by n\n");
+
+static PyObject *
+SpiDev_stats(SpiDevObject *self, PyObject *unused)
+{
+	PyObject *errors, *latency, *result;
+	unsigned long long call_ns, released_ns;
+	int ii;
+
+	if ((errors = PyDict_New()) == NULL)
+		return NULL;
+	for (ii = 0; ii < SPIDEV_STATS_ERRNOS; ii++) {
+		unsigned long long count = spidev_stats_get(&self->stats.errors[ii]);
+		PyObject *key, *value;
+		int status;
+
+		if (count == 0)
+			continue;
+		key = PyLong_FromLong(ii);
+		value = PyLong_FromUnsignedLongLong(count);
+		status = (key && value) ? PyDict_SetItem(errors, key, value) : -1;
+		Py_XDECREF(key);
+		Py_XDECREF(value);
+		if (status < 0) {
+			Py_DECREF(errors);
+			return NULL;
+		}
+	}
+
+	if ((latency = PyList_New(SPIDEV_STATS_BUCKETS)) == NULL) {
+		Py_DECREF(errors);
+		return NULL;
+	}
+	for (ii = 0; ii < SPIDEV_STATS_BUCKETS; ii++) {
+		PyObject *value = PyLong_FromUnsignedLongLong(spidev_stats_get(&self->stats.latency[ii]));
+		if (!value) {
+			Py_DECREF(errors);
+			Py_DECREF(latency);
+			return NULL;
+		}
+		PyList_SET_ITEM(latency, ii, value);
+	}
+
+	call_ns = spidev_stats_get(&self->stats.call_ns);
+	released_ns = spidev_stats_get(&self->stats.released_ns);
+
+	result = Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:N,s:K,s:K,s:K,s:N}",
+		"transfers", spidev_stats_get(&self->stats.transfers),
+		"tx_bytes", spidev_stats_get(&self->stats.tx_bytes),
+		"rx_bytes", spidev_stats_get(&self->stats.rx_bytes),
+		"ioctls", spidev_stats_get(&self->stats.ioctls),
+		"io_ns", spidev_stats_get(&self->stats.io_ns),
+		"errors", errors,
+		"call_ns", call_ns,
+		"released_ns", released_ns,
+		"held_ns", (call_ns > released_ns) ? call_ns - released_ns : 0ULL,
+		"latency", latency);
+	return result;
+}
+
+PyDoc_STRVAR(SpiDev_reset_stats_doc,
+	"reset_stats() -> None\n\n"
+	"Clear the statistics returned by stats().\n");
+
+static PyObject *
+SpiDev_reset_stats(SpiDevObject *self, PyObject *unused)
+{
+	int ii;
+
+	atomic_store_explicit(&self->stats.transfers, 0, memory_order_relaxed);
+	atomic_store_explicit(&self->stats.tx_bytes, 0, memory_order_relaxed);
+	atomic_store_explicit(&self->stats.rx_bytes, 0, memory_order_relaxed);
+	atomic_store_explicit(&self->stats.ioctls, 0, memory_order_relaxed);
+	atomic_store_explicit(&self->stats.io_ns, 0, memory_order_relaxed);
+	atomic_store_explicit(&self->stats.call_ns, 0, memory_order_relaxed);
+	atomic_store_explicit(&self->stats.released_ns, 0, memory_order_relaxed);
+	for (ii = 0; ii < SPIDEV_STATS_ERRNOS; ii++)
+		atomic_store_explicit(&self->stats.errors[ii], 0, memory_order_relaxed);
+	for (ii = 0; ii < SPIDEV_STATS_BUCKETS; ii++)
+		atomic_store_explicit(&self->stats.latency[ii], 0, memory_order_relaxed);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static int __spidev_set_mode( SpiDevObject *self, __u32 mode) {
+	__u32 test = 0;
+	int status;
+
+	Py_BEGIN_ALLOW_THREADS
+	status = spidev_write_mode(self, mode);
+	if (status != -1)
+		status = spidev_read_mode(self, &test);
+	Py_END_ALLOW_THREADS
+
+	if (status == -1) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return -1;
+	}
+	if (test != mode) {
+		PyErr_Format(PyExc_IOError,
+			"Attempted to set mode 0x%x but mode 0x%x returned",
+			(unsigned int)mode, (unsigned int)test);
+		return -1;
+	}
+	return 0;
+}
+
+PyDoc_STRVAR(SpiDev_fileno_doc,
+	"fileno() -> integer \"file descriptor\"\n\n"
+	"This is needed for lower-level file interfaces, such as os.read().\n");
+
+static PyObject *
+SpiDev_fileno(SpiDevObject *self)
+{
+	return PyInt_FromLong(self->fd);
+}
+
+static PyObject *
+SpiDev_get_mode(SpiDevObject *self, void *closure)
+{
+	return PyInt_FromLong(self->mode & (SPI_CPHA | SPI_CPOL));
+}
+
+static PyObject *
+SpiDev_get_cshigh(SpiDevObject *self, void *closure)
+{
+	PyObject *result;
+
+	if (self->mode & SPI_CS_HIGH)
+		result = Py_True;
+	else
+		result = Py_False;
+
+	Py_INCREF(result);
+	return result;
+}
+
+static PyObject *
+SpiDev_get_lsbfirst(SpiDevObject *self, void *closure)
+{
+	PyObject *result;
+
+	if (self->mode & SPI_LSB_FIRST)
+		result = Py_True;
+	else
+		result = Py_False;
+
+	Py_INCREF(result);
+	return result;
+}
+
+static PyObject *
+SpiDev_get_3wire(SpiDevObject *self, void *closure)
+{
+	PyObject *result;
+
+	if (self->mode & SPI_3WIRE)
+		result = Py_True;
+	else
+		result = Py_False;
+
+	Py_INCREF(result);
+	return result;
+}
+
+static PyObject *
+SpiDev_get_loop(SpiDevObject *self, void *closure)
+{
+	PyObject *result;
+
+	if (self->mode & SPI_LOOP)
+		result = Py_True;
+	else
+		result = Py_False;
+
+	Py_INCREF(result);
+	return result;
+}
+
+static PyObject *
+SpiDev_get_no_cs(SpiDevObject *self, void *closure)
+{
+        PyObject *result;
+
+        if (self->mode & SPI_NO_CS)
+                result = Py_True;
+        else
+                result = Py_False;
+
+        Py_INCREF(result);
+        return result;
+}
+
+
+static int
+SpiDev_set_mode_impl(SpiDevObject *self, PyObject *val, void *closure)
+{
+	uint8_t mode;
+	uint32_t tmp;
+	int ret;
+
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError,
+			"Cannot delete attribute");
+		return -1;
+	}
+#if PY_MAJOR_VERSION < 3
+	if (PyInt_Check(val)) {
+		mode = PyInt_AS_LONG(val);
+	} else
+#endif
+	{
+		if (PyLong_Check(val)) {
+			mode = PyLong_AS_LONG(val);
+		} else {
+			PyErr_SetString(PyExc_TypeError,
+				"The mode attribute must be an integer");
+			return -1;
+		}
+	}
+
+
+	if ( mode > 3 ) {
+		PyErr_SetString(PyExc_TypeError,
+			"The mode attribute must be an integer"
+				 "between 0 and 3.");
+		return -1;
+	}
+
+	// clean and set CPHA and CPOL bits
+	tmp = ( self->mode & ~(SPI_CPHA | SPI_CPOL) ) | mode ;
+
+	ret = __spidev_set_mode(self, tmp);
+
+	if (ret != -1)
+		self->mode = tmp;
+	return ret;
+}
+
+SPIDEV_LOCKED_SETTER(SpiDev_set_mode)
+
+static int
+SpiDev_set_cshigh_impl(SpiDevObject *self, PyObject *val, void *closure)
+{
+	uint32_t tmp;
+	int ret;
+
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError,
+			"Cannot delete attribute");
+		return -1;
+	}
+	else if (!PyBool_Check(val)) {
+		PyErr_SetString(PyExc_TypeError,
+			"The cshigh attribute must be boolean");
+		return -1;
+	}
+
+	if (val == Py_True)
+		tmp = self->mode | SPI_CS_HIGH;
+	else
+		tmp = self->mode & ~SPI_CS_HIGH;
+
+	ret = __spidev_set_mode(self, tmp);
+
+	if (ret != -1)
+		self->mode = tmp;
+	return ret;
+}
+
+SPIDEV_LOCKED_SETTER(SpiDev_set_cshigh)
+
+static int
+SpiDev_set_lsbfirst_impl(SpiDevObject *self, PyObject *val, void *closure)
+{
+	uint32_t tmp;
+	int ret;
+
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError,
+			"Cannot delete attribute");
+		return -1;
+	}
+	else if (!PyBool_Check(val)) {
+		PyErr_SetString(PyExc_TypeError,
+			"The lsbfirst attribute must be boolean");
+		return -1;
+	}
+
+	if (val == Py_True)
+		tmp = self->mode | SPI_LSB_FIRST;
+	else
+		tmp = self->mode & ~SPI_LSB_FIRST;
+
+	ret = __spidev_set_mode(self, tmp);
+
+	if (ret != -1)
+		self->mode = tmp;
+	return ret;
+}
+
+SPIDEV_LOCKED_SETTER(SpiDev_set_lsbfirst)
+
+static int
+SpiDev_set_3wire_impl(SpiDevObject *self, PyObject *val, void *closure)
+{
+	uint32_t tmp;
+	int ret;
+
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError,
+			"Cannot delete attribute");
+		return -1;
+	}
+	else if (!PyBool_Check(val)) {
+		PyErr_SetString(PyExc_TypeError,
+			"The 3wire attribute must be boolean");
+		return -1;
+	}
+
+	if (val == Py_True)
+		tmp = self->mode | SPI_3WIRE;
+	else
+		tmp = self->mode & ~SPI_3WIRE;
+
+	ret = __spidev_set_mode(self, tmp);
+
+	if (ret != -1)
+		self->mode = tmp;
+	return ret;
+}
+
+SPIDEV_LOCKED_SETTER(SpiDev_set_3wire)
+
+static int
+SpiDev_set_no_cs_impl(SpiDevObject *self, PyObject *val, void *closure)
+{
+        uint32_t tmp;
+	int ret;
+
+        if (val == NULL) {
+                PyErr_SetString(PyExc_TypeError,
+                        "Cannot delete attribute");
+                return -1;
+        }
+        else if (!PyBool_Check(val)) {
+                PyErr_SetString(PyExc_TypeError,
+                        "The no_cs attribute must be boolean");
+                return -1;
+        }
+
+        if (val == Py_True)
+                tmp = self->mode | SPI_NO_CS;
+        else
+                tmp = self->mode & ~SPI_NO_CS;
+
+        ret = __spidev_set_mode(self, tmp);
+
+	if (ret != -1)
+		self->mode = tmp;
+        return ret;
+}
+
+SPIDEV_LOCKED_SETTER(SpiDev_set_no_cs)
+
+
+static int
+SpiDev_set_loop_impl(SpiDevObject *self, PyObject *val, void *closure)
+{
+	uint32_t tmp;
+	int ret;
+
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError,
+			"Cannot delete attribute");
+		return -1;
+	}
+	else if (!PyBool_Check(val)) {
+		PyErr_SetString(PyExc_TypeError,
+			"The loop attribute must be boolean");
+		return -1;
+	}
+
+	if (val == Py_True)
+		tmp = self->mode | SPI_LOOP;
+	else
+		tmp = self->mode & ~SPI_LOOP;
+
+	ret = __spidev_set_mode(self, tmp);
+
+	if (ret != -1)
+		self->mode = tmp;
+	return ret;
+}
+
+SPIDEV_LOCKED_SETTER(SpiDev_set_loop)
+
+#ifdef SPI_TX_QUAD
+// Bus widths of the data phase. The closure holds the SPI_TX_*/SPI_RX_* bit.
+// Dual and quad exclude each other, so enabling one clears the other.
+#define SPIDEV_TX_WIDTHS (SPI_TX_DUAL | SPI_TX_QUAD)
+#define SPIDEV_RX_WIDTHS (SPI_RX_DUAL | SPI_RX_QUAD)
+
+static PyObject *
+SpiDev_get_width(SpiDevObject *self, void *closure)
+{
+	PyObject *result;
+
+	if (self->mode & (uint32_t)(uintptr_t)closure)
+		result = Py_True;
+	else
+		result = Py_False;
+
+	Py_INCREF(result);
+	return result;
+}
+
+static int
+SpiDev_set_width_impl(SpiDevObject *self, PyObject *val, void *closure)
+{
+	uint32_t flag = (uint32_t)(uintptr_t)closure;
+	uint32_t tmp;
+	int ret;
+
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError,
+			"Cannot delete attribute");
+		return -1;
+	}
+	else if (!PyBool_Check(val)) {
+		PyErr_SetString(PyExc_TypeError,
+			"The bus width attributes must be boolean");
+		return -1;
+	}
+
+	if (val == Py_True)
+		tmp = (self->mode & ~((flag & SPIDEV_TX_WIDTHS) ? SPIDEV_TX_WIDTHS : SPIDEV_RX_WIDTHS)) | flag;
+	else
+		tmp = self->mode & ~flag;
+
+	ret = __spidev_set_mode(self, tmp);
+
+	if (ret != -1)
+		self->mode = tmp;
+	return ret;
+}
+
+SPIDEV_LOCKED_SETTER(SpiDev_set_width)
+#endif
+
+static PyObject *
+SpiDev_get_bits_per_word(SpiDevObject *self, void *closure)
+{
+	return PyInt_FromLong(self->bits_per_word);
+}
+
+static int
+SpiDev_set_bits_per_word_impl(SpiDevObject *self, PyObject *val, void *closure)
+{
+	uint8_t bits;
+	int status;
+
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError,
+			"Cannot delete attribute");
+		return -1;
+	}
+#if PY_MAJOR_VERSION < 3
+	if (PyInt_Check(val)) {
+		bits = PyInt_AS_LONG(val);
+	} else
+#endif
+	{
+		if (PyLong_Check(val)) {
+			bits = PyLong_AS_LONG(val);
+		} else {
+			PyErr_SetString(PyExc_TypeError,
+				"The bits_per_word attribute must be an integer");
+			return -1;
+		}
+	}
+
+		if (bits < 8 || bits > 32) {
+		PyErr_SetString(PyExc_TypeError,
+			"invalid bits_per_word (8 to 32)");
+		return -1;
+	}
+
+	if (self->bits_per_word != bits) {
+		Py_BEGIN_ALLOW_THREADS
+		status = spidev_ioctl(self, SPI_IOC_WR_BITS_PER_WORD, &bits);
+		Py_END_ALLOW_THREADS
+		if (status == -1) {
+			PyErr_SetFromErrno(PyExc_IOError);
+			return -1;
+		}
+		self->bits_per_word = bits;
+	}
+	return 0;
+}
+
+SPIDEV_LOCKED_SETTER(SpiDev_set_bits_per_word)
+
+static PyObject *
+SpiDev_get_max_speed_hz(SpiDevObject *self, void *closure)
+{
+	return PyInt_FromLong(self->max_speed_hz);
+}
+
+static int
+SpiDev_set_max_speed_hz_impl(SpiDevObject *self, PyObject *val, void *closure)
+{
+	uint32_t max_speed_hz;
+	int status;
+
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError,
+			"Cannot delete attribute");
+		return -1;
+	}
+#if PY_MAJOR_VERSION < 3
+	if (PyInt_Check(val)) {
+		max_speed_hz = PyInt_AS_LONG(val);
+	} else
+#endif
+	{
+		if (PyLong_Check(val)) {
+			max_speed_hz = PyLong_AS_LONG(val);
+		} else {
+			PyErr_SetString(PyExc_TypeError,
+				"The max_speed_hz attribute must be an integer");
+			return -1;
+		}
+	}
+
+	if (self->max_speed_hz != max_speed_hz) {
+		Py_BEGIN_ALLOW_THREADS
+		status = spidev_ioctl(self, SPI_IOC_WR_MAX_SPEED_HZ, &max_speed_hz);
+		Py_END_ALLOW_THREADS
+		if (status == -1) {
+			PyErr_SetFromErrno(PyExc_IOError);
+			return -1;
+		}
+		self->max_speed_hz = max_speed_hz;
+	}
+	return 0;
+}
+
+SPIDEV_LOCKED_SETTER(SpiDev_set_max_speed_hz)
+
+static PyObject *
+SpiDev_get_read0(SpiDevObject *self, void *closure)
+{
+	PyObject *result = (self->read0 == 1) ? Py_True : Py_False;
+	Py_INCREF(result);
+	return result;
+}
+
+static int
+SpiDev_set_read0_impl(SpiDevObject *self, PyObject *val, void *closure)
+{
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError,
+			"Cannot delete attribute");
+		return -1;
+	}
+	else if (!PyBool_Check(val)) {
+		PyErr_SetString(PyExc_TypeError,
+			"The read0 attribute must be boolean");
+		return -1;
+	}
+
+	self->read0 = (val == Py_True) ? 1 : 0;
+
+	return 0;
+}
+
+SPIDEV_LOCKED_SETTER(SpiDev_set_read0)
+
+static PyObject *
+SpiDev_get_output_type(SpiDevObject *self, void *closure)
+{
+	PyObject *result;
+
+	switch (self->output_type) {
+	case SPIDEV_OUTPUT_LIST:
+		result = (PyObject *)&PyList_Type;
+		break;
+	case SPIDEV_OUTPUT_BYTES:
+		result = (PyObject *)&PyBytes_Type;
+		break;
+	case SPIDEV_OUTPUT_BYTEARRAY:
+		result = (PyObject *)&PyByteArray_Type;
+		break;
+	case SPIDEV_OUTPUT_MEMORYVIEW:
+		result = (PyObject *)&PyMemoryView_Type;
+		break;
+	default:
+		result = Py_None;
+	}
+
+	Py_INCREF(result);
+	return result;
+}
+
+static int
+SpiDev_set_output_type_impl(SpiDevObject *self, PyObject *val, void *closure)
+{
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError,
+			"Cannot delete attribute");
+		return -1;
+	}
+
+	if (val == Py_None)
+		self->output_type = SPIDEV_OUTPUT_DEFAULT;
+	else if (val == (PyObject *)&PyList_Type)
+		self->output_type = SPIDEV_OUTPUT_LIST;
+	else if (val == (PyObject *)&PyBytes_Type)
+		self->output_type = SPIDEV_OUTPUT_BYTES;
+	else if (val == (PyObject *)&PyByteArray_Type)
+		self->output_type = SPIDEV_OUTPUT_BYTEARRAY;
+	else if (val == (PyObject *)&PyMemoryView_Type)
+		self->output_type = SPIDEV_OUTPUT_MEMORYVIEW;
+	else {
+		PyErr_SetString(PyExc_TypeError,
+			"The output_type attribute must be None, list, bytes, bytearray or memoryview");
+		return -1;
+	}
+
+	if (self->output_type != SPIDEV_OUTPUT_MEMORYVIEW)
+		Py_CLEAR(self->recycled);
+
+	return 0;
+}
+
+SPIDEV_LOCKED_SETTER(SpiDev_set_output_type)
+
+static PyObject *
+SpiDev_get_block_size(SpiDevObject *self, void *closure)
+{
+	return PyLong_FromUnsignedLong(SPIDEV_BLOCK_SIZE(self));
+}
+
+static int
+SpiDev_set_block_size_impl(SpiDevObject *self, PyObject *val, void *closure)
+{
+	unsigned long block_size;
+	uint32_t bufsiz;
+
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError,
+			"Cannot delete attribute");
+		return -1;
+	}
+	if (!PyLong_Check(val)) {
+		PyErr_SetString(PyExc_TypeError,
+			"The block_size attribute must be an integer");
+		return -1;
+	}
+
+	block_size = PyLong_AsUnsignedLong(val);
+	if (PyErr_Occurred())
+		return -1;
+
+	bufsiz = spidev_read_bufsiz();
+	if (block_size < 1 || block_size > (bufsiz ? bufsiz : UINT32_MAX)) {
+		PyErr_Format(PyExc_ValueError,
+			"invalid block_size (1 to %u)", bufsiz ? bufsiz : UINT32_MAX);
+		return -1;
+	}
+
+	self->block_size = block_size;
+	return 0;
+}
+
+SPIDEV_LOCKED_SETTER(SpiDev_set_block_size)
+
+static PyObject *
+SpiDev_get_scratch_limit(SpiDevObject *self, void *closure)
+{
+	return PyLong_FromSize_t(self->scratch_limit);
+}
+
+static int
+SpiDev_set_scratch_limit_impl(SpiDevObject *self, PyObject *val, void *closure)
+{
+	int ii;
+	size_t limit;
+
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError,
+			"Cannot delete attribute");
+		return -1;
+	}
+	if (!PyLong_Check(val)) {
+		PyErr_SetString(PyExc_TypeError,
+			"The scratch_limit attribute must be an integer");
+		return -1;
+	}
+
+	limit = PyLong_AsSize_t(val);
+	if (PyErr_Occurred())
+		return -1;
+
+	// Idle buffers above the new limit go now, others when given back
+	self->scratch_limit = limit;
+	for (ii = 0; ii < SPIDEV_SCRATCH_COUNT; ii++) {
+		if (!self->scratch[ii].busy && self->scratch[ii].size > limit)
+			spidev_scratch_release(&self->scratch[ii]);
+	}
+	return 0;
+}
+
+SPIDEV_LOCKED_SETTER(SpiDev_set_scratch_limit)
+
+static PyObject *
+SpiDev_get_backend(SpiDevObject *self, void *closure)
+{
+	return PyUnicode_FromString(self->backend->name);
+}
+
+static PyGetSetDef SpiDev_getset[] = {
+	{"mode", (getter)SpiDev_get_mode, (setter)SpiDev_set_mode,
+			"SPI mode as two bit pattern of \n"
+			"Clock Polarity  and Phase [CPOL|CPHA]\n"
+			"min: 0b00 = 0 max: 0b11 = 3\n"},
+	{"cshigh", (getter)SpiDev_get_cshigh, (setter)SpiDev_set_cshigh,
+			"CS active high\n"},
+	{"threewire", (getter)SpiDev_get_3wire, (setter)SpiDev_set_3wire,
+			"SI/SO signals shared\n"},
+	{"lsbfirst", (getter)SpiDev_get_lsbfirst, (setter)SpiDev_set_lsbfirst,
+			"LSB first\n"},
+	{"loop", (getter)SpiDev_get_loop, (setter)SpiDev_set_loop,
+			"loopback configuration\n"},
+	{"no_cs", (getter)SpiDev_get_no_cs, (setter)SpiDev_set_no_cs,
+			"disable chip select\n"},
+#ifdef SPI_TX_QUAD
+	{"tx_dual", (getter)SpiDev_get_width, (setter)SpiDev_set_width,
+			"transmit with 2 wires\n", (void *)(uintptr_t)SPI_TX_DUAL},
+	{"tx_quad", (getter)SpiDev_get_width, (setter)SpiDev_set_width,
+			"transmit with 4 wires\n", (void *)(uintptr_t)SPI_TX_QUAD},
+	{"rx_dual", (getter)SpiDev_get_width, (setter)SpiDev_set_width,
+			"receive with 2 wires\n", (void *)(uintptr_t)SPI_RX_DUAL},
+	{"rx_quad", (getter)SpiDev_get_width, (setter)SpiDev_set_width,
+			"receive with 4 wires\n", (void *)(uintptr_t)SPI_RX_QUAD},
+#endif
+	{"bits_per_word", (getter)SpiDev_get_bits_per_word, (setter)SpiDev_set_bits_per_word,
+			"bits per word\n"},
+	{"max_speed_hz", (getter)SpiDev_get_max_speed_hz, (setter)SpiDev_set_max_speed_hz,
+			"maximum speed in Hz\n"},
+	{"read0", (getter)SpiDev_get_read0, (setter)SpiDev_set_read0,
+			"Read 0 bytes after transfer to lower CS if cshigh == True\n"},
+	{"block_size", (getter)SpiDev_get_block_size, (setter)SpiDev_set_block_size,
+			"largest number of bytes sent in one message, larger\n"
+			"transfers are split in blocks of this size\n"},
+	{"scratch_limit", (getter)SpiDev_get_scratch_limit, (setter)SpiDev_set_scratch_limit,
+			"largest buffer kept from one call to the next for\n"
+			"converting lists, 0 to allocate them on every call\n"},
+	{"output_type", (getter)SpiDev_get_output_type, (setter)SpiDev_set_output_type,
+			"type of received data: None (lists), list, bytes, bytearray or memoryview\n"},
+	{"backend", (getter)SpiDev_get_backend, NULL,
+			"name of the backend the device is accessed with\n"},
+	{NULL},
+};
+
+PyDoc_STRVAR(SpiDev_open_doc,
+	"open(bus, device[, backend])\n\n"
+	"Connects the object to the specified SPI device.\n"
+	"open(X,Y) will open /dev/spidev<X>.<Y>\n"
+	"backend selects how the device is accessed: \"kernel\" (default)\n"
+	"or \"loopback\", an in-process device echoing what it receives,\n"
+	"see loopback().\n");
+
+static PyObject *
+SpiDev_open_impl(SpiDevObject *self, PyObject *args, PyObject *kwds)
+{
+	int bus, device;
+	char path[SPIDEV_MAXPATH];
+	uint8_t bits = 0;
+	uint32_t mode = 0, speed = 0, block_size = 0;
+	int status;
+	const char *name = NULL;
+	const SpiDevBackend *backend = &spidev_kernel_backend;
+	PyObject *ret;
+	int ii;
+	static char *kwlist[] = {"bus", "device", "backend", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii|z:open", kwlist, &bus, &device, &name))
+		return NULL;
+	if (name) {
+		for (ii = 0; spidev_backends[ii]; ii++)
+			if (strcmp(spidev_backends[ii]->name, name) == 0)
+				break;
+		if (!spidev_backends[ii]) {
+			PyErr_Format(PyExc_ValueError, "Unknown backend '%s'.", name);
+			return NULL;
+		}
+		backend = spidev_backends[ii];
+	}
+	if (snprintf(path, SPIDEV_MAXPATH, "/dev/spidev%d.%d", bus, device) >= SPIDEV_MAXPATH) {
+		PyErr_SetString(PyExc_OverflowError,
+			"Bus and/or device number is invalid.");
+		return NULL;
+	}
+	// Release the device opened before, if any
+	if ((ret = SpiDev_close_impl(self)) == NULL)
+		return NULL;
+	Py_DECREF(ret);
+
+	// The device is opened and its settings read without the GIL
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&self->dev_lock);
+	status = backend->open(self, path);
+	if (status != -1)
+		self->backend = backend;
+	pthread_mutex_unlock(&self->dev_lock);
+	if (status != -1)
+		status = spidev_read_mode(self, &mode);
+	if (status != -1)
+		status = spidev_ioctl(self, SPI_IOC_RD_BITS_PER_WORD, &bits);
+	if (status != -1)
+		status = spidev_ioctl(self, SPI_IOC_RD_MAX_SPEED_HZ, &speed);
+	if (status != -1)
+		block_size = spidev_default_block_size();
+	Py_END_ALLOW_THREADS
+
+	if (status == -1) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return NULL;
+	}
+	self->mode = mode;
+	self->bits_per_word = bits;
+	self->max_speed_hz = speed;
+	self->block_size = block_size;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+SPIDEV_LOCKED_KEYWORDS(SpiDev_open)
+
+static int
+SpiDev_init(SpiDevObject *self, PyObject *args, PyObject *kwds)
+{
+	int bus = -1;
+	int client = -1;
+	static char *kwlist[] = {"bus", "client", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ii:__init__",
+			kwlist, &bus, &client))
+		return -1;
+
+	if (bus >= 0) {
+		SpiDev_open(self, args, kwds);
+		if (PyErr_Occurred())
+			return -1;
+	}
+
+	return 0;
+}
+
+
+PyDoc_STRVAR(SpiDevObjectType_doc,
+	"SpiDev([bus],[client]) -> SPI\n\n"
+	"Return a new SPI object that is (optionally) connected to the\n"
+	"specified SPI device interface.\n");
+
+static
+PyObject *SpiDev_enter(PyObject *self, PyObject *args)
+{
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+
+    Py_INCREF(self);
+    return self;
+}
+
+static
+PyObject *SpiDev_exit(SpiDevObject *self, PyObject *args)
+{
+
+    PyObject *exc_type = 0;
+    PyObject *exc_value = 0;
+    PyObject *traceback = 0;
+    if (!PyArg_UnpackTuple(args, "__exit__", 3, 3, &exc_type, &exc_value,
+                           &traceback)) {
+        return 0;
+    }
+
+    SpiDev_close(self);
+    Py_RETURN_FALSE;
+}
+
+static PyMethodDef SpiDev_methods[] = {
+	{"open", (PyCFunction)SpiDev_open, METH_VARARGS | METH_KEYWORDS,
+		SpiDev_open_doc},
+	{"close", (PyCFunction)SpiDev_close, METH_NOARGS,
+		SpiDev_close_doc},
+	{"fileno", (PyCFunction)SpiDev_fileno, METH_NOARGS,
+		SpiDev_fileno_doc},
+	{"readbytes", (PyCFunction)SpiDev_readbytes, SPIDEV_METH_ARGS,
+		SpiDev_read_doc},
+	{"writebytes", (PyCFunction)SpiDev_writebytes, SPIDEV_METH_ARGS,
+		SpiDev_write_doc},
+	{"writebytes2", (PyCFunction)SpiDev_writebytes2, SPIDEV_METH_ARGS,
+		SpiDev_writebytes2_doc},
+	{"read_to_file", (PyCFunction)SpiDev_read_to_file, SPIDEV_METH_ARGS,
+		SpiDev_read_to_file_doc},
+	{"write_from_file", (PyCFunction)SpiDev_write_from_file, SPIDEV_METH_ARGS,
+		SpiDev_write_from_file_doc},
+	{"xfer", (PyCFunction)SpiDev_xfer, SPIDEV_METH_ARGS,
+		SpiDev_xfer_doc},
+	{"xfer2", (PyCFunction)SpiDev_xfer2, SPIDEV_METH_ARGS,
+		SpiDev_xfer2_doc},
+	{"xfer3", (PyCFunction)SpiDev_xfer3, SPIDEV_METH_ARGS,
+		SpiDev_xfer3_doc},
+	{"xfer_into", (PyCFunction)SpiDev_xfer_into, SPIDEV_METH_ARGS,
+		SpiDev_xfer_into_doc},
+	{"transfer", (PyCFunction)SpiDev_transfer, SPIDEV_METH_ARGS,
+		SpiDev_transfer_doc},
+	{"execute", (PyCFunction)SpiDev_execute, SPIDEV_METH_ARGS,
+		SpiDev_execute_doc},
+	{"flash_read", (PyCFunction)SpiDev_flash_read, SPIDEV_METH_ARGS,
+		SpiDev_flash_read_doc},
+	{"poll_until", (PyCFunction)SpiDev_poll_until, SPIDEV_METH_ARGS,
+		SpiDev_poll_until_doc},
+	{"loopback", (PyCFunction)SpiDev_loopback, METH_VARARGS | METH_KEYWORDS,
+		SpiDev_loopback_doc},
+	{"stats", (PyCFunction)SpiDev_stats, METH_NOARGS,
+		SpiDev_stats_doc},
+	{"reset_stats", (PyCFunction)SpiDev_reset_stats, METH_NOARGS,
+		SpiDev_reset_stats_doc},
+	{"calibrate_block_size", (PyCFunction)SpiDev_calibrate_block_size, METH_VARARGS | METH_KEYWORDS,
+		SpiDev_calibrate_block_size_doc},
+	{"axfer", (PyCFunction)SpiDev_axfer, SPIDEV_METH_ARGS,
+		SpiDev_axfer_doc},
+	{"awrite", (PyCFunction)SpiDev_awrite, SPIDEV_METH_ARGS,
+		SpiDev_awrite_doc},
+	{"aread", (PyCFunction)SpiDev_aread, SPIDEV_METH_ARGS,
+		SpiDev_aread_doc},
+	{"stream_start", (PyCFunction)SpiDev_stream_start, METH_VARARGS | METH_KEYWORDS,
+		SpiDev_stream_start_doc},
+	{"stream_stop", (PyCFunction)SpiDev_stream_stop, METH_NOARGS,
+		SpiDev_stream_stop_doc},
+	{"stream_read", (PyCFunction)SpiDev_stream_read, METH_VARARGS,
+		SpiDev_stream_read_doc},
+	{"stream_readinto", (PyCFunction)SpiDev_stream_readinto, METH_VARARGS,
+		SpiDev_stream_readinto_doc},
+	{"stream_stats", (PyCFunction)SpiDev_stream_stats, METH_NOARGS,
+		SpiDev_stream_stats_doc},
+	{"submit_frame", (PyCFunction)SpiDev_submit_frame, SPIDEV_METH_ARGS,
+		SpiDev_submit_frame_doc},
+	{"flush", (PyCFunction)SpiDev_flush, METH_VARARGS | METH_KEYWORDS,
+		SpiDev_flush_doc},
+	{"frame_stats", (PyCFunction)SpiDev_frame_stats, METH_NOARGS,
+		SpiDev_frame_stats_doc},
+	{"write_ws2812", (PyCFunction)SpiDev_write_ws2812, SPIDEV_METH_ARGS,
+		SpiDev_write_ws2812_doc},
+	{"__enter__", (PyCFunction)SpiDev_enter, METH_VARARGS,
+		NULL},
+	{"__exit__", (PyCFunction)SpiDev_exit, METH_VARARGS,
+		NULL},
+	{NULL},
+};
+
+static PyTypeObject SpiDevObjectType = {
+#if PY_MAJOR_VERSION >= 3
+	PyVarObject_HEAD_INIT(NULL, 0)
+#else
+	PyObject_HEAD_INIT(NULL)
+	0,				/* ob_size */
+#endif
+	"SpiDev",			/* tp_name */
+	sizeof(SpiDevObject),		/* tp_basicsize */
+	0,				/* tp_itemsize */
+	(destructor)SpiDev_dealloc,	/* tp_dealloc */
+	0,				/* tp_print */
+	0,				/* tp_getattr */
+	0,				/* tp_setattr */
+	0,				/* tp_compare */
+	0,				/* tp_repr */
+	0,				/* tp_as_number */
+	0,				/* tp_as_sequence */
+	0,				/* tp_as_mapping */
+	0,				/* tp_hash */
+	0,				/* tp_call */
+	0,				/* tp_str */
+	0,				/* tp_getattro */
+	0,				/* tp_setattro */
+	0,				/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+	SpiDevObjectType_doc,		/* tp_doc */
+	0,				/* tp_traverse */
+	0,				/* tp_clear */
+	0,				/* tp_richcompare */
+	0,				/* tp_weaklistoffset */
+	0,				/* tp_iter */
+	0,				/* tp_iternext */
+	SpiDev_methods,			/* tp_methods */
+	0,				/* tp_members */
+	SpiDev_getset,			/* tp_getset */
+	0,				/* tp_base */
+	0,				/* tp_dict */
+	0,				/* tp_descr_get */
+	0,				/* tp_descr_set */
+	0,				/* tp_dictoffset */
+	(initproc)SpiDev_init,		/* tp_init */
+	0,				/* tp_alloc */
+	SpiDev_new,			/* tp_new */
+};
+
+// Register maps.
+// A RegisterMap describes once how a device addresses its registers: address
+// width, bits set in the address of reads, writes and multi-byte accesses,
+// and dummy bytes between address and data of reads. Accesses then run as one
+// transfer each, CS going inactive in between, batched into as few
+// SPI_IOC_MESSAGE(N) ioctls as the segment limit and block_size allow.
+
+typedef struct {
+	PyObject_HEAD
+	SpiDevObject *spi;
+	int address_bytes;
+	unsigned long read_mask;	/* or'ed into the address of reads */
+	unsigned long write_mask;	/* or'ed into the address of writes */
+	unsigned long increment_mask;	/* or'ed into the address of accesses to several registers */
+	int auto_increment;	/* the device moves to the next register by itself */
+	int dummy_bytes;	/* between address and data of reads */
+} RegisterMapObject;
+
+// len bytes read into out, or written from data, starting at register reg
+typedef struct {
+	unsigned long reg;
+	size_t len;
+	const uint8_t *data;	/* NULL for reads */
+	uint8_t *out;
+} RegisterAccess;
+
+// Largest address that fits in address_bytes
+static unsigned long
+regmap_max_address(int address_bytes)
+{
+	return address_bytes >= (int)sizeof(unsigned long) ?
+		ULONG_MAX : (1UL << (8 * address_bytes)) - 1;
+}
+
+// Run ioctls for the count transfers prepared in xfers, then copy the data
+// received by reads to their destination. Returns 0 or a negative errno.
+static int
+regmap_flush(SpiDevObject *dev, struct spi_ioc_transfer *xfers, uint8_t **dst,
+		unsigned int *skip, unsigned int count)
+{
+	unsigned int ii;
+	int status;
+
+	// CS stays active after the last transfer otherwise
+	xfers[count - 1].cs_change = 0;
+
+	SPIDEV_BEGIN_ALLOW_THREADS(dev)
+	status = spidev_ioctl(dev, SPI_IOC_MESSAGE(count), xfers);
+	if (status >= 0)
+		spidev_read0(dev);
+	SPIDEV_END_ALLOW_THREADS(dev)
+
+	if (status < 0)
+		return -errno;
+
+	for (ii = 0; ii < count; ii++)
+		if (dst[ii])
+			memcpy(dst[ii], (uint8_t *)(unsigned long)xfers[ii].rx_buf + skip[ii],
+				xfers[ii].len - skip[ii]);
+	return 0;
+}
+
+// Run count accesses. Accesses to several registers of a device that does
+// not auto-increment are split in one transfer per register.
+static int
+regmap_run(RegisterMapObject *self, RegisterAccess *acc, Py_ssize_t count)
+{
+	SpiDevObject *dev = self->spi;
+	struct spi_ioc_transfer xfers[SPIDEV_MAX_SEGMENTS];
+	uint8_t *dst[SPIDEV_MAX_SEGMENTS];
+	unsigned int skip[SPIDEV_MAX_SEGMENTS], nxfers = 0;
+	size_t block = SPIDEV_BLOCK_SIZE(dev), used = 0, total = 0, hdr, len, off;
+	unsigned long reg, max_reg = regmap_max_address(self->address_bytes);
+	uint8_t *tx, *rx = NULL;
+	Py_ssize_t ii;
+	int jj, status = 0;
+	uint64_t t0 = spidev_now_ns();
+
+	for (ii = 0; ii < count; ii++) {
+		if (acc[ii].reg > max_reg || acc[ii].len - 1 > max_reg - acc[ii].reg) {
+			PyErr_Format(PyExc_ValueError, "register %lu out of range", acc[ii].reg);
+			return -1;
+		}
+		hdr = self->address_bytes + (acc[ii].data ? 0 : self->dummy_bytes);
+		len = self->auto_increment ? acc[ii].len : 1;
+		if (hdr + len > block) {
+			PyErr_Format(PyExc_OverflowError,
+				"Register access exceeds block_size (%zu bytes).", block);
+			return -1;
+		}
+		total += (hdr + len) * (acc[ii].len / len);
+	}
+
+	if (total > block)
+		total = block;
+	if ((tx = spidev_scratch_get(dev, SPIDEV_SCRATCH_TX, total)) == NULL ||
+	    (rx = spidev_scratch_get(dev, SPIDEV_SCRATCH_RX, total)) == NULL) {
+		if (tx)
+			spidev_scratch_put(dev, SPIDEV_SCRATCH_TX, tx);
+		return -1;
+	}
+
+	for (ii = 0; ii < count && status == 0; ii++) {
+		hdr = self->address_bytes + (acc[ii].data ? 0 : self->dummy_bytes);
+		len = self->auto_increment ? acc[ii].len : 1;
+
+		for (off = 0; off < acc[ii].len && status == 0; off += len) {
+			if (nxfers == SPIDEV_MAX_SEGMENTS || used + hdr + len > block) {
+				status = regmap_flush(dev, xfers, dst, skip, nxfers);
+				nxfers = used = 0;
+				if (status < 0)
+					break;
+			}
+
+			reg = acc[ii].reg + off;
+			reg |= acc[ii].data ? self->write_mask : self->read_mask;
+			if (len > 1)
+				reg |= self->increment_mask;
+			for (jj = 0; jj < self->address_bytes; jj++)
+				tx[used + jj] = reg >> (8 * (self->address_bytes - 1 - jj));
+			if (acc[ii].data)
+				memcpy(tx + used + hdr, acc[ii].data + off, len);
+			else
+				memset(tx + used + self->address_bytes, 0, self->dummy_bytes + len);
+
+			memset(&xfers[nxfers], 0, sizeof(xfers[nxfers]));
+			xfers[nxfers].tx_buf = (unsigned long)(tx + used);
+			xfers[nxfers].rx_buf = acc[ii].data ? 0 : (unsigned long)(rx + used);
+			xfers[nxfers].len = hdr + len;
+			xfers[nxfers].speed_hz = dev->max_speed_hz;
+			xfers[nxfers].bits_per_word = 8;
+			xfers[nxfers].cs_change = 1;
+			dst[nxfers] = acc[ii].data ? NULL : acc[ii].out + off;
+			skip[nxfers] = hdr;
+			nxfers++;
+			used += hdr + len;
+		}
+	}
+	if (status == 0 && nxfers)
+		status = regmap_flush(dev, xfers, dst, skip, nxfers);
+
+	spidev_scratch_put(dev, SPIDEV_SCRATCH_RX, rx);
+	spidev_scratch_put(dev, SPIDEV_SCRATCH_TX, tx);
+	spidev_stats_call(dev, t0);
+
+	if (status < 0) {
+		spidev_set_errno(status);
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *
+RegisterMap_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	RegisterMapObject *self;
+	SpiDevObject *spi;
+	int address_bytes = 1, dummy_bytes = 0;
+	unsigned long read_mask = 0x80, write_mask = 0, increment_mask = 0;
+	PyObject *auto_increment = NULL;
+	static char *kwlist[] = {"spi", "address_bytes", "read_mask", "write_mask",
+		"increment_mask", "auto_increment", "dummy_bytes", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|ikkkOi:RegisterMap", kwlist,
+			&SpiDevObjectType, &spi, &address_bytes, &read_mask, &write_mask,
+			&increment_mask, &auto_increment, &dummy_bytes))
+		return NULL;
+
+	if (address_bytes < 1 || address_bytes > 4) {
+		PyErr_SetString(PyExc_ValueError, "address_bytes must be between 1 and 4");
+		return NULL;
+	}
+	if (dummy_bytes < 0 || dummy_bytes > FLASH_READ_MAX_DUMMY) {
+		PyErr_Format(PyExc_ValueError, "dummy_bytes must be between 0 and %d",
+			FLASH_READ_MAX_DUMMY);
+		return NULL;
+	}
+
+	if ((read_mask | write_mask | increment_mask) > regmap_max_address(address_bytes)) {
+		PyErr_SetString(PyExc_ValueError, "masks must fit in address_bytes");
+		return NULL;
+	}
+
+	if ((self = (RegisterMapObject *)type->tp_alloc(type, 0)) == NULL)
+		return NULL;
+
+	Py_INCREF(spi);
+	self->spi = spi;
+	self->address_bytes = address_bytes;
+	self->read_mask = read_mask;
+	self->write_mask = write_mask;
+	self->increment_mask = increment_mask;
+	self->auto_increment = auto_increment ? PyObject_IsTrue(auto_increment) : 1;
+	self->dummy_bytes = dummy_bytes;
+	if (self->auto_increment < 0) {
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	return (PyObject *)self;
+}
+
+static void
+RegisterMap_dealloc(RegisterMapObject *self)
+{
+	Py_XDECREF(self->spi);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+// Register number argument
+static int
+regmap_arg_reg(PyObject *obj, unsigned long *reg)
+{
+	*reg = PyLong_AsUnsignedLong(obj);
+	return (*reg == (unsigned long)-1 && PyErr_Occurred()) ? -1 : 0;
+}
+
+PyDoc_STRVAR(RegisterMap_read_doc,
+	"read(reg[, n]) -> bytes\n\n"
+	"Read n registers (1 by default) starting at reg.\n");
+
+static const char * const regmap_read_keywords[] = {"reg", "n", NULL};
+static SpiDevArgParser RegisterMap_read_parser = {"read", regmap_read_keywords, 1};
+
+static PyObject *
+RegisterMap_read_impl(RegisterMapObject *self, SPIDEV_ARGS)
+{
+	PyObject *args_out[2], *result;
+	Py_ssize_t n = 1;
+	RegisterAccess acc = {0};
+
+	if (spidev_parse_args(&RegisterMap_read_parser, SPIDEV_ARGS_FWD, args_out) < 0 ||
+	    regmap_arg_reg(args_out[0], &acc.reg) < 0 ||
+	    spidev_arg_ssize(args_out[1], &n) < 0)
+		return NULL;
+
+	if (n < 1) {
+		PyErr_SetString(PyExc_ValueError, "register count must be positive");
+		return NULL;
+	}
+
+	if ((result = PyBytes_FromStringAndSize(NULL, n)) == NULL)
+		return NULL;
+	acc.len = n;
+	acc.out = (uint8_t *)PyBytes_AS_STRING(result);
+
+	if (regmap_run(self, &acc, 1) < 0)
+		Py_CLEAR(result);
+	return result;
+}
+
+PyDoc_STRVAR(RegisterMap_write_doc,
+	"write(reg, data) -> None\n\n"
+	"Write data (an int, a buffer or a list of values) to the registers\n"
+	"starting at reg.\n");
+
+static const char * const regmap_write_keywords[] = {"reg", "data", NULL};
+static SpiDevArgParser RegisterMap_write_parser = {"write", regmap_write_keywords, 2};
+
+static PyObject *
+RegisterMap_write_impl(RegisterMapObject *self, SPIDEV_ARGS)
+{
+	PyObject *args_out[2], *data;
+	RegisterAccess acc = {0};
+	Py_buffer view;
+	unsigned long value;
+	uint8_t byte;
+	int status;
+
+	if (spidev_parse_args(&RegisterMap_write_parser, SPIDEV_ARGS_FWD, args_out) < 0 ||
+	    regmap_arg_reg(args_out[0], &acc.reg) < 0)
+		return NULL;
+
+	data = args_out[1];
+	if (PyInt_Check(data) || PyLong_Check(data)) {
+		if (spidev_item_value(data, &value) < 0)
+			return NULL;
+		byte = value;
+		acc.data = &byte;
+		acc.len = 1;
+		status = regmap_run(self, &acc, 1);
+	} else {
+		// Lists are packed into bytes first
+		if (PyObject_CheckBuffer(data))
+			Py_INCREF(data);
+		else if ((data = spidev_seq_to_bytes(data, 1)) == NULL)
+			return NULL;
+		if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) == -1) {
+			Py_DECREF(data);
+			return NULL;
+		}
+		if (view.len <= 0) {
+			PyBuffer_Release(&view);
+			Py_DECREF(data);
+			PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+			return NULL;
+		}
+		acc.data = view.buf;
+		acc.len = view.len;
+		status = regmap_run(self, &acc, 1);
+		PyBuffer_Release(&view);
+		Py_DECREF(data);
+	}
+
+	if (status < 0)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+PyDoc_STRVAR(RegisterMap_update_bits_doc,
+	"update_bits(reg, mask, val) -> int\n\n"
+	"Read register reg, replace the bits set in mask with those of val and\n"
+	"write it back if it changed. Return the previous value.\n");
+
+static const char * const regmap_update_keywords[] = {"reg", "mask", "val", NULL};
+static SpiDevArgParser RegisterMap_update_bits_parser = {"update_bits", regmap_update_keywords, 3};
+
+static PyObject *
+RegisterMap_update_bits_impl(RegisterMapObject *self, SPIDEV_ARGS)
+{
+	PyObject *args_out[3];
+	RegisterAccess acc = {0};
+	unsigned long long mask = 0, val = 0;
+	uint8_t old, new;
+
+	if (spidev_parse_args(&RegisterMap_update_bits_parser, SPIDEV_ARGS_FWD, args_out) < 0 ||
+	    regmap_arg_reg(args_out[0], &acc.reg) < 0 ||
+	    spidev_arg_mask(args_out[1], &mask) < 0 ||
+	    spidev_arg_mask(args_out[2], &val) < 0)
+		return NULL;
+
+	acc.len = 1;
+	acc.out = &old;
+	if (regmap_run(self, &acc, 1) < 0)
+		return NULL;
+
+	new = (old & ~mask) | (val & mask);
+	if (new != old) {
+		acc.out = NULL;
+		acc.data = &new;
+		if (regmap_run(self, &acc, 1) < 0)
+			return NULL;
+	}
+
+	return PyInt_FromLong(old);
+}
+
+PyDoc_STRVAR(RegisterMap_read_many_doc,
+	"read_many(regs) -> bytes\n\n"
+	"Read each of regs, a register number or a (reg, n) tuple to read n\n"
+	"registers, and return the data read, one access after the other.\n"
+	"The accesses are coalesced into as few ioctls as possible.\n");
+
+static const char * const regmap_read_many_keywords[] = {"regs", NULL};
+static SpiDevArgParser RegisterMap_read_many_parser = {"read_many", regmap_read_many_keywords, 1};
+
+static PyObject *
+RegisterMap_read_many_impl(RegisterMapObject *self, SPIDEV_ARGS)
+{
+	PyObject *obj, *seq, *item, *result = NULL;
+	RegisterAccess *acc;
+	Py_ssize_t ii, count, n, total = 0;
+	uint8_t *out;
+
+	if (spidev_parse_args(&RegisterMap_read_many_parser, SPIDEV_ARGS_FWD, &obj) < 0)
+		return NULL;
+
+	if ((seq = PySequence_Fast(obj, "expected a sequence")) == NULL)
+		return NULL;
+	count = PySequence_Fast_GET_SIZE(seq);
+
+	acc = PyMem_Malloc((count ? count : 1) * sizeof(*acc));
+	if (!acc) {
+		Py_DECREF(seq);
+		return PyErr_NoMemory();
+	}
+
+	for (ii = 0; ii < count; ii++) {
+		item = PySequence_Fast_GET_ITEM(seq, ii);
+		n = 1;
+		if (PyTuple_Check(item)) {
+			if (!PyArg_ParseTuple(item, "kn:read_many", &acc[ii].reg, &n))
+				goto out;
+		} else if (regmap_arg_reg(item, &acc[ii].reg) < 0) {
+			goto out;
+		}
+		if (n < 1 || n > PY_SSIZE_T_MAX - total) {
+			PyErr_SetString(PyExc_ValueError, "register count must be positive");
+			goto out;
+		}
+		acc[ii].len = n;
+		acc[ii].data = NULL;
+		total += n;
+	}
+
+	if ((result = PyBytes_FromStringAndSize(NULL, total)) == NULL)
+		goto out;
+	out = (uint8_t *)PyBytes_AS_STRING(result);
+	for (ii = 0; ii < count; ii++) {
+		acc[ii].out = out;
+		out += acc[ii].len;
+	}
+
+	if (count && regmap_run(self, acc, count) < 0)
+		Py_CLEAR(result);
+
+out:
+	PyMem_Free(acc);
+	Py_DECREF(seq);
+	return result;
+}
+
+// Register accesses lock the SpiDev they run on
+#define REGMAP_LOCKED_FASTCALL(name) \
+	SPIDEV_LOCKED_ON(self->spi, PyObject *, name, (RegisterMapObject *self, SPIDEV_ARGS), (self, SPIDEV_ARGS_FWD))
+
+REGMAP_LOCKED_FASTCALL(RegisterMap_read)
+REGMAP_LOCKED_FASTCALL(RegisterMap_write)
+REGMAP_LOCKED_FASTCALL(RegisterMap_update_bits)
+REGMAP_LOCKED_FASTCALL(RegisterMap_read_many)
+
+static PyMethodDef RegisterMap_methods[] = {
+	{"read", (PyCFunction)RegisterMap_read, SPIDEV_METH_ARGS,
+		RegisterMap_read_doc},
+	{"write", (PyCFunction)RegisterMap_write, SPIDEV_METH_ARGS,
+		RegisterMap_write_doc},
+	{"update_bits", (PyCFunction)RegisterMap_update_bits, SPIDEV_METH_ARGS,
+		RegisterMap_update_bits_doc},
+	{"read_many", (PyCFunction)RegisterMap_read_many, SPIDEV_METH_ARGS,
+		RegisterMap_read_many_doc},
+	{NULL},
+};
+
+static PyMemberDef RegisterMap_members[] = {
+	{"spi", T_OBJECT, offsetof(RegisterMapObject, spi), READONLY,
+		"SpiDev the registers are accessed through"},
+	{"address_bytes", T_INT, offsetof(RegisterMapObject, address_bytes), READONLY, NULL},
+	{"read_mask", T_ULONG, offsetof(RegisterMapObject, read_mask), READONLY, NULL},
+	{"write_mask", T_ULONG, offsetof(RegisterMapObject, write_mask), READONLY, NULL},
+	{"increment_mask", T_ULONG, offsetof(RegisterMapObject, increment_mask), READONLY, NULL},
+	{"auto_increment", T_INT, offsetof(RegisterMapObject, auto_increment), READONLY, NULL},
+	{"dummy_bytes", T_INT, offsetof(RegisterMapObject, dummy_bytes), READONLY, NULL},
+	{NULL},
+};
+
+PyDoc_STRVAR(RegisterMapObjectType_doc,
+	"RegisterMap(spi[, address_bytes, read_mask, write_mask, increment_mask,\n"
+	"            auto_increment, dummy_bytes]) -> map\n\n"
+	"Register access on an open SpiDev. Registers are addressed with\n"
+	"address_bytes (1) bytes, most significant first. read_mask (0x80) is\n"
+	"or'ed into the address of reads, write_mask (0) into that of writes\n"
+	"and increment_mask (0) into that of accesses to several registers.\n"
+	"Devices that don't auto_increment (True) get one transfer per register.\n"
+	"Reads clock dummy_bytes (0) bytes between address and data.\n");
+
+static PyTypeObject RegisterMapObjectType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	"RegisterMap",			/* tp_name */
+	sizeof(RegisterMapObject),	/* tp_basicsize */
+	0,				/* tp_itemsize */
+	(destructor)RegisterMap_dealloc,	/* tp_dealloc */
+	0,				/* tp_print */
+	0,				/* tp_getattr */
+	0,				/* tp_setattr */
+	0,				/* tp_compare */
+	0,				/* tp_repr */
+	0,				/* tp_as_number */
+	0,				/* tp_as_sequence */
+	0,				/* tp_as_mapping */
+	0,				/* tp_hash */
+	0,				/* tp_call */
+	0,				/* tp_str */
+	0,				/* tp_getattro */
+	0,				/* tp_setattro */
+	0,				/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,		/* tp_flags */
+	RegisterMapObjectType_doc,	/* tp_doc */
+	0,				/* tp_traverse */
+	0,				/* tp_clear */
+	0,				/* tp_richcompare */
+	0,				/* tp_weaklistoffset */
+	0,				/* tp_iter */
+	0,				/* tp_iternext */
+	RegisterMap_methods,		/* tp_methods */
+	RegisterMap_members,		/* tp_members */
+	0,				/* tp_getset */
+	0,				/* tp_base */
+	0,				/* tp_dict */
+	0,				/* tp_descr_get */
+	0,				/* tp_descr_set */
+	0,				/* tp_dictoffset */
+	0,				/* tp_init */
+	0,				/* tp_alloc */
+	RegisterMap_new,		/* tp_new */
+};
+
+// Serial NOR flash.
+// A SpiFlash drives a flash chip on a SpiDev: the geometry is discovered
+// from the JEDEC ID and the SFDP basic parameter table (JESD216), then
+// reads, page programs and erases run as whole loops without the GIL,
+// polling the WIP bit of the status register natively.
+
+#define SPIFLASH_CMD_WREN	0x06
+#define SPIFLASH_CMD_RDSR	0x05
+#define SPIFLASH_CMD_RDID	0x9f
+#define SPIFLASH_CMD_RDSFDP	0x5a
+#define SPIFLASH_SR_WIP		0x01
+#define SPIFLASH_SFDP_SIGNATURE	0x50444653	/* "SFDP" */
+#define SPIFLASH_MAX_ERASE_TYPES 4
+
+// Longest waits for WIP to clear, and the sleep between polls of erases
+#define SPIFLASH_PROGRAM_TIMEOUT_NS	(50 * 1000000ULL)
+#define SPIFLASH_ERASE_TIMEOUT_NS	(20 * 1000000000ULL)
+#define SPIFLASH_ERASE_POLL_NS		1000000
+
+typedef struct {
+	uint32_t size;
+	uint8_t opcode;
+} SpiFlashErase;
+
+typedef struct {
+	PyObject_HEAD
+	SpiDevObject *spi;
+	uint8_t jedec_id[3];
+	unsigned long long size;	/* bytes */
+	uint32_t page_size;
+	int address_bytes;	/* 3, or 4 above 16 MiB */
+	int sfdp;		/* geometry read from SFDP */
+	uint8_t read_cmd;	/* fast read, 1 dummy byte */
+	uint8_t program_cmd;
+	SpiFlashErase erase[SPIFLASH_MAX_ERASE_TYPES];	/* largest first */
+	int nerase;
+} SpiFlashObject;
+
+// Single transfer of len bytes, rx may be NULL. Without the GIL.
+static int
+spiflash_xfer(SpiDevObject *dev, const uint8_t *tx, uint8_t *rx, size_t len)
+{
+	struct spi_ioc_transfer xfer;
+
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.tx_buf = (unsigned long)tx;
+	xfer.rx_buf = (unsigned long)rx;
+	xfer.len = len;
+	xfer.speed_hz = dev->max_speed_hz;
+	xfer.bits_per_word = 8;
+	if (spidev_ioctl(dev, SPI_IOC_MESSAGE(1), &xfer) < 0)
+		return -errno;
+	return 0;
+}
+
+// Wait for the end of a program or erase: poll the status register until
+// WIP clears, sleeping interval_ns between polls. Without the GIL.
+static int
+spiflash_wait(SpiDevObject *dev, uint64_t timeout_ns, long interval_ns)
+{
+	uint8_t tx[2] = {SPIFLASH_CMD_RDSR, 0}, rx[2];
+	struct timespec ts = {0, interval_ns};
+	uint64_t deadline = spidev_now_ns() + timeout_ns;
+	int status;
+
+	for (;;) {
+		if ((status = spiflash_xfer(dev, tx, rx, 2)) < 0)
+			return status;
+		if (!(rx[1] & SPIFLASH_SR_WIP))
+			return 0;
+		if (spidev_now_ns() >= deadline)
+			return -ETIMEDOUT;
+		if (interval_ns)
+			clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+	}
+}
+
+// Write enable, then the command in hdr (opcode and address) followed by
+// len bytes of data, CS going inactive in between. Without the GIL.
+static int
+spiflash_write_cmd(SpiDevObject *dev, const uint8_t *hdr, size_t hdr_len,
+		const uint8_t *data, size_t len)
+{
+	static const uint8_t wren = SPIFLASH_CMD_WREN;
+	struct spi_ioc_transfer xfer[3];
+	unsigned int ii;
+
+	memset(xfer, 0, sizeof(xfer));
+	xfer[0].tx_buf = (unsigned long)&wren;
+	xfer[0].len = 1;
+	xfer[0].cs_change = 1;
+	xfer[1].tx_buf = (unsigned long)hdr;
+	xfer[1].len = hdr_len;
+	xfer[2].tx_buf = (unsigned long)data;
+	xfer[2].len = len;
+	for (ii = 0; ii < 3; ii++) {
+		xfer[ii].speed_hz = dev->max_speed_hz;
+		xfer[ii].bits_per_word = 8;
+	}
+	if (spidev_ioctl(dev, SPI_IOC_MESSAGE(len ? 3 : 2), xfer) < 0)
+		return -errno;
+	return 0;
+}
+
+static void
+spiflash_address(uint8_t *hdr, int address_bytes, unsigned long long address)
+{
+	int ii;
+
+	for (ii = 0; ii < address_bytes; ii++)
+		hdr[1 + ii] = (uint8_t)(address >> (8 * (address_bytes - 1 - ii)));
+}
+
+// Read len bytes of SFDP data from address. Without the GIL.
+static int
+spiflash_read_sfdp(SpiDevObject *dev, uint32_t address, uint8_t *buf, size_t len)
+{
+	struct spi_ioc_transfer xfer[2];
+	uint8_t hdr[5] = {SPIFLASH_CMD_RDSFDP};
+
+	memset(xfer, 0, sizeof(xfer));
+	xfer[0].len = sizeof(hdr);
+	xfer[1].rx_buf = (unsigned long)buf;
+	xfer[0].speed_hz = xfer[1].speed_hz = dev->max_speed_hz;
+	xfer[0].bits_per_word = xfer[1].bits_per_word = 8;
+	return spidev_flash_read_blocks(dev, xfer, hdr, 3, address, buf, len, len);
+}
+
+static uint32_t
+spiflash_dword(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Geometry from the basic flash parameter table. Returns 1 if found, 0 if
+// the chip has no SFDP, or a negative errno.
+static int
+spiflash_parse_sfdp(SpiFlashObject *self)
+{
+	SpiDevObject *dev = self->spi;
+	uint8_t hdr[16], bfpt[64];
+	uint32_t dw, ptr, len, density;
+	int status, ii;
+
+	if ((status = spiflash_read_sfdp(dev, 0, hdr, sizeof(hdr))) < 0)
+		return status;
+	// The first parameter header is the basic table (ID 0x00, 0xff)
+	if (spiflash_dword(hdr) != SPIFLASH_SFDP_SIGNATURE || hdr[8] != 0x00 || hdr[15] != 0xff)
+		return 0;
+
+	len = hdr[11] * 4;
+	ptr = hdr[12] | (hdr[13] << 8) | (hdr[14] << 16);
+	if (len < 9 * 4)
+		return 0;
+	if (len > sizeof(bfpt))
+		len = sizeof(bfpt);
+	memset(bfpt, 0, sizeof(bfpt));
+	if ((status = spiflash_read_sfdp(dev, ptr, bfpt, len)) < 0)
+		return status;
+
+	// DWORD 2: density in bits, or 2^N bits with bit 31 set
+	density = spiflash_dword(bfpt + 4);
+	if (density & 0x80000000) {
+		density &= 0x7fffffff;
+		self->size = (density >= 3 && density < 67) ? 1ULL << (density - 3) : 0;
+	} else
+		self->size = ((unsigned long long)density + 1) / 8;
+
+	// DWORDs 8 and 9: erase types as size exponent and opcode
+	self->nerase = 0;
+	for (ii = 0; ii < SPIFLASH_MAX_ERASE_TYPES; ii++) {
+		dw = spiflash_dword(bfpt + 28 + 4 * (ii / 2)) >> (16 * (ii % 2));
+		if ((dw & 0xff) && (dw & 0xff) < 32) {
+			self->erase[self->nerase].size = 1U << (dw & 0xff);
+			self->erase[self->nerase].opcode = dw >> 8;
+			self->nerase++;
+		}
+	}
+
+	// DWORD 11 (JESD216A): page size as 2^N
+	if (len >= 11 * 4)
+		self->page_size = 1U << ((spiflash_dword(bfpt + 40) >> 4) & 0xf);
+
+	return 1;
+}
+
+// Opcode of the 4 byte address variant of a 3 byte address command
+static uint8_t
+spiflash_4byte_opcode(uint8_t opcode)
+{
+	switch (opcode) {
+	case 0x20:
+		return 0x21;
+	case 0x52:
+		return 0x5c;
+	case 0xd8:
+		return 0xdc;
+	default:
+		return opcode;
+	}
+}
+
+// Read the JEDEC ID and the geometry of the chip, size and page_size
+// override what is found when nonzero. Raises an exception on failure.
+static int
+spiflash_probe(SpiFlashObject *self, unsigned long long size, uint32_t page_size)
+{
+	SpiDevObject *dev = self->spi;
+	uint8_t tx[4] = {SPIFLASH_CMD_RDID}, rx[4];
+	SpiFlashErase tmp;
+	int status, ii, jj;
+
+	SPIDEV_BEGIN_ALLOW_THREADS(dev)
+	status = spiflash_xfer(dev, tx, rx, sizeof(tx));
+	if (status == 0)
+		status = spiflash_parse_sfdp(self);
+	SPIDEV_END_ALLOW_THREADS(dev)
+
+	if (status < 0) {
+		spidev_set_errno(status);
+		return -1;
+	}
+	memcpy(self->jedec_id, rx + 1, 3);
+	if ((rx[1] == 0x00 && rx[2] == 0x00) || (rx[1] == 0xff && rx[2] == 0xff)) {
+		errno = ENODEV;
+		PyErr_SetFromErrno(PyExc_IOError);
+		return -1;
+	}
+	self->sfdp = status;
+
+	// Without SFDP, the last ID byte of most parts is log2 of the size
+	if (!self->sfdp) {
+		if (rx[3] >= 16 && rx[3] < 40)
+			self->size = 1ULL << rx[3];
+		self->erase[0] = (SpiFlashErase){64 * 1024, 0xd8};
+		self->erase[1] = (SpiFlashErase){4096, 0x20};
+		self->nerase = 2;
+	}
+	if (size)
+		self->size = size;
+	if (page_size)
+		self->page_size = page_size;
+	if (!self->page_size)
+		self->page_size = 256;
+	if (!self->size) {
+		PyErr_SetString(PyExc_ValueError, "flash size unknown, give it as size");
+		return -1;
+	}
+	if (self->page_size & (self->page_size - 1)) {
+		PyErr_SetString(PyExc_ValueError, "page_size must be a power of two");
+		return -1;
+	}
+
+	for (ii = 1; ii < self->nerase; ii++) {
+		for (jj = ii; jj > 0 && self->erase[jj].size > self->erase[jj - 1].size; jj--) {
+			tmp = self->erase[jj];
+			self->erase[jj] = self->erase[jj - 1];
+			self->erase[jj - 1] = tmp;
+		}
+	}
+
+	// Larger parts are used with the 4 byte address instruction set
+	self->address_bytes = self->size > (1 << 24) ? 4 : 3;
+	self->read_cmd = self->address_bytes == 4 ? 0x0c : 0x0b;
+	self->program_cmd = self->address_bytes == 4 ? 0x12 : 0x02;
+	if (self->address_bytes == 4)
+		for (ii = 0; ii < self->nerase; ii++)
+			self->erase[ii].opcode = spiflash_4byte_opcode(self->erase[ii].opcode);
+
+	return 0;
+}
+
+static PyObject *
+SpiFlash_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	SpiFlashObject *self;
+	SpiDevObject *spi;
+	unsigned long long size = 0;
+	unsigned int page_size = 0;
+	int status;
+	static char *kwlist[] = {"spi", "size", "page_size", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|KI:SpiFlash", kwlist,
+			&SpiDevObjectType, &spi, &size, &page_size))
+		return NULL;
+
+	if ((self = (SpiFlashObject *)type->tp_alloc(type, 0)) == NULL)
+		return NULL;
+
+	Py_INCREF(spi);
+	self->spi = spi;
+
+	Py_BEGIN_CRITICAL_SECTION((PyObject *)spi);
+	status = spiflash_probe(self, size, page_size);
+	Py_END_CRITICAL_SECTION();
+
+	if (status < 0) {
+		Py_DECREF(self);
+		return NULL;
 	}
-	return 0;
+	return (PyObject *)self;
 }
 
-static PyObject *
-SpiDev_get_max_speed_hz(SpiDevObject *self, void *closure)
+static void
+SpiFlash_dealloc(SpiFlashObject *self)
 {
-	PyObject *result = Py_BuildValue("i", self->max_speed_hz);
-	Py_INCREF(result);
-	return result;
+	Py_XDECREF(self->spi);
+	Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
+// Check that [address, address + length) lies in the chip
 static int
-SpiDev_set_max_speed_hz(SpiDevObject *self, PyObject *val, void *closure)
+spiflash_check_range(SpiFlashObject *self, unsigned long long address, unsigned long long length)
 {
-	uint32_t max_speed_hz;
-
-	if (val == NULL) {
-		PyErr_SetString(PyExc_TypeError,
-			"Cannot delete attribute");
+	if (address > self->size || length > self->size - address) {
+		PyErr_Format(PyExc_ValueError,
+			"range exceeds the flash size (%llu bytes)", self->size);
 		return -1;
 	}
-#if PY_MAJOR_VERSION < 3
-	if (PyInt_Check(val)) {
-		max_speed_hz = PyInt_AS_LONG(val);
-	} else
-#endif
-	{
-		if (PyLong_Check(val)) {
-			max_speed_hz = PyLong_AS_LONG(val);
-		} else {
-			PyErr_SetString(PyExc_TypeError,
-				"The max_speed_hz attribute must be an integer");
-			return -1;
-		}
-	}
-
-	if (self->max_speed_hz != max_speed_hz) {
-		if (ioctl(self->fd, SPI_IOC_WR_MAX_SPEED_HZ, &max_speed_hz) == -1) {
-			PyErr_SetFromErrno(PyExc_IOError);
-			return -1;
-		}
-		self->max_speed_hz = max_speed_hz;
-	}
 	return 0;
 }
 
-static PyObject *
-SpiDev_get_read0(SpiDevObject *self, void *closure)
+// Flash reads as the producer of a pipe
+typedef struct {
+	SpiDevObject *dev;
+	struct spi_ioc_transfer *tmpl;
+	uint8_t *hdr;
+	int address_bytes;
+	unsigned long long address;
+	size_t block;
+} SpiFlashReadEnd;
+
+static int
+spiflash_pipe_read(void *ctx, uint8_t *buf, size_t len, unsigned long long pos)
 {
-	PyObject *result = (self->read0 == 1) ? Py_True : Py_False;
-	Py_INCREF(result);
-	return result;
+	SpiFlashReadEnd *end = ctx;
+
+	return spidev_flash_read_blocks(end->dev, end->tmpl, end->hdr, end->address_bytes,
+		end->address + pos, buf, len, end->block);
 }
 
-static int
-SpiDev_set_read0(SpiDevObject *self, PyObject *val, void *closure)
+PyDoc_STRVAR(SpiFlash_read_doc,
+	"read(address, length[, into]) -> bytes\n\n"
+	"Read length bytes from address with fast read commands. The data is\n"
+	"returned, or stored into into: a writable buffer, or a file (a path,\n"
+	"an open file or a file descriptor) written at its current position,\n"
+	"and None returned. Writes to a file overlap with the flash reads.\n");
+
+static const char * const spiflash_read_keywords[] = {"address", "length", "into", NULL};
+static SpiDevArgParser SpiFlash_read_parser = {"read", spiflash_read_keywords, 2};
+
+static PyObject *
+SpiFlash_read_impl(SpiFlashObject *self, SPIDEV_ARGS)
 {
-	if (val == NULL) {
-		PyErr_SetString(PyExc_TypeError,
-			"Cannot delete attribute");
-		return -1;
+	SpiDevObject *dev = self->spi;
+	PyObject *args_out[3], *into, *result = NULL;
+	unsigned long long address = 0;
+	Py_ssize_t length = 0;
+	struct spi_ioc_transfer tmpl[2];
+	uint8_t hdr[6];
+	size_t block = SPIDEV_BLOCK_SIZE(dev);
+	SpiFlashReadEnd flash;
+	SpiDevFileEnd file = {-1, 0};
+	Py_buffer view = {0};
+	uint8_t *rx = NULL, *buf[2];
+	int opened = 0, status = 0;
+	uint64_t t0;
+
+	if (spidev_parse_args(&SpiFlash_read_parser, SPIDEV_ARGS_FWD, args_out) < 0 ||
+	    spidev_arg_mask(args_out[0], &address) < 0 ||
+	    spidev_arg_ssize(args_out[1], &length) < 0)
+		return NULL;
+
+	if (length < 0) {
+		PyErr_SetString(PyExc_ValueError, "length must not be negative");
+		return NULL;
 	}
-	else if (!PyBool_Check(val)) {
-		PyErr_SetString(PyExc_TypeError,
-			"The read0 attribute must be boolean");
-		return -1;
+	if (spiflash_check_range(self, address, length) < 0)
+		return NULL;
+
+	memset(tmpl, 0, sizeof(tmpl));
+	hdr[0] = self->read_cmd;
+	tmpl[0].len = 1 + self->address_bytes + 1;
+	tmpl[0].speed_hz = tmpl[1].speed_hz = dev->max_speed_hz;
+	tmpl[0].bits_per_word = tmpl[1].bits_per_word = 8;
+	memset(hdr + 1, 0, sizeof(hdr) - 1);
+	if (block > XFER3_MAX_BLOCK_SIZE)
+		block = XFER3_MAX_BLOCK_SIZE;
+
+	into = args_out[2];
+	if (!into || into == Py_None) {
+		if ((result = PyBytes_FromStringAndSize(NULL, length)) == NULL)
+			return NULL;
+		rx = (uint8_t *)PyBytes_AS_STRING(result);
+	} else if (PyObject_CheckBuffer(into) && !spidev_is_path(into)) {
+		if (PyObject_GetBuffer(into, &view, PyBUF_WRITABLE) == -1)
+			return NULL;
+		if (view.len < length) {
+			PyBuffer_Release(&view);
+			PyErr_SetString(PyExc_ValueError, "into is smaller than length");
+			return NULL;
+		}
+		rx = view.buf;
+	} else {
+		file.fd = spidev_file_open(into, O_WRONLY | O_CREAT | O_TRUNC, &opened);
+		if (file.fd < 0)
+			return NULL;
+		if (spidev_pipe_buffers(dev, buf, block, length) < 0) {
+			spidev_file_close(into, file.fd, opened);
+			return NULL;
+		}
 	}
 
-	self->read0 = (val == Py_True) ? 1 : 0;
+	t0 = spidev_now_ns();
 
-	return 0;
+	SPIDEV_BEGIN_ALLOW_THREADS(dev)
+	if (file.fd < 0) {
+		status = spidev_flash_read_blocks(dev, tmpl, hdr, self->address_bytes,
+			address, rx, length, block);
+	} else {
+		flash.dev = dev;
+		flash.tmpl = tmpl;
+		flash.hdr = hdr;
+		flash.address_bytes = self->address_bytes;
+		flash.address = address;
+		flash.block = block;
+		posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		status = spidev_pipe_run(buf, block, length,
+			spiflash_pipe_read, &flash, spidev_pipe_file_write, &file);
+	}
+	SPIDEV_END_ALLOW_THREADS(dev)
+
+	spidev_stats_call(dev, t0);
+	if (view.obj)
+		PyBuffer_Release(&view);
+	if (file.fd >= 0) {
+		spidev_pipe_buffers_put(dev, buf);
+		if (spidev_file_close(into, file.fd, opened) < 0 && status == 0)
+			return NULL;
+	}
+
+	if (status < 0) {
+		Py_XDECREF(result);
+		spidev_set_errno(status);
+		return NULL;
+	}
+	if (!result) {
+		Py_INCREF(Py_None);
+		result = Py_None;
+	}
+	return result;
 }
 
-static PyGetSetDef SpiDev_getset[] = {
-	{"mode", (getter)SpiDev_get_mode, (setter)SpiDev_set_mode,
-			"SPI mode as two bit pattern of \n"
-			"Clock Polarity  and Phase [CPOL|CPHA]\n"
-			"min: 0b00 = 0 max: 0b11 = 3\n"},
-	{"cshigh", (getter)SpiDev_get_cshigh, (setter)SpiDev_set_cshigh,
-			"CS active high\n"},
-	{"threewire", (getter)SpiDev_get_3wire, (setter)SpiDev_set_3wire,
-			"SI/SO signals shared\n"},
-	{"lsbfirst", (getter)SpiDev_get_lsbfirst, (setter)SpiDev_set_lsbfirst,
-			"LSB first\n"},
-	{"loop", (getter)SpiDev_get_loop, (setter)SpiDev_set_loop,
-			"loopback configuration\n"},
-	{"no_cs", (getter)SpiDev_get_no_cs, (setter)SpiDev_set_no_cs,
-			"disable chip select\n"},
-	{"bits_per_word", (getter)SpiDev_get_bits_per_word, (setter)SpiDev_set_bits_per_word,
-			"bits per word\n"},
-	{"max_speed_hz", (getter)SpiDev_get_max_speed_hz, (setter)SpiDev_set_max_speed_hz,
-			"maximum speed in Hz\n"},
-	{"read0", (getter)SpiDev_get_read0, (setter)SpiDev_set_read0,
-			"Read 0 bytes after transfer to lower CS if cshigh == True\n"},
-	{NULL},
-};
+PyDoc_STRVAR(SpiFlash_program_doc,
+	"program(address, data) -> None\n\n"
+	"Program data (a buffer or list of values) from address, page by page,\n"
+	"waiting for each page to complete. The area must have been erased.\n");
 
-PyDoc_STRVAR(SpiDev_open_doc,
-	"open(bus, device)\n\n"
-	"Connects the object to the specified SPI device.\n"
-	"open(X,Y) will open /dev/spidev<X>.<Y>\n");
+static const char * const spiflash_program_keywords[] = {"address", "data", NULL};
+static SpiDevArgParser SpiFlash_program_parser = {"program", spiflash_program_keywords, 2};
 
 static PyObject *
-SpiDev_open(SpiDevObject *self, PyObject *args, PyObject *kwds)
+SpiFlash_program_impl(SpiFlashObject *self, SPIDEV_ARGS)
 {
-	int bus, device;
-	char path[SPIDEV_MAXPATH];
-	uint8_t tmp8;
-	uint32_t tmp32;
-	static char *kwlist[] = {"bus", "device", NULL};
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii:open", kwlist, &bus, &device))
+	SpiDevObject *dev = self->spi;
+	PyObject *args_out[2];
+	unsigned long long address = 0;
+	SpiDevTxData tx;
+	uint8_t hdr[5], *data, *alloc;
+	size_t len, chunk;
+	int status = 0;
+	uint64_t t0;
+
+	if (spidev_parse_args(&SpiFlash_program_parser, SPIDEV_ARGS_FWD, args_out) < 0 ||
+	    spidev_arg_mask(args_out[0], &address) < 0)
 		return NULL;
-	if (snprintf(path, SPIDEV_MAXPATH, "/dev/spidev%d.%d", bus, device) >= SPIDEV_MAXPATH) {
-		PyErr_SetString(PyExc_OverflowError,
-			"Bus and/or device number is invalid.");
+
+	if (spidev_tx_open(args_out[1], &tx, 1) < 0)
 		return NULL;
-	}
-	if ((self->fd = open(path, O_RDWR, 0)) == -1) {
-		PyErr_SetFromErrno(PyExc_IOError);
+	if (spiflash_check_range(self, address, tx.len) < 0 ||
+	    (data = spidev_tx_buffer(dev, &tx, &alloc)) == NULL) {
+		spidev_tx_close(&tx);
 		return NULL;
 	}
-	if (ioctl(self->fd, SPI_IOC_RD_MODE, &tmp8) == -1) {
-		PyErr_SetFromErrno(PyExc_IOError);
+	if (1 + 1 + self->address_bytes + self->page_size > SPIDEV_BLOCK_SIZE(dev)) {
+		if (alloc)
+			spidev_scratch_put(dev, SPIDEV_SCRATCH_TX, alloc);
+		spidev_tx_close(&tx);
+		PyErr_Format(PyExc_OverflowError,
+			"Page program exceeds block_size (%u bytes).", SPIDEV_BLOCK_SIZE(dev));
 		return NULL;
 	}
-	self->mode = tmp8;
-	if (ioctl(self->fd, SPI_IOC_RD_BITS_PER_WORD, &tmp8) == -1) {
-		PyErr_SetFromErrno(PyExc_IOError);
-		return NULL;
+
+	hdr[0] = self->program_cmd;
+	len = tx.len;
+	t0 = spidev_now_ns();
+
+	SPIDEV_BEGIN_ALLOW_THREADS(dev)
+	while (len > 0 && status == 0) {
+		// Programs wrap around at the end of a page
+		chunk = self->page_size - (address & (self->page_size - 1));
+		if (chunk > len)
+			chunk = len;
+		spiflash_address(hdr, self->address_bytes, address);
+		status = spiflash_write_cmd(dev, hdr, 1 + self->address_bytes, data, chunk);
+		if (status == 0)
+			status = spiflash_wait(dev, SPIFLASH_PROGRAM_TIMEOUT_NS, 0);
+		address += chunk;
+		data += chunk;
+		len -= chunk;
 	}
-	self->bits_per_word = tmp8;
-	if (ioctl(self->fd, SPI_IOC_RD_MAX_SPEED_HZ, &tmp32) == -1) {
-		PyErr_SetFromErrno(PyExc_IOError);
+	SPIDEV_END_ALLOW_THREADS(dev)
+
+	spidev_stats_call(dev, t0);
+	if (alloc)
+		spidev_scratch_put(dev, SPIDEV_SCRATCH_TX, alloc);
+	spidev_tx_close(&tx);
+
+	if (status < 0) {
+		spidev_set_errno(status);
 		return NULL;
 	}
-	self->max_speed_hz = tmp32;
 
 	Py_INCREF(Py_None);
 	return Py_None;
 }
 
-static int
-SpiDev_init(SpiDevObject *self, PyObject *args, PyObject *kwds)
+PyDoc_STRVAR(SpiFlash_erase_doc,
+	"erase(address, length) -> None\n\n"
+	"Erase length bytes from address, both multiples of the smallest erase\n"
+	"size, using the largest erase type that fits at every step.\n");
+
+static const char * const spiflash_erase_keywords[] = {"address", "length", NULL};
+static SpiDevArgParser SpiFlash_erase_parser = {"erase", spiflash_erase_keywords, 2};
+
+static PyObject *
+SpiFlash_erase_impl(SpiFlashObject *self, SPIDEV_ARGS)
 {
-	int bus = -1;
-	int client = -1;
-	static char *kwlist[] = {"bus", "client", NULL};
+	SpiDevObject *dev = self->spi;
+	PyObject *args_out[2];
+	unsigned long long address = 0, length = 0;
+	uint32_t unit;
+	uint8_t hdr[5];
+	int status = 0, ii;
+	uint64_t t0;
+
+	if (spidev_parse_args(&SpiFlash_erase_parser, SPIDEV_ARGS_FWD, args_out) < 0 ||
+	    spidev_arg_mask(args_out[0], &address) < 0 ||
+	    spidev_arg_mask(args_out[1], &length) < 0)
+		return NULL;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ii:__init__",
-			kwlist, &bus, &client))
-		return -1;
+	if (spiflash_check_range(self, address, length) < 0)
+		return NULL;
+	if (!self->nerase) {
+		PyErr_SetString(PyExc_ValueError, "flash has no erase commands");
+		return NULL;
+	}
+	unit = self->erase[self->nerase - 1].size;
+	if (address % unit || length % unit) {
+		PyErr_Format(PyExc_ValueError,
+			"address and length must be multiples of %u bytes", unit);
+		return NULL;
+	}
 
-	if (bus >= 0) {
-		SpiDev_open(self, args, kwds);
-		if (PyErr_Occurred())
-			return -1;
+	t0 = spidev_now_ns();
+
+	SPIDEV_BEGIN_ALLOW_THREADS(dev)
+	while (length > 0 && status == 0) {
+		for (ii = 0; ii < self->nerase - 1; ii++)
+			if (address % self->erase[ii].size == 0 && length >= self->erase[ii].size)
+				break;
+		hdr[0] = self->erase[ii].opcode;
+		spiflash_address(hdr, self->address_bytes, address);
+		status = spiflash_write_cmd(dev, hdr, 1 + self->address_bytes, NULL, 0);
+		if (status == 0)
+			status = spiflash_wait(dev, SPIFLASH_ERASE_TIMEOUT_NS, SPIFLASH_ERASE_POLL_NS);
+		address += self->erase[ii].size;
+		length -= self->erase[ii].size;
 	}
+	SPIDEV_END_ALLOW_THREADS(dev)
 
-	return 0;
+	spidev_stats_call(dev, t0);
+	if (status < 0) {
+		spidev_set_errno(status);
+		return NULL;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
 }
 
+// Flash accesses lock the SpiDev they run on
+#define SPIFLASH_LOCKED_FASTCALL(name) \
+	SPIDEV_LOCKED_ON(self->spi, PyObject *, name, (SpiFlashObject *self, SPIDEV_ARGS), (self, SPIDEV_ARGS_FWD))
 
-PyDoc_STRVAR(SpiDevObjectType_doc,
-	"SpiDev([bus],[client]) -> SPI\n\n"
-	"Return a new SPI object that is (optionally) connected to the\n"
-	"specified SPI device interface.\n");
+SPIFLASH_LOCKED_FASTCALL(SpiFlash_read)
+SPIFLASH_LOCKED_FASTCALL(SpiFlash_program)
+SPIFLASH_LOCKED_FASTCALL(SpiFlash_erase)
 
-static
-PyObject *SpiDev_enter(PyObject *self, PyObject *args)
+static PyObject *
+SpiFlash_get_jedec_id(SpiFlashObject *self, void *closure)
 {
-    if (!PyArg_ParseTuple(args, ""))
-        return NULL;
-
-    Py_INCREF(self);
-    return self;
+	return PyBytes_FromStringAndSize((const char *)self->jedec_id, sizeof(self->jedec_id));
 }
 
-static
-PyObject *SpiDev_exit(SpiDevObject *self, PyObject *args)
+static PyObject *
+SpiFlash_get_erase_sizes(SpiFlashObject *self, void *closure)
 {
+	PyObject *result;
+	int ii;
 
-    PyObject *exc_type = 0;
-    PyObject *exc_value = 0;
-    PyObject *traceback = 0;
-    if (!PyArg_UnpackTuple(args, "__exit__", 3, 3, &exc_type, &exc_value,
-                           &traceback)) {
-        return 0;
-    }
+	if ((result = PyTuple_New(self->nerase)) == NULL)
+		return NULL;
+	for (ii = 0; ii < self->nerase; ii++) {
+		PyObject *size = PyLong_FromUnsignedLong(self->erase[ii].size);
 
-    SpiDev_close(self);
-    Py_RETURN_FALSE;
+		if (!size) {
+			Py_DECREF(result);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(result, ii, size);
+	}
+	return result;
 }
 
-static PyMethodDef SpiDev_methods[] = {
-	{"open", (PyCFunction)SpiDev_open, METH_VARARGS | METH_KEYWORDS,
-		SpiDev_open_doc},
-	{"close", (PyCFunction)SpiDev_close, METH_NOARGS,
-		SpiDev_close_doc},
-	{"fileno", (PyCFunction)SpiDev_fileno, METH_NOARGS,
-		SpiDev_fileno_doc},
-	{"readbytes", (PyCFunction)SpiDev_readbytes, METH_VARARGS,
-		SpiDev_read_doc},
-	{"writebytes", (PyCFunction)SpiDev_writebytes, METH_VARARGS,
-		SpiDev_write_doc},
-	{"writebytes2", (PyCFunction)SpiDev_writebytes2, METH_VARARGS,
-		SpiDev_writebytes2_doc},
-	{"xfer", (PyCFunction)SpiDev_xfer, METH_VARARGS,
-		SpiDev_xfer_doc},
-	{"xfer2", (PyCFunction)SpiDev_xfer2, METH_VARARGS,
-		SpiDev_xfer2_doc},
-	{"xfer3", (PyCFunction)SpiDev_xfer3, METH_VARARGS,
-		SpiDev_xfer3_doc},
-	{"__enter__", (PyCFunction)SpiDev_enter, METH_VARARGS,
-		NULL},
-	{"__exit__", (PyCFunction)SpiDev_exit, METH_VARARGS,
-		NULL},
+static PyGetSetDef SpiFlash_getset[] = {
+	{"jedec_id", (getter)SpiFlash_get_jedec_id, NULL,
+		"manufacturer and device ID bytes\n"},
+	{"erase_sizes", (getter)SpiFlash_get_erase_sizes, NULL,
+		"sizes of the erase commands, largest first\n"},
 	{NULL},
 };
 
-static PyTypeObject SpiDevObjectType = {
-#if PY_MAJOR_VERSION >= 3
+static PyMemberDef SpiFlash_members[] = {
+	{"spi", T_OBJECT, offsetof(SpiFlashObject, spi), READONLY,
+		"SpiDev the flash is accessed through"},
+	{"size", T_ULONGLONG, offsetof(SpiFlashObject, size), READONLY, NULL},
+	{"page_size", T_UINT, offsetof(SpiFlashObject, page_size), READONLY, NULL},
+	{"address_bytes", T_INT, offsetof(SpiFlashObject, address_bytes), READONLY, NULL},
+	{"sfdp", T_INT, offsetof(SpiFlashObject, sfdp), READONLY,
+		"1 if the geometry was read from SFDP"},
+	{NULL},
+};
+
+static PyMethodDef SpiFlash_methods[] = {
+	{"read", (PyCFunction)SpiFlash_read, SPIDEV_METH_ARGS,
+		SpiFlash_read_doc},
+	{"program", (PyCFunction)SpiFlash_program, SPIDEV_METH_ARGS,
+		SpiFlash_program_doc},
+	{"erase", (PyCFunction)SpiFlash_erase, SPIDEV_METH_ARGS,
+		SpiFlash_erase_doc},
+	{NULL},
+};
+
+PyDoc_STRVAR(SpiFlashObjectType_doc,
+	"SpiFlash(spi[, size, page_size]) -> flash\n\n"
+	"Serial NOR flash on an open SpiDev. The JEDEC ID and SFDP parameters\n"
+	"are read when it is created; size and page_size override them, and\n"
+	"are needed for chips without SFDP whose ID doesn't tell the size.\n"
+	"Chips above 16 MiB are accessed with 4 byte address commands.\n");
+
+static PyTypeObject SpiFlashObjectType = {
 	PyVarObject_HEAD_INIT(NULL, 0)
-#else
-	PyObject_HEAD_INIT(NULL)
-	0,				/* ob_size */
-#endif
-	"SpiDev",			/* tp_name */
-	sizeof(SpiDevObject),		/* tp_basicsize */
+	"SpiFlash",			/* tp_name */
+	sizeof(SpiFlashObject),		/* tp_basicsize */
 	0,				/* tp_itemsize */
-	(destructor)SpiDev_dealloc,	/* tp_dealloc */
+	(destructor)SpiFlash_dealloc,	/* tp_dealloc */
 	0,				/* tp_print */
 	0,				/* tp_getattr */
 	0,				/* tp_setattr */
@@ -1482,25 +7660,93 @@ static PyTypeObject SpiDevObjectType = {
 	0,				/* tp_getattro */
 	0,				/* tp_setattro */
 	0,				/* tp_as_buffer */
-	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
-	SpiDevObjectType_doc,		/* tp_doc */
+	Py_TPFLAGS_DEFAULT,		/* tp_flags */
+	SpiFlashObjectType_doc,		/* tp_doc */
 	0,				/* tp_traverse */
 	0,				/* tp_clear */
 	0,				/* tp_richcompare */
 	0,				/* tp_weaklistoffset */
 	0,				/* tp_iter */
 	0,				/* tp_iternext */
-	SpiDev_methods,			/* tp_methods */
-	0,				/* tp_members */
-	SpiDev_getset,			/* tp_getset */
+	SpiFlash_methods,		/* tp_methods */
+	SpiFlash_members,		/* tp_members */
+	SpiFlash_getset,		/* tp_getset */
 	0,				/* tp_base */
 	0,				/* tp_dict */
 	0,				/* tp_descr_get */
 	0,				/* tp_descr_set */
 	0,				/* tp_dictoffset */
-	(initproc)SpiDev_init,		/* tp_init */
+	0,				/* tp_init */
 	0,				/* tp_alloc */
-	SpiDev_new,			/* tp_new */
+	SpiFlash_new,			/* tp_new */
+};
+
+// C API, exported as the spidev._C_API capsule (see spidev_capi.h)
+
+static int
+spidev_capi_fileno(PyObject *spi)
+{
+	return ((SpiDevObject *)spi)->fd;
+}
+
+static size_t
+spidev_capi_block_size(PyObject *spi)
+{
+	return SPIDEV_BLOCK_SIZE((SpiDevObject *)spi);
+}
+
+static int
+spidev_capi_transfer(PyObject *spi, struct spi_ioc_transfer *xfers, unsigned int count)
+{
+	SpiDevObject *self = (SpiDevObject *)spi;
+
+	if (count == 0 || count > SPIDEV_MAX_SEGMENTS)
+		return -EINVAL;
+
+	spidev_stats_add(&self->stats.transfers, 1);
+	if (spidev_ioctl(self, SPI_IOC_MESSAGE(count), xfers) < 0)
+		return -errno;
+
+	spidev_read0(self);
+	return 0;
+}
+
+// The scratch buffers are only touched in a critical section on the object,
+// as the methods do
+static void *
+spidev_capi_scratch_get(PyObject *spi, int which, size_t len)
+{
+	void *buf;
+
+	if (which < 0 || which >= SPIDEV_SCRATCH_COUNT) {
+		PyErr_SetString(PyExc_ValueError, "invalid scratch buffer");
+		return NULL;
+	}
+	Py_BEGIN_CRITICAL_SECTION(spi);
+	buf = spidev_scratch_get((SpiDevObject *)spi, which, len);
+	Py_END_CRITICAL_SECTION();
+	return buf;
+}
+
+static void
+spidev_capi_scratch_put(PyObject *spi, int which, void *buf)
+{
+	if (which < 0 || which >= SPIDEV_SCRATCH_COUNT)
+		return;
+	Py_BEGIN_CRITICAL_SECTION(spi);
+	spidev_scratch_put((SpiDevObject *)spi, which, buf);
+	Py_END_CRITICAL_SECTION();
+}
+
+static const SpiDev_CAPI spidev_capi = {
+	.version = SPIDEV_CAPI_VERSION,
+	.size = sizeof(SpiDev_CAPI),
+	.SpiDev_Type = &SpiDevObjectType,
+	.fileno = spidev_capi_fileno,
+	.block_size = spidev_capi_block_size,
+	.transfer = spidev_capi_transfer,
+	.scratch_get = spidev_capi_scratch_get,
+	.scratch_put = spidev_capi_scratch_put,
 };
 
 static PyMethodDef SpiDev_module_methods[] = {
@@ -1534,7 +7780,10 @@ void initspidev(void)
 {
 	PyObject* m;
 
-	if (PyType_Ready(&SpiDevObjectType) < 0)
+	if (PyType_Ready(&SpiDevObjectType) < 0 ||
+	    PyType_Ready(&SpiMessageObjectType) < 0 ||
+	    PyType_Ready(&RegisterMapObjectType) < 0 ||
+	    PyType_Ready(&SpiFlashObjectType) < 0)
 #if PY_MAJOR_VERSION >= 3
 		return NULL;
 #else
@@ -1549,6 +7798,11 @@ void initspidev(void)
 	PyObject *version = PyString_FromString(_VERSION_);
 #endif
 
+#ifdef Py_GIL_DISABLED
+	// Calls on the same object are serialized by critical sections
+	PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED);
+#endif
+
 	PyObject *dict = PyModule_GetDict(m);
 	PyDict_SetItemString(dict, "__version__", version);
 	Py_DECREF(version);
@@ -1556,6 +7810,18 @@ void initspidev(void)
 	Py_INCREF(&SpiDevObjectType);
 	PyModule_AddObject(m, "SpiDev", (PyObject *)&SpiDevObjectType);
 
+	Py_INCREF(&SpiMessageObjectType);
+	PyModule_AddObject(m, "SpiMessage", (PyObject *)&SpiMessageObjectType);
+
+	Py_INCREF(&RegisterMapObjectType);
+	PyModule_AddObject(m, "RegisterMap", (PyObject *)&RegisterMapObjectType);
+
+	Py_INCREF(&SpiFlashObjectType);
+	PyModule_AddObject(m, "SpiFlash", (PyObject *)&SpiFlashObjectType);
+
+	PyModule_AddObject(m, "_C_API",
+		PyCapsule_New((void *)&spidev_capi, SPIDEV_CAPI_NAME, NULL));
+
 #if PY_MAJOR_VERSION >= 3
 	return m;
 #endif
@@ -0,0 +1,37 @@
+import os
+import tempfile
+import unittest
+
+import spidev
+
+
+class FileTransferTest(unittest.TestCase):
+    def setUp(self):
+        self.spi = spidev.SpiDev()
+        self.spi.open(0, 0, backend="loopback")
+        fd, self.path = tempfile.mkstemp()
+        os.write(fd, bytes(bytearray(range(64))))
+        os.close(fd)
+
+    def tearDown(self):
+        self.spi.close()
+        os.unlink(self.path)
+
+    def test_write_rest_of_file(self):
+        self.assertEqual(self.spi.write_from_file(self.path), 64)
+        self.assertEqual(self.spi.write_from_file(self.path, 16, None), 48)
+
+    def test_write_negative_nbytes(self):
+        self.assertRaises(ValueError, self.spi.write_from_file, self.path, 0, -5)
+        self.assertRaises(ValueError, self.spi.write_from_file, self.path, 0, -1)
+
+    def test_read_negative_nbytes(self):
+        self.assertRaises(ValueError, self.spi.read_to_file, self.path, -1)
+
+    def test_read_to_file(self):
+        self.assertEqual(self.spi.read_to_file(self.path, 32), 32)
+        self.assertEqual(os.path.getsize(self.path), 32)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,28 @@
+import unittest
+
+import spidev
+
+
+class FlashReadTest(unittest.TestCase):
+    def setUp(self):
+        self.spi = spidev.SpiDev()
+        self.spi.open(0, 0, backend="loopback")
+
+    def tearDown(self):
+        self.spi.close()
+
+    def test_read_at_end_of_range(self):
+        self.assertEqual(len(self.spi.flash_read(2**24 - 16, 16)), 16)
+
+    def test_read_past_end_of_range(self):
+        self.assertRaises(OverflowError, self.spi.flash_read, 2**24 - 15, 16)
+
+    def test_read_wrapping_address(self):
+        self.assertRaises(OverflowError, self.spi.flash_read, 2**64 - 1, 16)
+
+    def test_command_out_of_range(self):
+        self.assertRaises(ValueError, self.spi.flash_read, 0, 16, 0x16B)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,41 @@
+import threading
+import unittest
+
+import spidev
+
+
+class FrameWriterTest(unittest.TestCase):
+    def setUp(self):
+        self.spi = spidev.SpiDev()
+        self.spi.open(0, 0, backend="loopback")
+        self.spi.loopback(byte_ns=1000)
+
+    def tearDown(self):
+        self.spi.close()
+
+    def test_flush(self):
+        self.spi.submit_frame(bytes(bytearray(64)))
+        self.assertTrue(self.spi.flush())
+
+    def test_flush_timeouts(self):
+        self.spi.submit_frame(bytes(bytearray(64)))
+        self.assertRaises(ValueError, self.spi.flush, float('nan'))
+        self.assertTrue(self.spi.flush(float('inf')))
+        self.assertTrue(self.spi.flush(1e300))
+
+    def test_flush_while_closing(self):
+        for _ in range(20):
+            self.spi.open(0, 0, backend="loopback")
+            self.spi.loopback(byte_ns=1000)
+            for _ in range(4):
+                self.spi.submit_frame(bytes(bytearray(4096)))
+            results = []
+            waiter = threading.Thread(target=lambda: results.append(self.spi.flush()))
+            waiter.start()
+            self.spi.close()
+            waiter.join()
+            self.assertEqual(len(results), 1)
+
+
+if __name__ == '__main__':
+    unittest.main()
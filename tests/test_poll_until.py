@@ -0,0 +1,32 @@
+import unittest
+
+import spidev
+
+
+class PollUntilTest(unittest.TestCase):
+    def setUp(self):
+        self.spi = spidev.SpiDev()
+        self.spi.open(0, 0, backend="loopback")
+
+    def tearDown(self):
+        self.spi.close()
+
+    def test_ready(self):
+        ready, status, polls, elapsed = self.spi.poll_until([5, 1], 0xff, 1)
+        self.assertTrue(ready)
+        self.assertEqual(status, 1)
+        self.assertEqual(polls, 1)
+
+    def test_nan_timeout(self):
+        self.assertRaises(ValueError, self.spi.poll_until, [5, 0], 0xff, 1,
+                          float('nan'))
+
+    def test_huge_interval(self):
+        ready, status, polls, elapsed = self.spi.poll_until(
+            [5, 0], 0xff, 1, 0.05, 2**62)
+        self.assertFalse(ready)
+        self.assertLessEqual(polls, 2)
+
+
+if __name__ == '__main__':
+    unittest.main()
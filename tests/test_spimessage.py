@@ -0,0 +1,23 @@
+import sys
+import unittest
+
+import spidev
+
+
+class SpiMessageSetTxTest(unittest.TestCase):
+    def test_set_tx_in_range(self):
+        msg = spidev.SpiMessage([{'tx': bytes(bytearray(4))}])
+        msg.set_tx(0, b'\x01\x02', 2)
+
+    def test_set_tx_past_end(self):
+        msg = spidev.SpiMessage([{'tx': bytes(bytearray(4))}])
+        self.assertRaises(ValueError, msg.set_tx, 0, b'\x01\x02', 3)
+
+    def test_set_tx_huge_offset(self):
+        msg = spidev.SpiMessage([{'tx': bytes(bytearray(4))}])
+        self.assertRaises(ValueError, msg.set_tx, 0, b'\x01', sys.maxsize)
+        self.assertRaises(ValueError, msg.set_tx, 0, b'\x01', -1)
+
+
+if __name__ == '__main__':
+    unittest.main()